@@ -1,16 +1,275 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "../src/lab.h"
 
+/**
+ * @brief Run one simple command, either as a builtin or in a child process
+ *
+ * @param sh The shell
+ * @param argv The command to run
+ * @param redirs Its redirections, NULL for none
+ * @return The exit status of the command
+ */
+static int run_command(struct shell *sh, char **argv, const struct sh_redir *redirs)
+{
+  if (sh_run_builtin(sh, argv, redirs)) return sh->status;
+
+  struct sh_spawn_attr attr = SH_SPAWN_ATTR_INIT;
+  attr.redirs = redirs;
+  pid_t pid = redirs ? sh_spawn_with_attr(sh, argv, &attr) : sh_spawn(sh, argv);
+  if (pid < 0) return 127;
+
+  // Wait for the child to finish
+  int status = sh_wait(sh, pid);
+  if (status < 0) return 1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * @brief Start one simple command in the background. Builtins change the
+ * shell itself, so they still run in the foreground.
+ *
+ * @param sh The shell
+ * @param argv The command to run
+ * @param redirs Its redirections, NULL for none
+ * @return 0 if the command started, 127 if it could not
+ */
+static int run_background(struct shell *sh, char **argv, const struct sh_redir *redirs)
+{
+  if (sh_run_builtin(sh, argv, redirs)) return 0;
+
+  struct sh_spawn_attr attr = SH_SPAWN_ATTR_INIT;
+  attr.redirs = redirs;
+  return sh_run_background_with_attr(sh, argv, redirs ? &attr : NULL) ? 0 : 127;
+}
+
+/**
+ * @brief Copy the redirections of a command into list, ended by
+ * SH_REDIR_END
+ *
+ * @param ast The parsed line
+ * @param cmd The command node
+ * @param list Room for every redirection and the end
+ * @return The number of entries used, the end included
+ */
+static size_t collect_redirs(const struct sh_ast *ast, uint32_t cmd, struct sh_redir *list)
+{
+  size_t n = 0;
+  for (uint32_t r = sh_ast_child(ast, cmd); r != SH_NODE_NONE; r = sh_ast_next(ast, r))
+  {
+    list[n++] = sh_ast_redir(ast, r);
+  }
+  list[n++] = (struct sh_redir){SH_REDIR_END, 0, NULL, 0};
+  return n;
+}
+
+/**
+ * @brief Run one pipeline of a parsed line. A single command runs like any
+ * other, so builtins still change the shell itself.
+ *
+ * @param sh The shell
+ * @param ast The parsed line
+ * @param p The pipeline node
+ * @param background Whether it was followed by &
+ * @return Its exit status
+ */
+static int run_pipeline(struct shell *sh, const struct sh_ast *ast, uint32_t p, bool background)
+{
+  uint32_t first = sh_ast_child(ast, p);
+  size_t n = 0;
+  size_t nredirs = 0;
+  for (uint32_t c = first; c != SH_NODE_NONE; c = sh_ast_next(ast, c))
+  {
+    n++;
+    for (uint32_t r = sh_ast_child(ast, c); r != SH_NODE_NONE; r = sh_ast_next(ast, r)) nredirs++;
+  }
+
+  // Most commands have no redirections and allocate nothing for them
+  struct sh_redir *list = NULL;
+  const struct sh_redir **redirs = NULL;
+  if (nredirs)
+  {
+    list = sh_alloc(sh->alloc, (nredirs + n) * sizeof(*list));
+    redirs = sh_alloc(sh->alloc, n * sizeof(*redirs));
+    if (list == NULL || redirs == NULL)
+    {
+      perror("malloc");
+      sh_free(sh->alloc, list);
+      sh_free(sh->alloc, redirs);
+      return 1;
+    }
+    size_t used = 0;
+    size_t i = 0;
+    for (uint32_t c = first; c != SH_NODE_NONE; c = sh_ast_next(ast, c))
+    {
+      redirs[i++] = list + used;
+      used += collect_redirs(ast, c, list + used);
+    }
+  }
+
+  int status;
+  if (n == 1)
+  {
+    char **argv = sh_ast_argv(ast, first);
+    const struct sh_redir *r = redirs ? redirs[0] : NULL;
+    status = background ? run_background(sh, argv, r) : run_command(sh, argv, r);
+  }
+  else
+  {
+    char ***argvs = sh_alloc(sh->alloc, n * sizeof(*argvs));
+    if (argvs == NULL)
+    {
+      perror("malloc");
+      status = 1;
+    }
+    else
+    {
+      n = 0;
+      for (uint32_t c = first; c != SH_NODE_NONE; c = sh_ast_next(ast, c)) argvs[n++] = sh_ast_argv(ast, c);
+      struct sh_pipeline_attr attr = SH_PIPELINE_ATTR_INIT;
+      attr.redirs = redirs;
+      attr.background = background;
+      attr.pipe_size = sh_ast_pipe_size(ast, p);
+      status = sh_run_pipeline(sh, argvs, n, &attr);
+      sh_free(sh->alloc, argvs);
+    }
+  }
+
+  sh_free(sh->alloc, list);
+  sh_free(sh->alloc, redirs);
+  return status;
+}
+
+/**
+ * @brief Walk a parsed line and run its pipelines, honoring ;, &, && and ||
+ *
+ * @param sh The shell
+ * @param ast The parsed line
+ * @return The exit status of the last pipeline that ran
+ */
+static int run_line(struct shell *sh, const struct sh_ast *ast)
+{
+  int status = 0;
+  enum sh_list_op prev = SH_OP_SEQ;
+
+  for (uint32_t p = sh_ast_first(ast); p != SH_NODE_NONE; p = sh_ast_next(ast, p))
+  {
+    // && and || skip a pipeline based on the status of the last one that ran
+    bool skip = (prev == SH_OP_AND && status != 0) || (prev == SH_OP_OR && status == 0);
+    prev = sh_ast_op(ast, p);
+    if (skip) continue;
+
+    status = run_pipeline(sh, ast, p, prev == SH_OP_BG);
+  }
+
+  return status;
+}
+
+// Bytes of per-line memory before it spills to the heap
+#define LINE_ARENA_SIZE (64 * 1024)
+
+// Readline's line handler takes no context, so it finds the shell here
+static struct shell *line_shell;
+// What each line allocates, emptied once it has run
+static struct sh_arena line_arena;
+static bool input_done;
+// True while readline shows the prompt, false while a line runs
+static bool at_prompt;
+
+/**
+ * @brief Report finished jobs as soon as they finish (set -b). At the
+ * prompt the notices go on their own lines and the prompt and whatever was
+ * typed so far are drawn again below them.
+ *
+ * @param sh The shell
+ */
+static void job_notify(struct shell *sh)
+{
+  if (!at_prompt)
+  {
+    sh_jobs_notify(sh);
+    return;
+  }
+
+  rl_crlf();
+  sh_jobs_notify(sh);
+  rl_on_new_line();
+  rl_redisplay();
+}
+
+/**
+ * @brief Handle one line from readline: trim it, record it and run it
+ *
+ * @param line The line, or NULL at end of input
+ */
+static void on_line(char *line)
+{
+  if (line == NULL)
+  {
+    input_done = true;
+    rl_callback_handler_remove();
+    return;
+  }
+
+  at_prompt = false;
+  trim_white(line);
+
+  if (*line)
+  {
+    add_history(line);
+
+    // Repeated lines reuse the tree parsed the first time, and without a
+    // cache every line is parsed on its own
+    if (line_shell->cache)
+    {
+      const struct sh_ast *ast = sh_cache_parse(line_shell->cache, line);
+      if (ast)
+      {
+        run_line(line_shell, ast);
+        sh_cache_release(line_shell->cache, ast);
+      }
+    }
+    else
+    {
+      struct sh_ast *ast = sh_parse_with(line_shell->alloc, line);
+      if (ast)
+      {
+        run_line(line_shell, ast);
+        sh_ast_free_with(line_shell->alloc, ast);
+      }
+    }
+  }
+
+  free(line);
+  if (line_shell->alloc) sh_arena_reset(&line_arena);
+
+  // Report background jobs that finished before the next prompt
+  sh_jobs_notify(line_shell);
+
+  // Fork the next spare while the user types
+  if (line_shell->prefork) sh_prefork_arm(line_shell->prefork);
+  at_prompt = true;
+}
+
+static void on_input(void *ctx)
+{
+  UNUSED(ctx);
+  rl_callback_read_char();
+}
+
 int main(int argc, char *argv[])
 {
-  struct shell sh;
+  struct shell sh = {0};
 
   // Pre-main loop setup
   sh_init(&sh);
+  if (sh_arena_init(&line_arena, LINE_ARENA_SIZE)) sh.alloc = &line_arena.allocator;
   parse_args(argc, argv);
   using_history();
 
@@ -21,53 +280,25 @@ int main(int argc, char *argv[])
     return 1;
   }
 
-  char *line;
-  while ((line = readline(prompt)))
+  // The terminal is one more source in the shell's event loop, next to
+  // running children and timers
+  line_shell = &sh;
+  sh.job_notify = job_notify;
+  if (sh.prefork) sh_prefork_arm(sh.prefork);
+  rl_callback_handler_install(prompt, on_line);
+  at_prompt = true;
+  int input = fileno(rl_instream ? rl_instream : stdin);
+  if (sh.loop && sh_loop_watch_fd(sh.loop, input, on_input, NULL))
   {
-    trim_white(line);
-
-    if (line && *line)
-    {
-      char **argv = cmd_parse(line);
-
-      if (!do_builtin(&sh, argv))
-      {
-        pid_t pid = fork();
-        if (pid < 0)
-        {
-          perror("fork");
-        }
-        else if (pid == 0)
-        {
-          // Child process: reset signals to default behavior
-          signal(SIGINT, SIG_DFL);
-          signal(SIGQUIT, SIG_DFL);
-          signal(SIGTSTP, SIG_DFL);
-          signal(SIGTTIN, SIG_DFL);
-          signal(SIGTTOU, SIG_DFL);
-
-          // Execute the external command
-          execvp(argv[0], argv);
-          // If execvp fails
-          perror("execvp");
-          exit(EXIT_FAILURE);
-        }
-        else
-        {
-          // Parent process: wait for the child to finish
-          int status;
-          waitpid(pid, &status, 0);
-        }
-      }
-
-      // Clean up
-      cmd_free(argv);
-      add_history(line);
-    }
-
-    free(line);
+    while (!input_done && sh_loop_run_once(sh.loop, -1) >= 0)
+      ;
+  }
+  else
+  {
+    while (!input_done) rl_callback_read_char();
   }
 
   sh_destroy(&sh);
+  sh_arena_destroy(&line_arena);
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "../src/lab.h"
+
+// How long each benchmark is timed for
+#define BENCH_TARGET_NS 2e8
+
+// Allocations made through the shell's allocator hook
+struct counting
+{
+  size_t allocs;
+  size_t bytes;
+};
+
+static struct counting counts;
+
+static void *counting_alloc(void *ctx, size_t size)
+{
+  struct counting *c = ctx;
+  c->allocs++;
+  c->bytes += size;
+  return malloc(size);
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+  UNUSED(ctx);
+  free(ptr);
+}
+
+static const struct sh_allocator counting = {counting_alloc, counting_free, &counts};
+
+// State shared by the benchmark bodies
+static struct shell sh;
+static char *scratch;
+static char **scratch_argv;
+static size_t scratch_len;
+
+// One benchmark: a body run once per op on its input
+typedef struct
+{
+  const char *name;
+  void (*op)(const void *input);
+} bench_fn;
+
+// An input and what it looks like
+typedef struct
+{
+  const char *shape;
+  const void *input;
+  size_t bytes; // length of the input line, 0 if it is not a line
+} bench_input;
+
+typedef struct
+{
+  double ns_per_op;
+  double allocs_per_op;
+  double bytes_per_op;
+  size_t iters;
+} bench_result;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Bodies that modify their line work on a fresh copy, like a readline buffer
+static char *fresh_copy(const char *line)
+{
+  memcpy(scratch, line, strlen(line) + 1);
+  return scratch;
+}
+
+static void op_cmd_parse(const void *input)
+{
+  cmd_free_with(&counting, cmd_parse_with(&counting, input));
+}
+
+static void op_cmd_tokenize(const void *input)
+{
+  cmd_tokenize(fresh_copy(input), scratch_argv, scratch_len);
+}
+
+static void op_cmd_lex_inplace(const void *input)
+{
+  cmd_lex_inplace(fresh_copy(input), scratch_argv, scratch_len);
+}
+
+static void op_sh_parse(const void *input)
+{
+  sh_ast_free_with(&counting, sh_parse_with(&counting, input));
+}
+
+static void op_sh_cache_parse(const void *input)
+{
+  sh_cache_release(sh.cache, sh_cache_parse(sh.cache, input));
+}
+
+static void op_trim_white(const void *input)
+{
+  trim_white(fresh_copy(input));
+}
+
+static void op_do_builtin(const void *input)
+{
+  do_builtin(&sh, (char **)input);
+}
+
+// A command with redirections, as sh_run_builtin takes it
+struct redirected
+{
+  char **argv;
+  const struct sh_redir *redirs;
+};
+
+// Every fork() the process makes, counted by a pthread_atfork handler
+static size_t forks;
+
+static void count_fork(void)
+{
+  forks++;
+}
+
+static void op_run_builtin(const void *input)
+{
+  const struct redirected *r = input;
+  sh_run_builtin(&sh, r->argv, r->redirs);
+}
+
+static void op_get_prompt(const void *input)
+{
+  char *prompt = get_prompt_with(&counting, input);
+  counting.free(counting.ctx, prompt);
+}
+
+static void op_path_lookup_hit(const void *input)
+{
+  sh_path_lookup(sh.paths, input);
+}
+
+// Drop the entry first so every lookup walks PATH
+static void op_path_lookup_miss(const void *input)
+{
+  sh_path_forget(sh.paths, input);
+  sh_path_lookup(sh.paths, input);
+}
+
+// Start a command with one spawn backend and wait for it
+static void spawn_wait(enum sh_spawn_backend backend, const void *input)
+{
+  sh.spawn = backend;
+  pid_t pid = sh_spawn(&sh, (char *const *)input);
+  if (pid > 0) sh_wait(&sh, pid);
+}
+
+static void op_spawn_posix(const void *input)
+{
+  spawn_wait(SH_SPAWN_POSIX, input);
+}
+
+static void op_spawn_vfork(const void *input)
+{
+  spawn_wait(SH_SPAWN_VFORK, input);
+}
+
+static void op_spawn_fork(const void *input)
+{
+  spawn_wait(SH_SPAWN_FORK, input);
+}
+
+static void op_spawn_server(const void *input)
+{
+  spawn_wait(SH_SPAWN_SERVER, input);
+}
+
+// Run a two-stage pipeline the way the shell runs one typed at the prompt
+static void op_pipeline(const void *input)
+{
+  sh_run_pipeline(&sh, input, 2, NULL);
+}
+
+// The same with 1 MiB pipes, as pipesize 1m would ask for
+static void op_pipeline_1m(const void *input)
+{
+  struct sh_pipeline_attr attr = SH_PIPELINE_ATTR_INIT;
+  attr.pipe_size = (size_t)1 << 20;
+  sh_run_pipeline(&sh, input, 2, &attr);
+}
+
+// Builtins joined by | run on threads and talk through rings
+static void op_pipeline_builtins(const void *input)
+{
+  sh_run_pipeline(&sh, input, 3, NULL);
+}
+
+// The same with every builtin forked and joined by pipes, as before
+static void op_pipeline_builtins_fork(const void *input)
+{
+  sh.fork_builtins = true;
+  sh_run_pipeline(&sh, input, 3, NULL);
+  sh.fork_builtins = false;
+}
+
+// The same pipeline run by bash, for comparison
+static void op_pipeline_bash(const void *input)
+{
+  spawn_wait(SH_SPAWN_POSIX, input);
+}
+
+/**
+ * Run op until it has been timed for BENCH_TARGET_NS and report the cost of
+ * one op.
+ */
+static bench_result bench_run(const bench_fn *fn, const void *input)
+{
+  // Warm up and find an iteration count that takes long enough to time
+  size_t iters = 1;
+  for (;;)
+  {
+    double start = now_ns();
+    for (size_t i = 0; i < iters; i++) fn->op(input);
+    double elapsed = now_ns() - start;
+    if (elapsed > BENCH_TARGET_NS / 10)
+    {
+      iters = (size_t)(iters * (BENCH_TARGET_NS / elapsed)) + 1;
+      break;
+    }
+    iters *= 2;
+  }
+
+  counts = (struct counting){0};
+  double start = now_ns();
+  for (size_t i = 0; i < iters; i++) fn->op(input);
+  double elapsed = now_ns() - start;
+
+  return (bench_result){
+      .ns_per_op = elapsed / iters,
+      .allocs_per_op = (double)counts.allocs / iters,
+      .bytes_per_op = (double)counts.bytes / iters,
+      .iters = iters,
+  };
+}
+
+static void report(FILE *out, bool json, const bench_fn *fn, const bench_input *in, const bench_result *r)
+{
+  double ns_per_byte = in->bytes ? r->ns_per_op / in->bytes : 0.0;
+  if (json)
+  {
+    fprintf(out,
+            "{\"bench\":\"%s\",\"shape\":\"%s\",\"input_bytes\":%zu,\"iterations\":%zu,"
+            "\"ns_per_op\":%.2f,\"ns_per_byte\":%.4f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n",
+            fn->name, in->shape, in->bytes, r->iters, r->ns_per_op, ns_per_byte,
+            r->allocs_per_op, r->bytes_per_op);
+  }
+  else
+  {
+    fprintf(out, "%-22s %-10s %7zu %12.1f %9.3f %10.2f %10.1f\n", fn->name, in->shape, in->bytes,
+            r->ns_per_op, ns_per_byte, r->allocs_per_op, r->bytes_per_op);
+  }
+  fflush(out);
+}
+
+// Build a line of count arguments, each wrapped in quote when not NULL
+static char *make_args(const char *cmd, size_t count, const char *quote)
+{
+  size_t cap = strlen(cmd) + count * 24 + 1;
+  char *line = malloc(cap);
+  size_t len = (size_t)sprintf(line, "%s", cmd);
+  for (size_t i = 0; i < count; i++)
+  {
+    const char *q = quote ? quote : "";
+    len += (size_t)sprintf(line + len, " %s--option-%zu%s", q, i, q);
+  }
+  return line;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [--json] [filter]\n", prog);
+  fprintf(stderr, "  --json  print one JSON object per result\n");
+  fprintf(stderr, "  filter  only run benchmarks whose name contains filter\n");
+}
+
+int main(int argc, char *argv[])
+{
+  bool json = false;
+  const char *filter = NULL;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--json") == 0) json = true;
+    else if (argv[i][0] == '-')
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    else filter = argv[i];
+  }
+
+  // Results go to the real stdout, anything the builtins print is dropped
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  int devnull = open("/dev/null", O_WRONLY);
+  if (!out || devnull < 0)
+  {
+    perror("bench setup");
+    return 1;
+  }
+  fflush(stdout);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  sh.alloc = &counting;
+  sh_init(&sh);
+
+  // Start the fork server now, while the process is small, like sh_init does
+  if (!sh.server) sh.server = sh_forkserver_start(NULL, sh.loop);
+
+  char *long_line = make_args("printf '%s\\n'", 400, NULL);
+  char *quoted_line = make_args("echo", 400, "\"");
+  bench_input lines[] = {
+      {"short", "ls -la", 0},
+      {"typical", "grep -rn --color=auto TODO src/ include/ tests/", 0},
+      {"padded", " \t  make   -j8\t all   check  \t ", 0},
+      {"list", "make && ./run --fast || echo failed; ls -l", 0},
+      {"long", long_line, 0},
+      {"quoted", quoted_line, 0},
+  };
+  size_t nlines = sizeof(lines) / sizeof(lines[0]);
+
+  // Scratch space that fits the longest line
+  size_t max_len = 0;
+  for (size_t i = 0; i < nlines; i++)
+  {
+    lines[i].bytes = strlen(lines[i].input);
+    if (lines[i].bytes > max_len) max_len = lines[i].bytes;
+  }
+  scratch = malloc(max_len + 1);
+  scratch_len = CMD_ARGV_BOUND(max_len);
+  scratch_argv = malloc(scratch_len * sizeof(char *));
+
+  const bench_fn line_fns[] = {
+      {"cmd_parse", op_cmd_parse},
+      {"cmd_tokenize", op_cmd_tokenize},
+      {"cmd_lex_inplace", op_cmd_lex_inplace},
+      {"sh_parse", op_sh_parse},
+      {"sh_cache_parse", op_sh_cache_parse},
+      {"trim_white", op_trim_white},
+  };
+
+  // do_builtin: a dispatch miss and a few cheap builtins
+  char **miss = cmd_parse("grep -n foo");
+  char **cd = cmd_parse("cd .");
+  char **pwd = cmd_parse("pwd");
+  char **stats = cmd_parse("stats");
+  const bench_fn builtin_fn = {"do_builtin", op_do_builtin};
+  const bench_input builtins[] = {
+      {"miss", miss, 0},
+      {"cd", cd, 0},
+      {"pwd", pwd, 0},
+      {"stats", stats, 0},
+  };
+
+  // sh_run_builtin: a builtin that takes > as its stream, and one that
+  // has its stdout and stderr installed and put back. Neither may fork.
+  const struct sh_redir end = {SH_REDIR_END, 0, NULL, 0};
+  const struct sh_redir to_null[] = {{SH_REDIR_OUT, 1, "/dev/null", -1}, end};
+  const struct sh_redir all_to_null[] = {{SH_REDIR_OUT, 1, "/dev/null", -1}, {SH_REDIR_DUP, 2, NULL, 1}, end};
+  const struct redirected pwd_to_null = {pwd, to_null};
+  const struct redirected cd_to_null = {cd, all_to_null};
+  const bench_fn redirect_fn = {"run_builtin", op_run_builtin};
+  const bench_input redirected[] = {
+      {"pwd>null", &pwd_to_null, 0},
+      {"cd&>null", &cd_to_null, 0},
+  };
+  pthread_atfork(NULL, count_fork, NULL);
+
+  // get_prompt: the default and a prompt from the environment
+  setenv("BENCH_PROMPT", "bench[\\u@\\h]$ ", 1);
+  const bench_fn prompt_fn = {"get_prompt", op_get_prompt};
+  const bench_input prompts[] = {
+      {"default", "BENCH_UNSET_PROMPT", 0},
+      {"env", "BENCH_PROMPT", 0},
+  };
+
+  // sh_path_lookup: a cached command and a full PATH search, early and late in PATH
+  const bench_fn path_fns[] = {
+      {"path_lookup_hit", op_path_lookup_hit},
+      {"path_lookup_miss", op_path_lookup_miss},
+  };
+  const bench_input commands[] = {
+      {"ls", "ls", 0},
+      {"not-found", "no-such-command", 0},
+  };
+
+  // sh_spawn: launch latency of each backend as the shell's RSS grows
+  char *true_argv[] = {"true", NULL};
+  const bench_fn spawn_fns[] = {
+      {"spawn_posix", op_spawn_posix},
+      {"spawn_vfork", op_spawn_vfork},
+      {"spawn_fork", op_spawn_fork},
+      {"spawn_server", op_spawn_server},
+  };
+  const struct
+  {
+    bench_input in;
+    size_t rss;
+  } spawn_sizes[] = {
+      {{"rss-small", true_argv, 0}, 0},
+      {{"rss-256M", true_argv, 0}, (size_t)256 << 20},
+  };
+
+  // sh_run_pipeline: throughput of yes | head -c with the default pipe and
+  // with 1 MiB pipes, against bash running it. ns/B is the cost of each
+  // byte moved through the pipe. pwd | pwd | pwd is all builtins, run on
+  // threads and then forked.
+  char *yes_argv[] = {"yes", NULL};
+  char *head_argv[] = {"head", "-c", "67108864", NULL};
+  char **const yes_head[] = {yes_argv, head_argv};
+  char *bash_argv[] = {"bash", "-c", "yes | head -c 67108864", NULL};
+  char *pwd_argv[] = {"pwd", NULL};
+  char **const pwd_pwd[] = {pwd_argv, pwd_argv, pwd_argv};
+  const bench_fn pipe_fns[] = {
+      {"pipeline", op_pipeline},
+      {"pipeline_1m", op_pipeline_1m},
+      {"pipeline_bash", op_pipeline_bash},
+      {"pipeline_builtins", op_pipeline_builtins},
+      {"pipeline_builtins_fork", op_pipeline_builtins_fork},
+  };
+  const bench_input pipes[] = {
+      {"yes-head", yes_head, (size_t)64 << 20},
+      {"yes-head", yes_head, (size_t)64 << 20},
+      {"yes-head", bash_argv, (size_t)64 << 20},
+      {"pwd-pwd", pwd_pwd, 0},
+      {"pwd-pwd", pwd_pwd, 0},
+  };
+
+  if (!json)
+  {
+    fprintf(out, "scanner: %s\n", (const char *[]){"scalar", "sse2", "avx2"}[scan_get_isa()]);
+    fprintf(out, "%-22s %-10s %7s %12s %9s %10s %10s\n", "bench", "shape", "bytes", "ns/op", "ns/B",
+            "allocs/op", "bytes/op");
+  }
+
+  for (size_t f = 0; f < sizeof(line_fns) / sizeof(line_fns[0]); f++)
+  {
+    if (filter && !strstr(line_fns[f].name, filter)) continue;
+    for (size_t i = 0; i < nlines; i++)
+    {
+      bench_result r = bench_run(&line_fns[f], lines[i].input);
+      report(out, json, &line_fns[f], &lines[i], &r);
+    }
+  }
+
+  if (!filter || strstr(builtin_fn.name, filter))
+  {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+      bench_result r = bench_run(&builtin_fn, builtins[i].input);
+      report(out, json, &builtin_fn, &builtins[i], &r);
+    }
+  }
+
+  if (!filter || strstr(redirect_fn.name, filter))
+  {
+    for (size_t i = 0; i < sizeof(redirected) / sizeof(redirected[0]); i++)
+    {
+      size_t before = forks;
+      bench_result r = bench_run(&redirect_fn, redirected[i].input);
+      report(out, json, &redirect_fn, &redirected[i], &r);
+      if (forks != before)
+      {
+        fprintf(stderr, "run_builtin %s forked %zu times\n", redirected[i].shape, forks - before);
+        return 1;
+      }
+    }
+  }
+
+  if (!filter || strstr(prompt_fn.name, filter))
+  {
+    for (size_t i = 0; i < sizeof(prompts) / sizeof(prompts[0]); i++)
+    {
+      bench_result r = bench_run(&prompt_fn, prompts[i].input);
+      report(out, json, &prompt_fn, &prompts[i], &r);
+    }
+  }
+
+  for (size_t f = 0; f < sizeof(path_fns) / sizeof(path_fns[0]); f++)
+  {
+    if (filter && !strstr(path_fns[f].name, filter)) continue;
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+      bench_result r = bench_run(&path_fns[f], commands[i].input);
+      report(out, json, &path_fns[f], &commands[i], &r);
+    }
+  }
+
+  bool spawn_wanted = false;
+  for (size_t f = 0; f < sizeof(spawn_fns) / sizeof(spawn_fns[0]); f++)
+  {
+    if (!filter || strstr(spawn_fns[f].name, filter)) spawn_wanted = true;
+  }
+  for (size_t i = 0; spawn_wanted && i < sizeof(spawn_sizes) / sizeof(spawn_sizes[0]); i++)
+  {
+    // Touch every page so the memory is resident and must be mapped by fork
+    char *ballast = NULL;
+    if (spawn_sizes[i].rss)
+    {
+      ballast = malloc(spawn_sizes[i].rss);
+      if (!ballast) continue;
+      memset(ballast, 1, spawn_sizes[i].rss);
+    }
+
+    for (size_t f = 0; f < sizeof(spawn_fns) / sizeof(spawn_fns[0]); f++)
+    {
+      if (filter && !strstr(spawn_fns[f].name, filter)) continue;
+      bench_result r = bench_run(&spawn_fns[f], spawn_sizes[i].in.input);
+      report(out, json, &spawn_fns[f], &spawn_sizes[i].in, &r);
+    }
+    free(ballast);
+  }
+  sh.spawn = SH_SPAWN_AUTO;
+
+  for (size_t f = 0; f < sizeof(pipe_fns) / sizeof(pipe_fns[0]); f++)
+  {
+    if (filter && !strstr(pipe_fns[f].name, filter)) continue;
+    bench_result r = bench_run(&pipe_fns[f], pipes[f].input);
+    report(out, json, &pipe_fns[f], &pipes[f], &r);
+  }
+  sh.spawn = SH_SPAWN_AUTO;
+
+  cmd_free(miss);
+  cmd_free(cd);
+  cmd_free(pwd);
+  cmd_free(stats);
+  free(scratch_argv);
+  free(scratch);
+  free(long_line);
+  free(quoted_line);
+  sh_destroy(&sh);
+  fclose(out);
+  return 0;
+}
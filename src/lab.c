@@ -1,37 +1,81 @@
+#define _GNU_SOURCE
 #include "lab.h"
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <limits.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
 // Function prototypes for built-in commands
 static bool handle_exit(struct shell *sh, char **argv);
 static bool handle_cd(struct shell *sh, char **argv);
 static bool handle_ls(struct shell *sh, char **argv);
 static bool handle_history(struct shell *sh, char **argv);
 static bool handle_pwd(struct shell *sh, char **argv);
+static bool handle_stats(struct shell *sh, char **argv);
+static bool handle_hash(struct shell *sh, char **argv);
+static bool handle_jobs(struct shell *sh, char **argv);
+static bool handle_fg(struct shell *sh, char **argv);
+static bool handle_bg(struct shell *sh, char **argv);
+static bool handle_wait(struct shell *sh, char **argv);
+static bool handle_set(struct shell *sh, char **argv);
 
 // Define structures for built-in commands
 typedef struct
 {
     const char *name;
     bool (*func)(struct shell *sh, char **argv);
+    bool threads; // only reads the shell and prints to sh->out, so a
+                  // pipeline can run it on a thread, see pipeline_thread
 } builtin_command;
 
 static const builtin_command builtins[] = {
-    {"exit", handle_exit},
-    {"cd", handle_cd},
-    {"ls", handle_ls},
-    {"history", handle_history},
-    {"pwd", handle_pwd}
+    {"exit", handle_exit, false},
+    {"cd", handle_cd, false},
+    {"ls", handle_ls, false},
+    {"history", handle_history, true},
+    {"pwd", handle_pwd, true},
+    {"stats", handle_stats, true},
+    {"hash", handle_hash, false},
+    {"jobs", handle_jobs, false},
+    {"fg", handle_fg, false},
+    {"bg", handle_bg, false},
+    {"wait", handle_wait, false},
+    {"set", handle_set, false}
 };
 
 static const size_t num_builtins = sizeof(builtins) / sizeof(builtins[0]);
 
+// Where a builtin prints its output
+static FILE *builtin_out(const struct shell *sh)
+{
+    return sh->out ? sh->out : stdout;
+}
+
 /**
  * @brief Handle the 'exit' command. This function will exit the shell.
  *
@@ -56,13 +100,14 @@ static bool handle_exit(struct shell *sh, char **argv)
  */
 static bool handle_cd(struct shell *sh, char **argv)
 {
-    UNUSED(sh);
     const char *dir = argv[1];
 
     // On no 
     if (dir == NULL || strcmp(dir, "~") == 0) dir = getenv("HOME");
     // Error handling
     if (chdir(dir) != 0) perror("cd");
+    // The spare still has the old working directory
+    else sh_prefork_discard(sh->prefork);
 
     return true;
 }
@@ -76,35 +121,9 @@ static bool handle_cd(struct shell *sh, char **argv)
  */
 static bool handle_ls(struct shell *sh, char **argv)
 {
-    UNUSED(sh);
-
-    pid_t pid = fork();
-    if (pid < 0)
-    {
-        perror("fork");
-        return true; // For argument handling
-    }
-    else if (pid == 0)
-    {
-        // Child process: reset signals to default behavior
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGTTIN, SIG_DFL);
-        signal(SIGTTOU, SIG_DFL);
-
-        // Child process: execute 'ls' command
-        execvp("ls", argv);
-        // Error if execvp fails
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    }
-    else
-    {
-        // Parent process: wait for child to finish
-        int status;
-        waitpid(pid, &status, 0);
-    }
+    // Run the real 'ls' with the arguments we were given
+    pid_t pid = sh_spawn(sh, argv);
+    if (pid > 0) sh_wait(sh, pid);
 
     return true;
 }
@@ -118,18 +137,18 @@ static bool handle_ls(struct shell *sh, char **argv)
  */
 static bool handle_history(struct shell *sh, char **argv)
 {
-    UNUSED(sh);
     UNUSED(argv);
+    FILE *out = builtin_out(sh);
 
     // Get the history list
     HIST_ENTRY **history = history_list();
     if (history)
     {
-        for (int i = 0; history[i]; i++) printf("%d: %s\n", i + history_base, history[i]->line);
+        for (int i = 0; history[i]; i++) fprintf(out, "%d: %s\n", i + history_base, history[i]->line);
     }
     else
     {
-        printf("No history available.\n");
+        fprintf(out, "No history available.\n");
     }
 
     return true;
@@ -144,7 +163,6 @@ static bool handle_history(struct shell *sh, char **argv)
  */
 static bool handle_pwd(struct shell *sh, char **argv)
 {
-    UNUSED(sh);
     UNUSED(argv);
 
     // Buffer to store the current working directory
@@ -154,7 +172,7 @@ static bool handle_pwd(struct shell *sh, char **argv)
     if (getcwd(cwd, sizeof(cwd)) != NULL)
     {
         // Print the current working directory
-        printf("%s\n", cwd);
+        fprintf(builtin_out(sh), "%s\n", cwd);
     }
     else
     {
@@ -166,202 +184,6446 @@ static bool handle_pwd(struct shell *sh, char **argv)
 }
 
 /**
- * @brief Get the shell prompt. This function will attempt to load a prompt
- * from the requested environment variable, if the environment variable is
- * not set a default prompt of "shell>" is returned.  This function calls
- * malloc internally and the caller must free the resulting string.
+ * @brief Handle the 'stats' command. This function will print the shell's
+ * performance counters.
  *
- * @param env The environment variable
- * @return const char* The prompt
+ * @param sh The shell
+ * @param argv The command arguments
+ * @return True since 'stats' is a built-in command
  */
-char *get_prompt(const char *env)
+static bool handle_stats(struct shell *sh, char **argv)
 {
-    const char *prompt_env = getenv(env);
+    UNUSED(argv);
+    FILE *out = builtin_out(sh);
 
-    // Use default if no prompt set
-    const char *default_prompt = "shell>";
-    const char *prompt = (prompt_env && strlen(prompt_env) > 0) ? prompt_env : default_prompt;
+    if (sh->cache)
+    {
+        struct sh_cache_stats cs = sh_cache_get_stats(sh->cache);
+        size_t lookups = cs.hits + cs.misses;
+        double rate = lookups ? 100.0 * cs.hits / lookups : 0.0;
+        fprintf(out, "parse cache: %zu hits, %zu misses (%.1f%% hit rate), %zu entries, %zu evictions\n",
+                cs.hits, cs.misses, rate, cs.entries, cs.evictions);
+    }
 
-    // Allocate memory
-    char *prompt_copy = (char *)malloc(strlen(prompt) + 1); // +1 for null terminator
-    if (!prompt_copy)
+    if (sh->paths)
     {
-        perror("Failed to allocate memory for the prompt");
-        return NULL;
+        struct sh_path_stats ps = sh_path_get_stats(sh->paths);
+        fprintf(out, "command lookups: %zu hits, %zu misses, %zu entries, %zu invalidations, %zu dropped\n",
+                ps.hits, ps.misses, ps.entries, ps.invalidations, ps.dropped);
+        fprintf(out, "exec fast path: %zu launches from a cached fd, %zu binaries opened, %zu evicted\n",
+                ps.fd_launches, ps.fd_opens, ps.fd_evictions);
     }
 
-    // Copy into allocated memory
-    strcpy(prompt_copy, prompt);
+    if (sh->prefork)
+    {
+        struct sh_prefork_stats fs = sh_prefork_get_stats(sh->prefork);
+        fprintf(out, "prefork: %zu launches from a spare, %zu spares forked, %zu discarded\n", fs.launches,
+                fs.spares, fs.discards);
+    }
 
-    return prompt_copy;
+    if (sh->jobs)
+    {
+        struct sh_jobs_stats js = sh_jobs_get_stats(sh->jobs);
+        fprintf(out, "jobs: %zu in the table, %zu started, %zu reaped in %zu batches (at most %zu at once)\n",
+                sh_jobs_count(sh->jobs), js.started, js.reaped, js.batches, js.max_batch);
+    }
+
+    struct sh_pipe_stats pipes = sh->pipe_stats;
+    fprintf(out, "pipes: %zu created, %zu resized, %zu resizes refused, last one %zu bytes\n", pipes.pipes,
+            pipes.resized, pipes.refused, pipes.last);
+    fprintf(out, "builtin stages: %zu on threads, %zu rings between them\n", pipes.threads, pipes.rings);
+
+    return true;
 }
 
+// Defined with the command lookup cache
+static void path_list(struct sh_path_cache *cache, bool reusable, FILE *out);
+static const char *path_cached(struct sh_path_cache *cache, const char *name);
+static struct path_entry *path_resolve(struct sh_path_cache *cache, const char *name, bool *found);
+
 /**
- * Changes the current working directory of the shell. Uses the linux system
- * call chdir. With no arguments the users home directory is used as the
- * directory to change to.
+ * @brief Handle the 'hash' command, which works like the bash builtin:
+ * with no names it lists the cached commands, 'hash name' looks name up
+ * again, -p path gives a name a path without searching, -d drops names,
+ * -t prints their paths, -r empties the cache and -l lists it as
+ * commands that rebuild it.
  *
- * @param dir The directory to change to
- * @return  On success, zero is returned.  On error, -1 is returned, and
- * errno is set to indicate the error.
+ * @param sh The shell
+ * @param argv The command arguments
+ * @return True since 'hash' is a built-in command
  */
-int change_dir(char **dir)
+static bool handle_hash(struct shell *sh, char **argv)
 {
-    struct shell sh;
-    handle_cd(&sh, dir); //Passed to handle_cd to make the test suite happy
-    return 0;
+    struct sh_path_cache *cache = sh->paths;
+    if (cache == NULL)
+    {
+        fprintf(stderr, "hash: hashing disabled\n");
+        return true;
+    }
+
+    bool clear = false, forget = false, show = false, reusable = false;
+    const char *path = NULL;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+
+        for (const char *f = argv[i] + 1; *f; f++)
+        {
+            if (*f == 'r') clear = true;
+            else if (*f == 'd') forget = true;
+            else if (*f == 't') show = true;
+            else if (*f == 'l') reusable = true;
+            else if (*f == 'p')
+            {
+                // The path is the rest of this word or the next one
+                path = f[1] ? f + 1 : argv[++i];
+                if (path == NULL)
+                {
+                    fprintf(stderr, "hash: -p: option requires an argument\n");
+                    return true;
+                }
+                break;
+            }
+            else
+            {
+                fprintf(stderr, "hash: -%c: invalid option\n", *f);
+                fprintf(stderr, "hash: usage: hash [-lr] [-p pathname] [-dt] [name ...]\n");
+                return true;
+            }
+        }
+    }
+
+    if (clear) sh_path_clear(cache);
+    if (argv[i] == NULL)
+    {
+        if (!clear) path_list(cache, reusable, builtin_out(sh));
+        return true;
+    }
+
+    // -t prints names too when it is given more than one
+    bool many = argv[i + 1] != NULL;
+    for (; argv[i]; i++)
+    {
+        const char *name = argv[i];
+        if (path) sh_path_add(cache, name, path);
+        else if (forget)
+        {
+            if (!sh_path_forget(cache, name)) fprintf(stderr, "hash: %s: not found\n", name);
+        }
+        else if (show)
+        {
+            const char *cached = path_cached(cache, name);
+            if (cached == NULL) fprintf(stderr, "hash: %s: not found\n", name);
+            else if (many) fprintf(builtin_out(sh), "%s\t%s\n", name, cached);
+            else fprintf(builtin_out(sh), "%s\n", cached);
+        }
+        else if (!strchr(name, '/'))
+        {
+            bool found;
+            path_resolve(cache, name, &found);
+            if (!found) fprintf(stderr, "hash: %s: not found\n", name);
+        }
+    }
+
+    return true;
 }
 
+// Defined with the job table
+static void job_refresh(struct sh_job *job);
+static void job_state(const struct sh_job *job, char *buf, size_t size);
+static int job_exit_code(int status);
+static struct sh_job *job_lookup(struct sh_jobs *jobs, const char *builtin, const char *id);
+static struct sh_job *jobs_wait_any(struct shell *sh, char **ids);
+static bool terminal_give(pid_t pgid);
+
 /**
- * @brief Convert line read from the user into to format that will work with
- * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
- * This function allocates memory that must be reclaimed with the cmd_free
- * function.
- *
- * @param line The line to process
+ * @brief Handle the 'jobs' command. This function will list the background
+ * jobs with their state, marking the current job with + and the previous
+ * one with -. -l adds pids and -p prints only pids. Finished jobs are
+ * removed once listed.
  *
- * @return The line read in a format suitable for exec
+ * @param sh The shell
+ * @param argv The command arguments (optionally job specs to list)
+ * @return True since 'jobs' is a built-in command
  */
-char **cmd_parse(char const *line)
+static bool handle_jobs(struct shell *sh, char **argv)
 {
-    if (line == NULL) return NULL;
+    bool pids = false, only_pids = false;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        for (const char *f = argv[i] + 1; *f; f++)
+        {
+            if (*f == 'l') pids = true;
+            else if (*f == 'p') only_pids = true;
+            else
+            {
+                fprintf(stderr, "jobs: -%c: invalid option\n", *f);
+                fprintf(stderr, "jobs: usage: jobs [-lp] [jobspec ...]\n");
+                sh->status = 2;
+                return true;
+            }
+        }
+    }
 
-    // Get the maximum number of arguments
-    long arg_max = sysconf(_SC_ARG_MAX);
-    if (arg_max == -1) arg_max = 4096;
+    struct sh_jobs *jobs = sh->jobs;
+    if (jobs == NULL) return true;
 
-    // Allocate memory for argument list (limit to ARG_MAX)
-    char **argv = malloc((arg_max + 1) * sizeof(char *));
-    if (!argv)
+    FILE *out = builtin_out(sh);
+
+    const struct sh_job *current = sh_job_parse(jobs, "%+");
+    const struct sh_job *previous = sh_job_parse(jobs, "%-");
+    bool all = argv[i] == NULL;
+    struct sh_job *job = all ? sh_job_next(jobs, NULL) : NULL;
+    while (all ? job != NULL : argv[i] != NULL)
     {
-        perror("malloc");
-        return NULL;
+        struct sh_job *next = NULL;
+        if (all) next = sh_job_next(jobs, job);
+        else if ((job = sh_job_parse(jobs, argv[i++])) == NULL)
+        {
+            fprintf(stderr, "jobs: %s: no such job\n", argv[i - 1]);
+            sh->status = 1;
+            continue;
+        }
+
+        if (only_pids)
+        {
+            fprintf(out, "%d\n", (int)job->pid);
+        }
+        else
+        {
+            char state[32];
+            char mark = job == current ? '+' : job == previous ? '-' : ' ';
+            job_refresh(job);
+            job_state(job, state, sizeof(state));
+            const char *amp = job->done || job->stopped ? "" : " &";
+            if (pids) fprintf(out, "[%d]%c %d %-24s%s%s\n", job->id, mark, (int)job->pid, state, job->command, amp);
+            else fprintf(out, "[%d]%c  %-24s%s%s\n", job->id, mark, state, job->command, amp);
+
+            // A finished job has been reported now
+            if (job->done) sh_job_remove(jobs, job);
+        }
+        job = next;
     }
 
-    // Tokenize the input line
-    char *line_copy = strdup(line);
-    if (!line_copy)
+    return true;
+}
+
+/**
+ * @brief Handle the 'fg' command. This function will continue a job (the
+ * current one by default) and wait for it in the foreground.
+ *
+ * @param sh The shell
+ * @param argv The command arguments (argv[1] is the job spec)
+ * @return True since 'fg' is a built-in command
+ */
+static bool handle_fg(struct shell *sh, char **argv)
+{
+    struct sh_job *job = sh->jobs ? sh_job_parse(sh->jobs, argv[1] ? argv[1] : "%+") : NULL;
+    if (job == NULL)
     {
-        perror("strdup");
-        free(argv);
-        return NULL;
+        fprintf(stderr, "fg: %s: no such job\n", argv[1] ? argv[1] : "current");
+        sh->status = 1;
+        return true;
     }
 
-    int argc = 0;
-    char *token = strtok(line_copy, " \t\n");
-    while (token != NULL && argc < arg_max)
+    if (job->done)
     {
-        argv[argc++] = strdup(token);
-        token = strtok(NULL, " \t\n");
+        fprintf(stderr, "fg: job has terminated\n");
+    }
+    else
+    {
+        FILE *out = builtin_out(sh);
+        fprintf(out, "%s\n", job->command);
+        fflush(out);
+        bool tty = job->pgid > 0 && terminal_give(job->pgid);
+        if (kill(job->pgid > 0 ? -job->pgid : job->pid, SIGCONT) < 0) perror("fg");
+        job->stopped = false;
+        sh_jobs_wait(sh, job);
+        if (tty) terminal_give(getpgrp());
     }
 
-    argv[argc] = NULL;
-    free(line_copy);
-
-    return argv;
+    sh->status = job->done ? job_exit_code(job->status) : 1;
+    if (job->done) sh_job_remove(sh->jobs, job);
+    return true;
 }
 
 /**
- * @brief Free the line that was constructed with cmd_parse
+ * @brief Handle the 'bg' command. This function will continue stopped
+ * jobs (the current one by default) in the background.
  *
- * @param line the line to free
+ * @param sh The shell
+ * @param argv The command arguments (job specs)
+ * @return True since 'bg' is a built-in command
  */
-void cmd_free(char **line)
+static bool handle_bg(struct shell *sh, char **argv)
 {
-    if (line == NULL) return;
+    char *current[] = {"%+", NULL};
+    char **specs = argv[1] ? argv + 1 : current;
+    for (; *specs; specs++)
+    {
+        struct sh_job *job = sh->jobs ? sh_job_parse(sh->jobs, *specs) : NULL;
+        if (job == NULL)
+        {
+            fprintf(stderr, "bg: %s: no such job\n", argv[1] ? *specs : "current");
+            sh->status = 1;
+            continue;
+        }
 
-    // Free each argument string
-    for (int i = 0; line[i] != NULL; i++) free(line[i]);
+        job_refresh(job);
+        if (job->done)
+        {
+            fprintf(stderr, "bg: job has terminated\n");
+            sh->status = 1;
+        }
+        else if (!job->stopped)
+        {
+            fprintf(stderr, "bg: job %d already in background\n", job->id);
+        }
+        else if (kill(job->pgid > 0 ? -job->pgid : job->pid, SIGCONT) < 0)
+        {
+            perror("bg");
+            sh->status = 1;
+        }
+        else
+        {
+            job->stopped = false;
+            fprintf(builtin_out(sh), "[%d] %s &\n", job->id, job->command);
+        }
+    }
 
-    free(line); // Free the argument list itself
+    return true;
 }
 
 /**
- * @brief Trim the whitespace from the start and end of a string.
- * For example "   ls -a   " becomes "ls -a". This function modifies
- * the argument line so that all printable chars are moved to the
- * front of the string
+ * @brief Handle the 'wait' command, which works like the bash builtin:
+ * with no ids it waits for every job, with ids (pids or job specs) for
+ * each of them, and with -n for the first one to finish. The status is
+ * the exit status of the last job waited for, which is then removed.
  *
- * @param line The line to trim
- * @return The new line with no whitespace
+ * @param sh The shell
+ * @param argv The command arguments
+ * @return True since 'wait' is a built-in command
  */
-char *trim_white(char *line)
+static bool handle_wait(struct shell *sh, char **argv)
 {
-    // Check for NULL input
-    if (line == NULL) return NULL;
+    bool next = false;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0)
+        {
+            next = true;
+            continue;
+        }
+        fprintf(stderr, "wait: %s: invalid option\n", argv[i]);
+        fprintf(stderr, "wait: usage: wait [-n] [id ...]\n");
+        sh->status = 2;
+        return true;
+    }
 
-    // Trim leading whitespace
-    char *start = line;
-    while (isspace((unsigned char)*start))
+    struct sh_jobs *jobs = sh->jobs;
+    if (jobs == NULL)
     {
-        start++;
+        if (next || argv[i]) sh->status = 127;
+        return true;
     }
 
-    // Trim trailing whitespace
-    char *end = line + strlen(line) - 1;
-    while (end > start && isspace((unsigned char)*end))
+    if (next)
+    {
+        // The first job to finish, without looking at the others
+        struct sh_job *job = argv[i] ? jobs_wait_any(sh, argv + i) : sh_jobs_wait(sh, NULL);
+        if (job == NULL)
+        {
+            sh->status = 127;
+            return true;
+        }
+        sh->status = job_exit_code(job->status);
+        sh_job_remove(jobs, job);
+        return true;
+    }
+
+    if (argv[i] == NULL)
     {
-        end--;
+        // Finished jobs are still reported afterwards, like in bash
+        for (struct sh_job *job = sh_job_next(jobs, NULL); job; job = sh_job_next(jobs, job))
+            sh_jobs_wait(sh, job);
+        return true;
     }
 
-    // Null terminate trimmed string
-    *(end + 1) = '\0';
+    for (; argv[i]; i++)
+    {
+        struct sh_job *job = job_lookup(jobs, "wait", argv[i]);
+        if (job == NULL)
+        {
+            sh->status = 127;
+            continue;
+        }
+        sh->status = sh_jobs_wait(sh, job) ? job_exit_code(job->status) : 127;
+        if (job->done) sh_job_remove(jobs, job);
+    }
 
-    // Move the trimmed string to the start of the original line
-    if (start != line)
+    return true;
+}
+
+// List the shell options, as set commands that restore them if reusable
+static void set_list(const struct shell *sh, bool reusable)
+{
+    FILE *out = builtin_out(sh);
+    if (reusable)
     {
-        memmove(line, start, end - start + 2); // +2 to include null terminator
+        fprintf(out, "set %cb\n", sh->notify ? '-' : '+');
+        if (sh->pipe_size) fprintf(out, "set -o pipesize=%zu\n", sh->pipe_size);
+        else fprintf(out, "set +o pipesize\n");
+        return;
     }
 
-    return line; 
+    fprintf(out, "notify\t%s\n", sh->notify ? "on" : "off");
+    if (sh->pipe_size) fprintf(out, "pipesize\t%zu\n", sh->pipe_size);
+    else fprintf(out, "pipesize\tdefault\n");
 }
 
 /**
- * @brief Takes an argument list and checks if the first argument is a
- * built in command such as exit, cd, jobs, etc. If the command is a
- * built in command this function will handle the command and then return
- * true. If the first argument is NOT a built in command this function will
- * return false.
+ * @brief Handle the 'set' command. Only shell options are supported:
+ * -b (or -o notify) reports finished background jobs right away instead of
+ * before the next prompt, +b turns that off, -o pipesize=SIZE sets the
+ * size of pipeline pipes (+o pipesize goes back to the kernel's), and -o
+ * lists the options.
  *
  * @param sh The shell
- * @param argv The command to check
- * @return True if the command was a built in command
+ * @param argv The command arguments
+ * @return True since 'set' is a built-in command
  */
-bool do_builtin(struct shell *sh, char **argv)
+static bool handle_set(struct shell *sh, char **argv)
 {
-    if (argv == NULL || argv[0] == NULL) return false;
+    if (argv[1] == NULL)
+    {
+        set_list(sh, false);
+        return true;
+    }
 
-    for (size_t i = 0; i < num_builtins; i++)
+    for (int i = 1; argv[i]; i++)
     {
-        if (strcmp(argv[0], builtins[i].name) == 0)
+        const char *arg = argv[i];
+        bool on = arg[0] == '-';
+        if ((arg[0] != '-' && arg[0] != '+') || arg[1] == '\0')
         {
-            return builtins[i].func(sh, argv); // Execute the built-in command
+            fprintf(stderr, "set: %s: invalid option\n", arg);
+            sh->status = 2;
+            return true;
+        }
+
+        if (strcmp(arg + 1, "o") == 0)
+        {
+            const char *name = argv[i + 1];
+            if (name == NULL)
+            {
+                set_list(sh, !on);
+                continue;
+            }
+            i++;
+
+            size_t size = 0;
+            if (strcmp(name, "notify") == 0)
+            {
+                sh->notify = on;
+            }
+            else if (!on && strcmp(name, "pipesize") == 0)
+            {
+                sh->pipe_size = 0;
+            }
+            else if (on && strncmp(name, "pipesize=", 9) == 0 && sh_pipe_size_parse(name + 9, &size))
+            {
+                sh->pipe_size = size;
+            }
+            else
+            {
+                fprintf(stderr, "set: %s: invalid option name\n", name);
+                sh->status = 2;
+                return true;
+            }
+            continue;
+        }
+
+        for (const char *f = arg + 1; *f; f++)
+        {
+            if (*f != 'b')
+            {
+                fprintf(stderr, "set: %c%c: invalid option\n", arg[0], *f);
+                fprintf(stderr, "set: usage: set [-b] [+b] [-o notify] [+o notify] [-o pipesize=SIZE] "
+                                "[+o pipesize]\n");
+                sh->status = 2;
+                return true;
+            }
+            sh->notify = on;
         }
     }
 
-    return false; // Command is not a built-in
+    return true;
+}
+
+/*
+ * Allocators. Everything the shell allocates goes through a struct
+ * sh_allocator so callers can swap the heap for an arena, a pool or a
+ * counting allocator.
+ */
+
+static void *malloc_alloc(void *ctx, size_t size)
+{
+    UNUSED(ctx);
+    return malloc(size);
+}
+
+static void malloc_free(void *ctx, void *ptr)
+{
+    UNUSED(ctx);
+    free(ptr);
 }
 
+const struct sh_allocator sh_malloc_allocator = {malloc_alloc, malloc_free, NULL};
+
 /**
- * @brief Initialize the shell for use. Allocate all data structures
- * Grab control of the terminal and put the shell in its own
- * process group. NOTE: This function will block until the shell is
- * in its own program group. Attaching a debugger will always cause
- * this function to fail because the debugger maintains control of
- * the subprocess it is debugging.
+ * @brief Allocate through a, or the heap if a is NULL
  *
- * @param sh
+ * @param a The allocator
+ * @param size The number of bytes
+ * @return The memory, or NULL if it ran out
  */
-void sh_init(struct shell *sh)
+void *sh_alloc(const struct sh_allocator *a, size_t size)
 {
-    // Ignore signals in the parent process (shell)
-    signal(SIGINT, SIG_IGN);  // Ignore Ctrl+C (SIGINT)
-    signal(SIGQUIT, SIG_IGN); // Ignore Ctrl+\ (SIGQUIT)
-    signal(SIGTSTP, SIG_IGN); // Ignore Ctrl+Z (SIGTSTP)
-    signal(SIGTTIN, SIG_IGN); // Ignore SIGTTIN (background input)
-    signal(SIGTTOU, SIG_IGN); // Ignore SIGTTOU (background output)
+    if (a == NULL) a = &sh_malloc_allocator;
+    return a->alloc(a->ctx, size);
+}
 
-    sh->prompt = get_prompt("MY_PROMPT");
+/**
+ * @brief Free through a, or the heap if a is NULL
+ *
+ * @param a The allocator the memory came from
+ * @param ptr The memory, or NULL
+ */
+void sh_free(const struct sh_allocator *a, void *ptr)
+{
+    if (ptr == NULL) return;
+    if (a == NULL) a = &sh_malloc_allocator;
+    a->free(a->ctx, ptr);
+}
+
+// Alignment of arena allocations
+#define ARENA_ALIGN 16
+
+// Goes in front of every heap block of a full arena, so reset can find it
+struct sh_arena_block
+{
+    struct sh_arena_block *next;
+    struct sh_arena_block *prev;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+    struct sh_arena *arena = ctx;
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start > arena->size || size > arena->size - start)
+    {
+        // Full: overflow to the heap instead of failing
+        if (size > SIZE_MAX - sizeof(struct sh_arena_block)) return NULL;
+        struct sh_arena_block *b = malloc(sizeof(*b) + size);
+        if (!b) return NULL;
+        arena->overflows++;
+        b->prev = NULL;
+        b->next = arena->overflow;
+        if (b->next) b->next->prev = b;
+        arena->overflow = b;
+        return b + 1;
+    }
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+    struct sh_arena *arena = ctx;
+
+    // Arena memory comes back all at once on reset, heap blocks right away
+    if ((char *)ptr >= arena->base && (char *)ptr < arena->base + arena->size) return;
+
+    struct sh_arena_block *b = (struct sh_arena_block *)ptr - 1;
+    if (b->prev) b->prev->next = b->next;
+    else arena->overflow = b->next;
+    if (b->next) b->next->prev = b->prev;
+    free(b);
+}
+
+/**
+ * @brief Set up a bump arena of the given size
+ *
+ * @param arena The arena
+ * @param size The number of bytes it hands out before overflowing to the heap
+ * @return True on success
+ */
+bool sh_arena_init(struct sh_arena *arena, size_t size)
+{
+    arena->base = malloc(size);
+    arena->size = arena->base ? size : 0;
+    arena->used = 0;
+    arena->overflows = 0;
+    arena->overflow = NULL;
+    arena->allocator = (struct sh_allocator){arena_alloc, arena_free, arena};
+    if (!arena->base) perror("malloc");
+    return arena->base != NULL;
+}
+
+/**
+ * @brief Release everything allocated from the arena at once, heap blocks
+ * it overflowed to included
+ *
+ * @param arena The arena
+ */
+void sh_arena_reset(struct sh_arena *arena)
+{
+    for (struct sh_arena_block *b = arena->overflow, *next; b; b = next)
+    {
+        next = b->next;
+        free(b);
+    }
+    arena->overflow = NULL;
+    arena->used = 0;
+}
+
+/**
+ * @brief Free the memory behind an arena
+ *
+ * @param arena The arena
+ */
+void sh_arena_destroy(struct sh_arena *arena)
+{
+    sh_arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+/**
+ * @brief Get the shell prompt. This function will attempt to load a prompt
+ * from the requested environment variable, if the environment variable is
+ * not set a default prompt of "shell>" is returned.  This function calls
+ * malloc internally and the caller must free the resulting string.
+ *
+ * @param env The environment variable
+ * @return const char* The prompt
+ */
+char *get_prompt(const char *env)
+{
+    return get_prompt_with(NULL, env);
+}
+
+/**
+ * @brief Get the shell prompt like get_prompt, allocating it with a. The
+ * caller must free the resulting string with the same allocator.
+ *
+ * @param a The allocator, or NULL for the heap
+ * @param env The environment variable
+ * @return const char* The prompt
+ */
+char *get_prompt_with(const struct sh_allocator *a, const char *env)
+{
+    const char *prompt_env = getenv(env);
+
+    // Use default if no prompt set
+    const char *default_prompt = "shell>";
+    const char *prompt = (prompt_env && strlen(prompt_env) > 0) ? prompt_env : default_prompt;
+
+    // Allocate memory
+    char *prompt_copy = (char *)sh_alloc(a, strlen(prompt) + 1); // +1 for null terminator
+    if (!prompt_copy)
+    {
+        perror("Failed to allocate memory for the prompt");
+        return NULL;
+    }
+
+    // Copy into allocated memory
+    strcpy(prompt_copy, prompt);
+
+    return prompt_copy;
+}
+
+/**
+ * Changes the current working directory of the shell. Uses the linux system
+ * call chdir. With no arguments the users home directory is used as the
+ * directory to change to.
+ *
+ * @param dir The directory to change to
+ * @return  On success, zero is returned.  On error, -1 is returned, and
+ * errno is set to indicate the error.
+ */
+int change_dir(char **dir)
+{
+    struct shell sh = {0};
+    handle_cd(&sh, dir); //Passed to handle_cd to make the test suite happy
+    return 0;
+}
+
+/*
+ * Whitespace scanning. The tokenizers and trim_white spend nearly all of
+ * their time looking for the next delimiter, so the scanners below check
+ * 16 (SSE2) or 32 (AVX2) bytes per step. The best implementation the CPU
+ * supports is picked once at startup and can be overridden with
+ * scan_set_isa. The scalar versions are the reference behavior.
+ */
+
+// Character classes used by the scanners
+#define SCAN_DELIM 0x1 // Argument separators: space, tab and newline
+#define SCAN_SPACE 0x2 // isspace in the C locale
+
+static const unsigned char scan_class[256] = {
+    ['\t'] = SCAN_DELIM | SCAN_SPACE,
+    ['\n'] = SCAN_DELIM | SCAN_SPACE,
+    ['\v'] = SCAN_SPACE,
+    ['\f'] = SCAN_SPACE,
+    ['\r'] = SCAN_SPACE,
+    [' '] = SCAN_DELIM | SCAN_SPACE,
+};
+
+// Scanner entry points for one instruction set
+typedef struct
+{
+    size_t (*span)(const char *s, int cls);
+    size_t (*cspan)(const char *s, int cls);
+    const char *(*rskip)(const char *start, const char *end, int cls);
+} scan_ops;
+
+/**
+ * @brief Count the leading bytes of s that are in class cls.
+ */
+static size_t scalar_span(const char *s, int cls)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    while (scan_class[*p] & cls) p++;
+    return (const char *)p - s;
+}
+
+/**
+ * @brief Count the leading bytes of s that are neither in class cls nor the
+ * null terminator.
+ */
+static size_t scalar_cspan(const char *s, int cls)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    while (*p && !(scan_class[*p] & cls)) p++;
+    return (const char *)p - s;
+}
+
+/**
+ * @brief Walk backwards from end to the last byte not in class cls, stopping
+ * at start.
+ */
+static const char *scalar_rskip(const char *start, const char *end, int cls)
+{
+    while (end > start && (scan_class[(unsigned char)*end] & cls)) end--;
+    return end;
+}
+
+static const scan_ops scan_scalar = {scalar_span, scalar_cspan, scalar_rskip};
+
+#ifdef SCAN_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+// The aligned loads may read past the null terminator, but never into the
+// next page, so they are safe even though ASan cannot tell
+#define NO_ASAN __attribute__((no_sanitize_address))
+
+static inline SSE2 __m128i sse2_in_class(__m128i v, int cls)
+{
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                                          _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+    if (cls & SCAN_SPACE)
+    {
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\v')),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\f')),
+                                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))));
+    }
+    return m;
+}
+
+static NO_ASAN SSE2 size_t sse2_span(const char *s, int cls)
+{
+    size_t off = (uintptr_t)s & 15;
+    const char *p = s - off;
+    unsigned stop = ~_mm_movemask_epi8(sse2_in_class(_mm_load_si128((const __m128i *)p), cls)) & 0xffff;
+    stop >>= off;
+    if (stop) return __builtin_ctz(stop);
+
+    for (p += 16;; p += 16)
+    {
+        stop = ~_mm_movemask_epi8(sse2_in_class(_mm_load_si128((const __m128i *)p), cls)) & 0xffff;
+        if (stop) return p - s + __builtin_ctz(stop);
+    }
+}
+
+static NO_ASAN SSE2 size_t sse2_cspan(const char *s, int cls)
+{
+    size_t off = (uintptr_t)s & 15;
+    const char *p = s - off;
+    __m128i v = _mm_load_si128((const __m128i *)p);
+    unsigned stop = _mm_movemask_epi8(_mm_or_si128(sse2_in_class(v, cls), _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+    stop >>= off;
+    if (stop) return __builtin_ctz(stop);
+
+    for (p += 16;; p += 16)
+    {
+        v = _mm_load_si128((const __m128i *)p);
+        stop = _mm_movemask_epi8(_mm_or_si128(sse2_in_class(v, cls), _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+        if (stop) return p - s + __builtin_ctz(stop);
+    }
+}
+
+static SSE2 const char *sse2_rskip(const char *start, const char *end, int cls)
+{
+    // Unaligned loads that stay inside [start, end]
+    while (end - start >= 16)
+    {
+        const char *p = end - 15;
+        unsigned keep = ~_mm_movemask_epi8(sse2_in_class(_mm_loadu_si128((const __m128i *)p), cls)) & 0xffff;
+        if (keep) return p + (31 - __builtin_clz(keep));
+        end -= 16;
+    }
+    return scalar_rskip(start, end, cls);
+}
+
+static inline AVX2 __m256i avx2_in_class(__m256i v, int cls)
+{
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+                                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+    if (cls & SCAN_SPACE)
+    {
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\v')),
+                                               _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\f')),
+                                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')))));
+    }
+    return m;
+}
+
+static NO_ASAN AVX2 size_t avx2_span(const char *s, int cls)
+{
+    size_t off = (uintptr_t)s & 31;
+    const char *p = s - off;
+    uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(avx2_in_class(_mm256_load_si256((const __m256i *)p), cls));
+    stop >>= off;
+    if (stop) return __builtin_ctz(stop);
+
+    for (p += 32;; p += 32)
+    {
+        stop = ~(uint32_t)_mm256_movemask_epi8(avx2_in_class(_mm256_load_si256((const __m256i *)p), cls));
+        if (stop) return p - s + __builtin_ctz(stop);
+    }
+}
+
+static NO_ASAN AVX2 size_t avx2_cspan(const char *s, int cls)
+{
+    size_t off = (uintptr_t)s & 31;
+    const char *p = s - off;
+    __m256i v = _mm256_load_si256((const __m256i *)p);
+    uint32_t stop = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(avx2_in_class(v, cls), _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+    stop >>= off;
+    if (stop) return __builtin_ctz(stop);
+
+    for (p += 32;; p += 32)
+    {
+        v = _mm256_load_si256((const __m256i *)p);
+        stop = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(avx2_in_class(v, cls), _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+        if (stop) return p - s + __builtin_ctz(stop);
+    }
+}
+
+static AVX2 const char *avx2_rskip(const char *start, const char *end, int cls)
+{
+    while (end - start >= 32)
+    {
+        const char *p = end - 31;
+        uint32_t keep = ~(uint32_t)_mm256_movemask_epi8(avx2_in_class(_mm256_loadu_si256((const __m256i *)p), cls));
+        if (keep) return p + (31 - __builtin_clz(keep));
+        end -= 32;
+    }
+    return sse2_rskip(start, end, cls);
+}
+
+static const scan_ops scan_sse2 = {sse2_span, sse2_cspan, sse2_rskip};
+static const scan_ops scan_avx2 = {avx2_span, avx2_cspan, avx2_rskip};
+
+#endif
+
+// The scanners in use. Written once at startup and by scan_set_isa only.
+static const scan_ops *scan = &scan_scalar;
+static enum scan_isa scan_isa_current = SCAN_ISA_SCALAR;
+
+/**
+ * @brief Check if the running CPU can execute the given instruction set
+ *
+ * @param isa The instruction set
+ * @return True if it is supported
+ */
+bool scan_isa_supported(enum scan_isa isa)
+{
+    switch (isa)
+    {
+    case SCAN_ISA_SCALAR:
+        return true;
+#ifdef SCAN_X86
+    case SCAN_ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case SCAN_ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Select the instruction set used for whitespace scanning. This is
+ * not synchronized with running parsers and is meant for tests and
+ * benchmarks.
+ *
+ * @param isa The instruction set to use
+ * @return True on success, false if the CPU does not support isa
+ */
+bool scan_set_isa(enum scan_isa isa)
+{
+    if (!scan_isa_supported(isa)) return false;
+
+    switch (isa)
+    {
+#ifdef SCAN_X86
+    case SCAN_ISA_SSE2:
+        scan = &scan_sse2;
+        break;
+    case SCAN_ISA_AVX2:
+        scan = &scan_avx2;
+        break;
+#endif
+    default:
+        scan = &scan_scalar;
+        break;
+    }
+    scan_isa_current = isa;
+    return true;
+}
+
+/**
+ * @brief Get the instruction set currently used for whitespace scanning
+ *
+ * @return The instruction set
+ */
+enum scan_isa scan_get_isa(void)
+{
+    return scan_isa_current;
+}
+
+/**
+ * @brief Pick the best scanner for this CPU before main runs, so threads
+ * only ever read the dispatch pointer.
+ */
+__attribute__((constructor)) static void scan_init(void)
+{
+#ifdef SCAN_X86
+    // Constructors may run before the one that fills in the CPU model
+    __builtin_cpu_init();
+#endif
+    if (!scan_set_isa(SCAN_ISA_AVX2)) scan_set_isa(SCAN_ISA_SSE2);
+}
+
+/**
+ * @brief Convert line read from the user into to format that will work with
+ * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
+ * The argv array and every token are packed into a single allocation sized
+ * to the actual line, so the result must be reclaimed with cmd_free. The
+ * scanners keep no state between calls (unlike strtok), so the function is
+ * safe to call from several threads.
+ *
+ * @param line The line to process
+ *
+ * @return The line read in a format suitable for exec
+ */
+char **cmd_parse(char const *line)
+{
+    return cmd_parse_with(NULL, line);
+}
+
+/**
+ * @brief Convert a line like cmd_parse, allocating the result with a. It
+ * must be reclaimed with cmd_free_with and the same allocator.
+ *
+ * @param a The allocator, or NULL for the heap
+ * @param line The line to process
+ * @return The line read in a format suitable for exec
+ */
+char **cmd_parse_with(const struct sh_allocator *a, char const *line)
+{
+    if (line == NULL) return NULL;
+
+    // First pass: count the tokens and the bytes needed to hold them
+    size_t argc = 0;
+    size_t bytes = 0;
+    const char *p = line + scan->span(line, SCAN_DELIM);
+    while (*p)
+    {
+        size_t len = scan->cspan(p, SCAN_DELIM);
+        argc++;
+        bytes += len + 1; // +1 for null terminator
+        p += len;
+        p += scan->span(p, SCAN_DELIM);
+    }
+
+    // Only ask the kernel for ARG_MAX when the line could actually exceed it
+    if (argc > _POSIX_ARG_MAX)
+    {
+        long arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max == -1) arg_max = _POSIX_ARG_MAX;
+        if (argc > (size_t)arg_max) argc = (size_t)arg_max;
+    }
+
+    // One block: the NULL terminated argv followed by the token bytes
+    char **argv = sh_alloc(a, (argc + 1) * sizeof(char *) + bytes);
+    if (!argv)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    // Second pass: copy each token into the block behind argv
+    char *out = (char *)(argv + argc + 1);
+    p = line + scan->span(line, SCAN_DELIM);
+    for (size_t i = 0; i < argc; i++)
+    {
+        size_t len = scan->cspan(p, SCAN_DELIM);
+        memcpy(out, p, len);
+        out[len] = '\0';
+        argv[i] = out;
+        out += len + 1;
+        p += len;
+        p += scan->span(p, SCAN_DELIM);
+    }
+
+    argv[argc] = NULL;
+
+    return argv;
+}
+
+/**
+ * @brief Split a line in place into a format that will work with execvp
+ * without allocating. The delimiter following each token is overwritten
+ * with '\0' and argv points into line, so line must outlive argv. At most
+ * n - 1 tokens are stored and argv is always NULL terminated.
+ *
+ * @param line The line to split, modified in place
+ * @param argv Caller owned array to fill
+ * @param n The number of slots in argv
+ * @return The number of tokens in line. If this is >= n the line is left
+ * untouched and the caller should retry with a larger argv.
+ */
+size_t cmd_tokenize(char *line, char **argv, size_t n)
+{
+    if (line == NULL || argv == NULL || n == 0) return 0;
+
+    // Count first so a line that does not fit is never modified
+    size_t argc = 0;
+    char *p = line + scan->span(line, SCAN_DELIM);
+    while (*p)
+    {
+        argc++;
+        p += scan->cspan(p, SCAN_DELIM);
+        p += scan->span(p, SCAN_DELIM);
+    }
+
+    if (argc >= n)
+    {
+        argv[0] = NULL;
+        return argc;
+    }
+
+    p = line + scan->span(line, SCAN_DELIM);
+    for (size_t i = 0; i < argc; i++)
+    {
+        argv[i] = p;
+        p += scan->cspan(p, SCAN_DELIM);
+        if (*p) *p++ = '\0';
+        p += scan->span(p, SCAN_DELIM);
+    }
+
+    argv[argc] = NULL;
+
+    return argc;
+}
+
+/*
+ * Quote aware lexer. A deterministic automaton driven by two tables: every
+ * input byte is mapped to a class, and (state, class) gives the next state
+ * plus the actions to take. Each byte is looked at exactly once. There are
+ * two class tables: one that only knows about words, and one that also
+ * splits off the control operators (; & && | || < > >> <> &> >& <& n> n<)
+ * used by sh_parse.
+ */
+
+// Input classes
+enum
+{
+    LC_OTHER,  // anything without a special meaning
+    LC_END,    // null terminator
+    LC_BLANK,  // space, tab, newline
+    LC_SQUOTE, // '
+    LC_DQUOTE, // "
+    LC_BSLASH, // backslash
+    LC_HASH,   // #
+    LC_DIGIT,  // 0-9, may prefix a redirection
+    LC_SEMI,   // ;
+    LC_AMP,    // &
+    LC_PIPE,   // |
+    LC_LT,     // <
+    LC_GT,     // >
+    LC_COUNT
+};
+
+// Automaton states
+enum
+{
+    LS_BLANK,   // between tokens
+    LS_WORD,    // inside an unquoted part of a word
+    LS_DIGITS,  // inside a word that is all digits so far
+    LS_SQUOTE,  // inside '...'
+    LS_DQUOTE,  // inside "..."
+    LS_ESC,     // after a backslash outside quotes
+    LS_DQESC,   // after a backslash inside "..."
+    LS_COMMENT, // after a # that starts a word
+    LS_AMP,     // after &
+    LS_PIPE,    // after |
+    LS_LT,      // after <
+    LS_GT,      // after >
+    LS_DONE,
+    LS_ERROR,
+    LS_COUNT
+};
+
+// Actions, applied in this order
+#define LA_END 0x01    // terminate the token that is open
+#define LA_START 0x02  // begin a new token at the output position
+#define LA_OPER 0x04   // mark the current token as an operator
+#define LA_EMITBS 0x08 // emit a backslash that did not escape anything
+#define LA_EMIT 0x10   // emit the input byte
+#define LA_FINISH 0x20 // terminate the token after emitting
+
+typedef struct
+{
+    unsigned char next;
+    unsigned char act;
+} lex_edge;
+
+static const unsigned char lex_class_words[256] = {
+    ['\0'] = LC_END,
+    [' '] = LC_BLANK,
+    ['\t'] = LC_BLANK,
+    ['\n'] = LC_BLANK,
+    ['\''] = LC_SQUOTE,
+    ['"'] = LC_DQUOTE,
+    ['\\'] = LC_BSLASH,
+    ['#'] = LC_HASH,
+};
+
+static const unsigned char lex_class_shell[256] = {
+    ['\0'] = LC_END,
+    [' '] = LC_BLANK,
+    ['\t'] = LC_BLANK,
+    ['\n'] = LC_BLANK,
+    ['\''] = LC_SQUOTE,
+    ['"'] = LC_DQUOTE,
+    ['\\'] = LC_BSLASH,
+    ['#'] = LC_HASH,
+    ['0' ... '9'] = LC_DIGIT,
+    [';'] = LC_SEMI,
+    ['&'] = LC_AMP,
+    ['|'] = LC_PIPE,
+    ['<'] = LC_LT,
+    ['>'] = LC_GT,
+};
+
+// Every class goes to the same edge
+#define LEX_ALL(s, a) [0 ... LC_COUNT - 1] = {s, a}
+
+// A byte seen between tokens. With e = LA_END it also closes the token
+// that was open, which is how words and operators end.
+#define LEX_BOUNDARY(e)                                               \
+    [LC_OTHER] = {LS_WORD, (e) | LA_START | LA_EMIT},                 \
+    [LC_END] = {LS_DONE, (e)},                                        \
+    [LC_BLANK] = {LS_BLANK, (e)},                                     \
+    [LC_SQUOTE] = {LS_SQUOTE, (e) | LA_START},                        \
+    [LC_DQUOTE] = {LS_DQUOTE, (e) | LA_START},                        \
+    [LC_BSLASH] = {LS_ESC, (e) | LA_START},                           \
+    [LC_HASH] = {LS_COMMENT, (e)},                                    \
+    [LC_DIGIT] = {LS_DIGITS, (e) | LA_START | LA_EMIT},               \
+    [LC_SEMI] = {LS_BLANK, (e) | LA_START | LA_OPER | LA_EMIT | LA_FINISH}, \
+    [LC_AMP] = {LS_AMP, (e) | LA_START | LA_OPER | LA_EMIT},          \
+    [LC_PIPE] = {LS_PIPE, (e) | LA_START | LA_OPER | LA_EMIT},        \
+    [LC_LT] = {LS_LT, (e) | LA_START | LA_OPER | LA_EMIT},            \
+    [LC_GT] = {LS_GT, (e) | LA_START | LA_OPER | LA_EMIT}
+
+// Rows start from a default and override the bytes that differ
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+static const lex_edge lex_table[LS_COUNT][LC_COUNT] = {
+    [LS_BLANK] = {LEX_BOUNDARY(0)},
+    [LS_WORD] = {
+        LEX_BOUNDARY(LA_END),
+        [LC_OTHER] = {LS_WORD, LA_EMIT},
+        [LC_SQUOTE] = {LS_SQUOTE, 0},
+        [LC_DQUOTE] = {LS_DQUOTE, 0},
+        [LC_BSLASH] = {LS_ESC, 0},
+        [LC_HASH] = {LS_WORD, LA_EMIT},
+        [LC_DIGIT] = {LS_WORD, LA_EMIT},
+    },
+    [LS_DIGITS] = {
+        LEX_BOUNDARY(LA_END),
+        [LC_OTHER] = {LS_WORD, LA_EMIT},
+        [LC_SQUOTE] = {LS_SQUOTE, 0},
+        [LC_DQUOTE] = {LS_DQUOTE, 0},
+        [LC_BSLASH] = {LS_ESC, 0},
+        [LC_HASH] = {LS_WORD, LA_EMIT},
+        [LC_DIGIT] = {LS_DIGITS, LA_EMIT},
+        [LC_LT] = {LS_LT, LA_OPER | LA_EMIT},
+        [LC_GT] = {LS_GT, LA_OPER | LA_EMIT},
+    },
+    [LS_SQUOTE] = {
+        LEX_ALL(LS_SQUOTE, LA_EMIT),
+        [LC_END] = {LS_ERROR, 0},
+        [LC_SQUOTE] = {LS_WORD, 0},
+    },
+    [LS_DQUOTE] = {
+        LEX_ALL(LS_DQUOTE, LA_EMIT),
+        [LC_END] = {LS_ERROR, 0},
+        [LC_DQUOTE] = {LS_WORD, 0},
+        [LC_BSLASH] = {LS_DQESC, 0},
+    },
+    [LS_ESC] = {
+        LEX_ALL(LS_WORD, LA_EMIT),
+        [LC_END] = {LS_ERROR, 0},
+    },
+    [LS_DQESC] = {
+        LEX_ALL(LS_DQUOTE, LA_EMITBS | LA_EMIT),
+        [LC_END] = {LS_ERROR, 0},
+        [LC_DQUOTE] = {LS_DQUOTE, LA_EMIT},
+        [LC_BSLASH] = {LS_DQUOTE, LA_EMIT},
+    },
+    [LS_COMMENT] = {
+        LEX_ALL(LS_COMMENT, 0),
+        [LC_END] = {LS_DONE, 0},
+    },
+    [LS_AMP] = {
+        LEX_BOUNDARY(LA_END),
+        [LC_AMP] = {LS_BLANK, LA_EMIT | LA_FINISH},
+        [LC_GT] = {LS_BLANK, LA_EMIT | LA_FINISH},
+    },
+    [LS_PIPE] = {
+        LEX_BOUNDARY(LA_END),
+        [LC_PIPE] = {LS_BLANK, LA_EMIT | LA_FINISH},
+    },
+    [LS_LT] = {
+        LEX_BOUNDARY(LA_END),
+        [LC_GT] = {LS_BLANK, LA_EMIT | LA_FINISH},
+        [LC_AMP] = {LS_BLANK, LA_EMIT | LA_FINISH},
+    },
+    [LS_GT] = {
+        LEX_BOUNDARY(LA_END),
+        [LC_GT] = {LS_BLANK, LA_EMIT | LA_FINISH},
+        [LC_AMP] = {LS_BLANK, LA_EMIT | LA_FINISH},
+    },
+};
+#pragma GCC diagnostic pop
+
+/**
+ * @brief Run the lexer over in, writing the unquoted tokens to out. At most
+ * n - 1 token pointers are stored in argv, which is always NULL terminated.
+ * With the word class table the output is never longer than the input, so
+ * out may equal in. With the shell class table operators get their own
+ * terminators and out needs room for 2 * strlen(in) + 1 bytes.
+ *
+ * @param class The class table to use
+ * @param oper If not NULL, set to true for each stored token that is an
+ * operator and false otherwise
+ * @return The number of tokens, or -1 on an unterminated quote or escape
+ */
+static ssize_t lex_run(const unsigned char *class, const char *in, char *out,
+                       char **argv, bool *oper, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    size_t argc = 0;
+    unsigned state = LS_BLANK;
+
+    do
+    {
+        unsigned char c = *p++;
+        lex_edge e = lex_table[state][class[c]];
+        if (e.act & LA_END) *out++ = '\0';
+        if (e.act & LA_START)
+        {
+            if (argc + 1 < n)
+            {
+                argv[argc] = out;
+                if (oper) oper[argc] = false;
+            }
+            argc++;
+        }
+        if ((e.act & LA_OPER) && oper && argc < n) oper[argc - 1] = true;
+        if (e.act & LA_EMITBS) *out++ = '\\';
+        if (e.act & LA_EMIT) *out++ = (char)c;
+        if (e.act & LA_FINISH) *out++ = '\0';
+        state = e.next;
+    } while (state < LS_DONE);
+
+    if (state == LS_ERROR)
+    {
+        if (n > 0) argv[0] = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (n > 0) argv[argc < n ? argc : n - 1] = NULL;
+    return (ssize_t)argc;
+}
+
+/**
+ * @brief Lex a line with shell quoting rules into a format that will work
+ * with execvp. Single quotes preserve everything, double quotes allow \" and
+ * \\ escapes, a backslash outside quotes escapes the next character and a #
+ * at the start of a word comments out the rest of the line. The result uses
+ * the same single block layout as cmd_parse and is freed with cmd_free.
+ *
+ * @param line The line to process
+ * @return The argument list, or NULL with errno set to EINVAL if the line
+ * ends inside a quote or escape
+ */
+char **cmd_lex(char const *line)
+{
+    return cmd_lex_with(NULL, line);
+}
+
+/**
+ * @brief Lex a line like cmd_lex, allocating the result with a. It must be
+ * reclaimed with cmd_free_with and the same allocator.
+ *
+ * @param a The allocator, or NULL for the heap
+ * @param line The line to process
+ * @return The argument list, or NULL on a syntax error
+ */
+char **cmd_lex_with(const struct sh_allocator *a, char const *line)
+{
+    if (line == NULL) return NULL;
+
+    // Size for the worst case so the lexer can run in a single pass
+    size_t len = strlen(line);
+    size_t n = CMD_ARGV_BOUND(len);
+    char **argv = sh_alloc(a, n * sizeof(char *) + len + 1);
+    if (!argv)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    if (lex_run(lex_class_words, line, (char *)(argv + n), argv, NULL, n) < 0)
+    {
+        sh_free(a, argv);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return argv;
+}
+
+/**
+ * @brief Lex a line with the same rules as cmd_lex, but in place and without
+ * allocating. The unquoted tokens are written back over line and argv points
+ * into it. At most n - 1 tokens are stored; an argv of
+ * CMD_ARGV_BOUND(strlen(line)) slots always holds every token.
+ *
+ * @param line The line to lex, modified in place
+ * @param argv Caller owned array to fill
+ * @param n The number of slots in argv
+ * @return The number of tokens, or -1 with errno set to EINVAL if the line
+ * ends inside a quote or escape
+ */
+ssize_t cmd_lex_inplace(char *line, char **argv, size_t n)
+{
+    if (line == NULL || argv == NULL) return 0;
+    return lex_run(lex_class_words, line, line, argv, NULL, n);
+}
+
+/*
+ * Command line parser. The line is lexed with operators into scratch space,
+ * the tokens are checked against the grammar while counting what the tree
+ * needs, and then the tree is built in one exactly sized block:
+ *
+ *   struct sh_ast | words (char *) | next, child, arg (uint32_t) |
+ *   kind, op (uint8_t) | word bytes
+ *
+ * Nodes are numbered in the order they appear on the line and refer to each
+ * other by index, so the block has no internal structure to chase beyond
+ * the argv pointers.
+ */
+
+// Lines up to this long are lexed into scratch space on the stack
+#define PARSE_STACK_LEN 256
+
+// Tally of what a line needs, filled in by the checking pass
+typedef struct
+{
+    size_t pipelines;
+    size_t cmds;
+    size_t words;
+    size_t bytes;
+    size_t redirs;
+    size_t targets; // words naming a redirection's file
+} parse_size;
+
+/**
+ * @brief Map an operator token to how it joins two pipelines
+ *
+ * @return The list operator, or SH_OP_END if tok does not join pipelines
+ */
+static enum sh_list_op parse_list_op(const char *tok)
+{
+    if (strcmp(tok, ";") == 0) return SH_OP_SEQ;
+    if (strcmp(tok, "&&") == 0) return SH_OP_AND;
+    if (strcmp(tok, "||") == 0) return SH_OP_OR;
+    if (strcmp(tok, "&") == 0) return SH_OP_BG;
+    return SH_OP_END;
+}
+
+/**
+ * @brief Recognize "pipesize SIZE" at tok[i], in front of a pipeline
+ *
+ * @param size Set to the size for a valid prefix
+ * @return 1 for a prefix, 0 if tok[i] starts a command, -1 if SIZE is not
+ * a valid size
+ */
+static int parse_pipesize(char **tok, const bool *oper, size_t ntok, size_t i, uint32_t *size)
+{
+    if (strcmp(tok[i], "pipesize") != 0 || i + 1 >= ntok || oper[i + 1]) return 0;
+
+    size_t n;
+    if (!sh_pipe_size_parse(tok[i + 1], &n) || n > UINT32_MAX) return -1;
+    *size = (uint32_t)n;
+    return 1;
+}
+
+/**
+ * @brief Recognize a redirection operator: <, >, >>, <>, >& or <&, each
+ * optionally after the number of the fd it redirects, or &>
+ *
+ * @param fd Set to the fd redirected
+ * @param op Set to what is done to it
+ * @return 1 for a redirection, 2 for &> (> followed by 2>&1), 0 for any
+ * other operator, -1 for an fd other than 0, 1 or 2
+ */
+static int parse_redir(const char *tok, int *fd, enum sh_redir_op *op)
+{
+    if (strcmp(tok, "&>") == 0)
+    {
+        *fd = STDOUT_FILENO;
+        *op = SH_REDIR_OUT;
+        return 2;
+    }
+
+    const char *p = tok;
+    while (isdigit((unsigned char)*p)) p++;
+    if (*p == '<')
+    {
+        *fd = STDIN_FILENO;
+        *op = p[1] == '>' ? SH_REDIR_RDWR : p[1] == '&' ? SH_REDIR_DUP : SH_REDIR_IN;
+    }
+    else if (*p == '>')
+    {
+        *fd = STDOUT_FILENO;
+        *op = p[1] == '>' ? SH_REDIR_APPEND : p[1] == '&' ? SH_REDIR_DUP : SH_REDIR_OUT;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (p == tok) return 1;
+    if (p - tok > 1 || *tok > '2') return -1;
+    *fd = *tok - '0';
+    return 1;
+}
+
+// The fd a >& or <& copies: 0, 1 or 2, else -1
+static int parse_fd(const char *word)
+{
+    return word[0] >= '0' && word[0] <= '2' && word[1] == '\0' ? word[0] - '0' : -1;
+}
+
+/**
+ * @brief Check the tokens against the grammar and count what the tree
+ * needs.
+ *
+ * line := pipeline ((';' | '&' | '&&' | '||') pipeline)* [';' | '&']
+ * pipeline := ['pipesize' SIZE] command ('|' command)*
+ * command := (WORD | redirect)+
+ * redirect := ('<' | '>' | '>>' | '<>' | '>&' | '<&' | '&>') WORD
+ *
+ * @return True if the tokens form a valid line
+ */
+static bool parse_check(char **tok, const bool *oper, size_t ntok, parse_size *size)
+{
+    bool need_cmd = true;
+    bool piped = false; // the next command continues the current pipeline
+    bool sized = false; // a pipesize prefix waits for its pipeline
+    memset(size, 0, sizeof(*size));
+
+    for (size_t i = 0; i < ntok; i++)
+    {
+        int fd;
+        enum sh_redir_op rop;
+        int redir = oper[i] ? parse_redir(tok[i], &fd, &rop) : 0;
+        if (redir < 0)
+        {
+            fprintf(stderr, "%s: bad file descriptor\n", tok[i]);
+            return false;
+        }
+
+        if (!oper[i] && need_cmd && !piped && !sized)
+        {
+            uint32_t bytes;
+            int prefix = parse_pipesize(tok, oper, ntok, i, &bytes);
+            if (prefix < 0)
+            {
+                fprintf(stderr, "pipesize: %s: invalid size\n", tok[i + 1]);
+                return false;
+            }
+            if (prefix > 0)
+            {
+                sized = true;
+                i++;
+                continue;
+            }
+        }
+
+        if (!oper[i] || redir > 0)
+        {
+            if (need_cmd)
+            {
+                if (!piped) size->pipelines++;
+                size->cmds++;
+                need_cmd = false;
+                piped = false;
+                sized = false;
+            }
+            if (redir == 0)
+            {
+                size->words++;
+                size->bytes += strlen(tok[i]) + 1;
+                continue;
+            }
+
+            // A redirection takes the word after it
+            if (i + 1 == ntok)
+            {
+                fprintf(stderr, "syntax error: unexpected end of line\n");
+                return false;
+            }
+            if (oper[i + 1])
+            {
+                fprintf(stderr, "syntax error near unexpected token `%s'\n", tok[i + 1]);
+                return false;
+            }
+            i++;
+            if (rop == SH_REDIR_DUP && parse_fd(tok[i]) < 0)
+            {
+                fprintf(stderr, "%s: bad file descriptor\n", tok[i]);
+                return false;
+            }
+            size->redirs += (size_t)redir;
+            if (rop != SH_REDIR_DUP)
+            {
+                size->targets++;
+                size->bytes += strlen(tok[i]) + 1;
+            }
+            continue;
+        }
+
+        if (strcmp(tok[i], "|") == 0 && !need_cmd)
+        {
+            if (i + 1 == ntok)
+            {
+                fprintf(stderr, "syntax error: unexpected end of line\n");
+                return false;
+            }
+            need_cmd = true;
+            piped = true;
+            continue;
+        }
+
+        enum sh_list_op op = parse_list_op(tok[i]);
+        if (op == SH_OP_END || need_cmd)
+        {
+            fprintf(stderr, "syntax error near unexpected token `%s'\n", tok[i]);
+            return false;
+        }
+        need_cmd = true;
+
+        // A trailing ; or & ends the line, but && and || need a right side
+        if (i + 1 == ntok && op != SH_OP_SEQ && op != SH_OP_BG)
+        {
+            fprintf(stderr, "syntax error: unexpected end of line\n");
+            return false;
+        }
+    }
+
+    if (sized)
+    {
+        fprintf(stderr, "syntax error: unexpected end of line\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Add a redirection node to the end of cmd's list
+ *
+ * @param last The last redirection of cmd so far, updated
+ */
+static void parse_add_redir(struct sh_ast *ast, uint32_t *node, uint32_t cmd, uint32_t *last, enum sh_redir_op op,
+                            int fd, uint32_t arg)
+{
+    uint32_t r = (*node)++;
+    if (*last == SH_NODE_NONE) ast->child[cmd] = r;
+    else ast->next[*last] = r;
+    *last = r;
+    ast->kind[r] = SH_NODE_REDIR;
+    ast->op[r] = (uint8_t)op;
+    ast->next[r] = SH_NODE_NONE;
+    ast->child[r] = (uint32_t)fd;
+    ast->arg[r] = arg;
+}
+
+/**
+ * @brief Build the tree for tokens that passed parse_check into the block.
+ * The files of redirections go in words after every argv.
+ */
+static void parse_build(struct sh_ast *ast, char **tok, const bool *oper, size_t ntok, const parse_size *size)
+{
+    char *bytes = (char *)(ast->op + ast->nnodes);
+    uint32_t node = 0;
+    uint32_t word = 0;
+    uint32_t argv_words = (uint32_t)(size->words + size->cmds);
+    uint32_t target = argv_words;
+    uint32_t pipeline = SH_NODE_NONE;
+    uint32_t cmd = SH_NODE_NONE;
+    uint32_t redir = SH_NODE_NONE;
+    bool piped = false;
+    bool sized = false;
+    uint32_t pipe_size = 0;
+
+    for (size_t i = 0; i < ntok; i++)
+    {
+        int fd;
+        enum sh_redir_op rop;
+        int is_redir = oper[i] ? parse_redir(tok[i], &fd, &rop) : 0;
+        if (oper[i] && !is_redir)
+        {
+            // Close the command and remember how the pipeline continues
+            ast->words[word++] = NULL;
+            if (strcmp(tok[i], "|") == 0) piped = true;
+            else ast->op[pipeline] = (uint8_t)parse_list_op(tok[i]);
+            continue;
+        }
+
+        bool new_pipeline = pipeline == SH_NODE_NONE || ast->op[pipeline] != SH_OP_END;
+        if (!is_redir && new_pipeline && !sized && parse_pipesize(tok, oper, ntok, i, &pipe_size) > 0)
+        {
+            sized = true;
+            i++;
+            continue;
+        }
+        if (new_pipeline)
+        {
+            // First word of a new pipeline and its first command
+            if (pipeline != SH_NODE_NONE) ast->next[pipeline] = node;
+            pipeline = node++;
+            ast->kind[pipeline] = SH_NODE_PIPELINE;
+            ast->op[pipeline] = SH_OP_END;
+            ast->next[pipeline] = SH_NODE_NONE;
+            ast->child[pipeline] = node;
+            ast->arg[pipeline] = sized ? pipe_size : 0; // pipe size, unused otherwise
+            sized = false;
+        }
+        else if (piped)
+        {
+            // First word of the next command in the pipeline
+            ast->next[cmd] = node;
+        }
+
+        if (new_pipeline || piped)
+        {
+            cmd = node++;
+            ast->kind[cmd] = SH_NODE_CMD;
+            ast->op[cmd] = 0;
+            ast->next[cmd] = SH_NODE_NONE;
+            ast->child[cmd] = SH_NODE_NONE;
+            ast->arg[cmd] = word;
+            piped = false;
+            redir = SH_NODE_NONE;
+        }
+
+        if (is_redir)
+        {
+            i++;
+            if (rop == SH_REDIR_DUP)
+            {
+                parse_add_redir(ast, &node, cmd, &redir, rop, fd, (uint32_t)parse_fd(tok[i]));
+                continue;
+            }
+
+            size_t len = strlen(tok[i]) + 1;
+            memcpy(bytes, tok[i], len);
+            ast->words[target] = bytes;
+            bytes += len;
+            parse_add_redir(ast, &node, cmd, &redir, rop, fd, target++);
+
+            // &> is > followed by 2>&1
+            if (is_redir == 2) parse_add_redir(ast, &node, cmd, &redir, SH_REDIR_DUP, STDERR_FILENO, STDOUT_FILENO);
+            continue;
+        }
+
+        size_t len = strlen(tok[i]) + 1;
+        memcpy(bytes, tok[i], len);
+        ast->words[word++] = bytes;
+        bytes += len;
+    }
+
+    // A trailing ; or & closed the last command already
+    if (word < argv_words) ast->words[word++] = NULL;
+    if (pipeline != SH_NODE_NONE && ast->op[pipeline] == SH_OP_SEQ) ast->op[pipeline] = SH_OP_END;
+}
+
+/**
+ * @brief Parse a line into a tree that starts head bytes into its block, so
+ * callers can keep their own bookkeeping in front of it. head must keep
+ * pointer alignment.
+ *
+ * @return The tree, or NULL on a syntax error or if memory ran out
+ */
+static struct sh_ast *parse_line(const struct sh_allocator *a, const char *line, size_t head)
+{
+    // Scratch space for the lexer: operators may double the byte count
+    size_t len = strlen(line);
+    size_t n = len + 2;
+    char stack_out[2 * PARSE_STACK_LEN + 1];
+    char *stack_tok[PARSE_STACK_LEN + 2];
+    bool stack_oper[PARSE_STACK_LEN + 2];
+    char *out = stack_out;
+    char **tok = stack_tok;
+    bool *oper = stack_oper;
+    void *scratch = NULL;
+
+    if (len > PARSE_STACK_LEN)
+    {
+        scratch = sh_alloc(a, 2 * len + 1 + n * (sizeof(char *) + sizeof(bool)));
+        if (!scratch)
+        {
+            perror("malloc");
+            return NULL;
+        }
+        tok = scratch;
+        oper = (bool *)(tok + n);
+        out = (char *)(oper + n);
+    }
+
+    struct sh_ast *ast = NULL;
+    parse_size size;
+    ssize_t ntok = lex_run(lex_class_shell, line, out, tok, oper, n);
+    if (ntok < 0)
+    {
+        fprintf(stderr, "syntax error: unterminated quote or escape\n");
+    }
+    else if (!parse_check(tok, oper, (size_t)ntok, &size))
+    {
+        errno = EINVAL;
+    }
+    else
+    {
+        size_t nnodes = size.pipelines + size.cmds + size.redirs;
+        size_t nwords = size.words + size.cmds + size.targets; // NULL after each argv
+        char *block = sh_alloc(a, head + sizeof(*ast) + nwords * sizeof(char *) +
+                             nnodes * (3 * sizeof(uint32_t) + 2) + size.bytes);
+        if (block)
+        {
+            ast = (struct sh_ast *)(block + head);
+            ast->nnodes = (uint32_t)nnodes;
+            ast->nwords = (uint32_t)nwords;
+            ast->words = (char **)(ast + 1);
+            ast->next = (uint32_t *)(ast->words + nwords);
+            ast->child = ast->next + nnodes;
+            ast->arg = ast->child + nnodes;
+            ast->kind = (uint8_t *)(ast->arg + nnodes);
+            ast->op = ast->kind + nnodes;
+            parse_build(ast, tok, oper, (size_t)ntok, &size);
+        }
+        else
+        {
+            perror("malloc");
+        }
+    }
+
+    sh_free(a, scratch);
+    return ast;
+}
+
+/**
+ * @brief Parse a command line into a flat tree of pipelines and commands.
+ * The whole tree lives in one allocation that is freed with sh_ast_free.
+ * Words follow the quoting rules of cmd_lex. Syntax errors are reported on
+ * stderr.
+ *
+ * @param line The line to parse
+ * @return The tree, or NULL on a syntax error (errno is EINVAL) or if
+ * memory ran out
+ */
+struct sh_ast *sh_parse(const char *line)
+{
+    return sh_parse_with(NULL, line);
+}
+
+/**
+ * @brief Parse a command line like sh_parse, allocating the tree with a. It
+ * must be freed with sh_ast_free_with and the same allocator.
+ *
+ * @param a The allocator, or NULL for the heap
+ * @param line The line to parse
+ * @return The tree, or NULL on a syntax error or if memory ran out
+ */
+struct sh_ast *sh_parse_with(const struct sh_allocator *a, const char *line)
+{
+    if (line == NULL) return NULL;
+    return parse_line(a, line, 0);
+}
+
+/**
+ * @brief Free a tree returned by sh_parse
+ *
+ * @param ast The tree to free
+ */
+void sh_ast_free(struct sh_ast *ast)
+{
+    sh_ast_free_with(NULL, ast);
+}
+
+/**
+ * @brief Free a tree returned by sh_parse_with
+ *
+ * @param a The allocator the tree came from
+ * @param ast The tree to free
+ */
+void sh_ast_free_with(const struct sh_allocator *a, struct sh_ast *ast)
+{
+    // Nodes, argv arrays and strings all live in one block
+    sh_free(a, ast);
+}
+
+/**
+ * @brief Get the first pipeline of a parsed line
+ *
+ * @param ast The tree
+ * @return The node index, or SH_NODE_NONE for an empty line
+ */
+uint32_t sh_ast_first(const struct sh_ast *ast)
+{
+    return ast->nnodes > 0 ? 0 : SH_NODE_NONE;
+}
+
+/**
+ * @brief Get the node that follows node in its list: the next pipeline of
+ * the line or the next command of a pipeline
+ *
+ * @param ast The tree
+ * @param node The current node
+ * @return The node index, or SH_NODE_NONE at the end of the list
+ */
+uint32_t sh_ast_next(const struct sh_ast *ast, uint32_t node)
+{
+    return ast->next[node];
+}
+
+/**
+ * @brief Get the first command of a pipeline, or the first redirection of
+ * a command
+ *
+ * @param ast The tree
+ * @param node The pipeline or command node
+ * @return The node index, or SH_NODE_NONE for a command without
+ * redirections
+ */
+uint32_t sh_ast_child(const struct sh_ast *ast, uint32_t node)
+{
+    return ast->child[node];
+}
+
+/**
+ * @brief Get how a pipeline is joined to the one after it. The last
+ * pipeline has SH_OP_END, or SH_OP_BG if the line ends with &.
+ *
+ * @param ast The tree
+ * @param pipeline The pipeline node
+ * @return The list operator
+ */
+enum sh_list_op sh_ast_op(const struct sh_ast *ast, uint32_t pipeline)
+{
+    return (enum sh_list_op)ast->op[pipeline];
+}
+
+/**
+ * @brief Get the NULL terminated argument list of a command, ready for
+ * execvp. It points into the tree and lives as long as the tree does.
+ *
+ * @param ast The tree
+ * @param cmd The command node
+ * @return The argument list
+ */
+char **sh_ast_argv(const struct sh_ast *ast, uint32_t cmd)
+{
+    return ast->words + ast->arg[cmd];
+}
+
+/**
+ * @brief Get the pipe size a pipeline asked for with a pipesize prefix
+ *
+ * @param ast The tree
+ * @param pipeline The pipeline node
+ * @return The size in bytes, or 0 if it has no prefix
+ */
+size_t sh_ast_pipe_size(const struct sh_ast *ast, uint32_t pipeline)
+{
+    return ast->arg[pipeline];
+}
+
+/**
+ * @brief Get a redirection node as a struct sh_redir. Its path points into
+ * the tree and lives as long as the tree does.
+ *
+ * @param ast The tree
+ * @param redir The redirection node
+ * @return The redirection
+ */
+struct sh_redir sh_ast_redir(const struct sh_ast *ast, uint32_t redir)
+{
+    struct sh_redir r = {(enum sh_redir_op)ast->op[redir], (int)ast->child[redir], NULL, -1};
+    if (r.op == SH_REDIR_DUP) r.src = (int)ast->arg[redir];
+    else r.path = ast->words[ast->arg[redir]];
+    return r;
+}
+
+/*
+ * Parse cache. Scripts and loops submit the same lines over and over, so
+ * parsed trees are kept in a bounded LRU keyed by a hash of the line. Each
+ * cached tree shares its block with the cache entry:
+ *
+ *   struct cache_entry | line bytes | pad | entry back pointer | sh_ast
+ *
+ * so a hit costs one hash, one bucket walk and one strcmp, and a miss one
+ * allocation. Trees are reference counted so an eviction never frees a tree
+ * that is still being run.
+ */
+
+struct cache_entry
+{
+    struct cache_entry *newer; // LRU list, most recent at the head, or the
+    struct cache_entry *older; // list of evicted entries still being run
+    struct cache_entry *chain; // next entry in the same bucket
+    uint64_t hash;
+    size_t refs;
+    bool evicted;
+    const struct sh_ast *ast;
+    char line[];
+};
+
+struct sh_cache
+{
+    const struct sh_allocator *alloc;
+    struct cache_entry **buckets;
+    size_t mask;
+    size_t capacity;
+    struct cache_entry *newest;
+    struct cache_entry *oldest;
+    struct cache_entry *held; // evicted entries not released yet
+    struct sh_cache_stats stats;
+};
+
+/**
+ * @brief Hash a line 8 bytes at a time
+ *
+ * @param line The line to hash
+ * @param len Its length
+ * @return The hash
+ */
+static uint64_t cache_hash(const char *line, size_t len)
+{
+    const uint64_t mul = 0x9e3779b97f4a7c15ull;
+    uint64_t h = len * mul;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, line + i, 8);
+        h = (h ^ w) * mul;
+        h ^= h >> 29;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, line + i, len - i);
+    h = (h ^ tail) * mul;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @brief Find the cache entry that owns a tree handed out by sh_cache_parse
+ */
+static struct cache_entry *cache_entry_of(const struct sh_ast *ast)
+{
+    return ((struct cache_entry **)ast)[-1];
+}
+
+/**
+ * @brief Unlink an entry from the LRU list
+ */
+static void cache_unlink(struct sh_cache *cache, struct cache_entry *e)
+{
+    if (e->newer) e->newer->older = e->older;
+    else cache->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else cache->oldest = e->newer;
+}
+
+/**
+ * @brief Put an entry at the head of the LRU list
+ */
+static void cache_push(struct sh_cache *cache, struct cache_entry *e)
+{
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest) cache->newest->newer = e;
+    cache->newest = e;
+    if (!cache->oldest) cache->oldest = e;
+}
+
+/**
+ * @brief Remove an evicted entry from the list of held ones
+ */
+static void cache_unhold(struct sh_cache *cache, struct cache_entry *e)
+{
+    if (e->newer) e->newer->older = e->older;
+    else cache->held = e->older;
+    if (e->older) e->older->newer = e->newer;
+}
+
+/**
+ * @brief Drop the least recently used entry. Its block is freed now if no
+ * one is running it, otherwise it is held until its last sh_cache_release.
+ */
+static void cache_evict(struct sh_cache *cache)
+{
+    struct cache_entry *e = cache->oldest;
+    cache_unlink(cache, e);
+
+    struct cache_entry **slot = &cache->buckets[e->hash & cache->mask];
+    while (*slot != e) slot = &(*slot)->chain;
+    *slot = e->chain;
+
+    cache->stats.entries--;
+    cache->stats.evictions++;
+    e->evicted = true;
+    if (e->refs == 0)
+    {
+        sh_free(cache->alloc, e);
+        return;
+    }
+
+    e->newer = NULL;
+    e->older = cache->held;
+    if (cache->held) cache->held->newer = e;
+    cache->held = e;
+}
+
+/**
+ * @brief Create a parse cache
+ *
+ * @param capacity The most lines to keep
+ * @return The cache, or NULL if memory ran out
+ */
+struct sh_cache *sh_cache_create(size_t capacity)
+{
+    return sh_cache_create_with(NULL, capacity);
+}
+
+/**
+ * @brief Create a parse cache that allocates the cache and every entry with
+ * a. The allocator must outlive the cache.
+ *
+ * @param a The allocator, or NULL for the heap
+ * @param capacity The most lines to keep
+ * @return The cache, or NULL if memory ran out
+ */
+struct sh_cache *sh_cache_create_with(const struct sh_allocator *a, size_t capacity)
+{
+    if (capacity == 0) capacity = 1;
+
+    // Keep the load factor at or below one half
+    size_t nbuckets = 1;
+    while (nbuckets < capacity * 2) nbuckets <<= 1;
+
+    struct sh_cache *cache = sh_alloc(a, sizeof(*cache));
+    struct cache_entry **buckets = sh_alloc(a, nbuckets * sizeof(*buckets));
+    if (!cache || !buckets)
+    {
+        perror("malloc");
+        sh_free(a, cache);
+        sh_free(a, buckets);
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    memset(buckets, 0, nbuckets * sizeof(*buckets));
+    cache->alloc = a;
+    cache->buckets = buckets;
+
+    cache->mask = nbuckets - 1;
+    cache->capacity = capacity;
+    return cache;
+}
+
+/**
+ * @brief Destroy a parse cache and every tree in it, including trees that
+ * were not released yet.
+ *
+ * @param cache The cache to destroy
+ */
+void sh_cache_destroy(struct sh_cache *cache)
+{
+    if (cache == NULL) return;
+
+    for (struct cache_entry *e = cache->newest, *older; e; e = older)
+    {
+        older = e->older;
+        sh_free(cache->alloc, e);
+    }
+    for (struct cache_entry *e = cache->held, *older; e; e = older)
+    {
+        older = e->older;
+        sh_free(cache->alloc, e);
+    }
+
+    const struct sh_allocator *a = cache->alloc;
+    sh_free(a, cache->buckets);
+    sh_free(a, cache);
+}
+
+/**
+ * @brief Look a trimmed line up in the cache, parsing and inserting it on a
+ * miss. The tree is shared with the cache and must not be modified; it
+ * stays valid until it is handed back with sh_cache_release.
+ *
+ * @param cache The cache
+ * @param line The trimmed line
+ * @return The tree, or NULL on a syntax error or if memory ran out
+ */
+const struct sh_ast *sh_cache_parse(struct sh_cache *cache, const char *line)
+{
+    if (cache == NULL || line == NULL) return NULL;
+
+    size_t len = strlen(line);
+    uint64_t hash = cache_hash(line, len);
+    struct cache_entry **bucket = &cache->buckets[hash & cache->mask];
+
+    for (struct cache_entry *e = *bucket; e; e = e->chain)
+    {
+        if (e->hash == hash && strcmp(e->line, line) == 0)
+        {
+            cache->stats.hits++;
+            cache_unlink(cache, e);
+            cache_push(cache, e);
+            e->refs++;
+            return e->ast;
+        }
+    }
+
+    cache->stats.misses++;
+
+    // The tree goes behind the entry, its key and a back pointer
+    size_t head = sizeof(struct cache_entry) + len + 1;
+    head = (head + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    head += sizeof(struct cache_entry *);
+
+    struct sh_ast *ast = parse_line(cache->alloc, line, head);
+    if (!ast) return NULL;
+
+    struct cache_entry *e = (struct cache_entry *)((char *)ast - head);
+    ((struct cache_entry **)ast)[-1] = e;
+    memcpy(e->line, line, len + 1);
+    e->hash = hash;
+    e->refs = 1;
+    e->evicted = false;
+    e->ast = ast;
+
+    if (cache->stats.entries == cache->capacity) cache_evict(cache);
+    e->chain = *bucket;
+    *bucket = e;
+    cache_push(cache, e);
+    cache->stats.entries++;
+
+    return ast;
+}
+
+/**
+ * @brief Hand back a tree returned by sh_cache_parse
+ *
+ * @param cache The cache
+ * @param ast The tree
+ */
+void sh_cache_release(struct sh_cache *cache, const struct sh_ast *ast)
+{
+    if (ast == NULL) return;
+
+    struct cache_entry *e = cache_entry_of(ast);
+    if (--e->refs || !e->evicted) return;
+
+    cache_unhold(cache, e);
+    sh_free(cache->alloc, e);
+}
+
+/**
+ * @brief Get the hit and miss counters of a parse cache
+ *
+ * @param cache The cache
+ * @return The counters
+ */
+struct sh_cache_stats sh_cache_get_stats(const struct sh_cache *cache)
+{
+    return cache->stats;
+}
+
+/**
+ * @brief Free the line that was constructed with cmd_parse
+ *
+ * @param line the line to free
+ */
+void cmd_free(char **line)
+{
+    cmd_free_with(NULL, line);
+}
+
+/**
+ * @brief Free a line that was constructed with cmd_parse_with or
+ * cmd_lex_with
+ *
+ * @param a The allocator the line came from
+ * @param line the line to free
+ */
+void cmd_free_with(const struct sh_allocator *a, char **line)
+{
+    // The argv array and all of its strings live in one block
+    sh_free(a, line);
+}
+
+/**
+ * @brief Trim the whitespace from the start and end of a string.
+ * For example "   ls -a   " becomes "ls -a". This function modifies
+ * the argument line so that all printable chars are moved to the
+ * front of the string
+ *
+ * @param line The line to trim
+ * @return The new line with no whitespace
+ */
+char *trim_white(char *line)
+{
+    // Check for NULL input
+    if (line == NULL) return NULL;
+
+    // Trim leading whitespace
+    char *start = line + scan->span(line, SCAN_SPACE);
+
+    // Trim trailing whitespace
+    char *end = line + strlen(line) - 1;
+    if (end > start) end = (char *)scan->rskip(start, end, SCAN_SPACE);
+
+    // Null terminate trimmed string
+    *(end + 1) = '\0';
+
+    // Move the trimmed string to the start of the original line
+    if (start != line)
+    {
+        memmove(line, start, end - start + 2); // +2 to include null terminator
+    }
+
+    return line; 
+}
+
+/*
+ * Command lookup cache. execvp tries an execve in every PATH directory
+ * until one works, so a command late in a long PATH costs a failed syscall
+ * per directory every time it runs. Resolved paths are kept in a hash table
+ * keyed by command name, filled on first use, and the shell execs the
+ * cached path directly. The table is emptied when PATH changes, and an
+ * entry whose binary has disappeared is dropped and resolved again the next
+ * time it fails to exec.
+ *
+ * Once attached to an event loop with sh_path_cache_watch, every PATH
+ * directory is watched with inotify and the loop drops the entry for any
+ * name created, removed, renamed or chmodded in one of them. That keeps the
+ * cache right when a binary is installed earlier in PATH or swapped out
+ * mid-session, without a stat per lookup: a lookup makes no syscalls.
+ *
+ * Hot commands also keep an O_PATH fd of their binary, so they can be
+ * started with execveat(fd, "", AT_EMPTY_PATH) without any path walk or
+ * directory permission checks. Only SH_EXEC_FDS fds are kept, in LRU order.
+ * Because an fd pins the old inode, the inotify watch matters here: a
+ * replaced binary drops its entry and with it the fd.
+ */
+
+// Used by execvp when PATH is not set
+#define PATH_DEFAULT "/bin:/usr/bin"
+
+// Uses of a command before its binary is kept open
+#define PATH_FD_HOT 2
+
+// Directory changes that can change what a name resolves to
+#define PATH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct path_entry
+{
+    struct path_entry *chain; // next entry in the same bucket
+    uint64_t hash;
+    size_t hits;
+    int fd;                      // O_PATH fd of path, -1 until the command is hot
+    bool no_fd;                  // path cannot be run from an fd, so none is kept
+    struct path_entry *fd_newer; // LRU list of entries with an fd
+    struct path_entry *fd_older;
+    char *path;                  // points into the same block, after name
+    char name[];
+};
+
+struct sh_path_cache
+{
+    const struct sh_allocator *alloc;
+    struct path_entry **buckets;
+    size_t mask;
+    char *path_env; // the PATH the entries were resolved against
+    struct sh_path_stats stats;
+    struct sh_loop *loop; // set by sh_path_cache_watch
+    struct sh_watch *watch;
+    int inotify_fd; // watches the directories in path_env, -1 if none
+    bool missing;   // a directory in path_env does not exist yet
+    struct path_entry *fd_newest;
+    struct path_entry *fd_oldest;
+    size_t nfds;
+};
+
+static void path_fd_unlink(struct sh_path_cache *cache, struct path_entry *e)
+{
+    if (e->fd_newer) e->fd_newer->fd_older = e->fd_older;
+    else cache->fd_newest = e->fd_older;
+    if (e->fd_older) e->fd_older->fd_newer = e->fd_newer;
+    else cache->fd_oldest = e->fd_newer;
+    e->fd_newer = e->fd_older = NULL;
+}
+
+// Close the fd of an entry, if it has one
+static void path_fd_close(struct sh_path_cache *cache, struct path_entry *e)
+{
+    if (e->fd < 0) return;
+
+    path_fd_unlink(cache, e);
+    close(e->fd);
+    e->fd = -1;
+    cache->nfds--;
+}
+
+static void path_entry_free(struct sh_path_cache *cache, struct path_entry *e)
+{
+    path_fd_close(cache, e);
+    sh_free(cache->alloc, e);
+}
+
+/**
+ * @brief Mark an entry as just used, opening its binary once it is hot and
+ * closing the least recently used fd if that makes too many
+ *
+ * @param cache The cache
+ * @param e The entry
+ */
+static void path_fd_touch(struct sh_path_cache *cache, struct path_entry *e)
+{
+    if (e->fd >= 0)
+    {
+        path_fd_unlink(cache, e);
+    }
+    else
+    {
+        if (e->hits < PATH_FD_HOT || e->no_fd) return;
+        e->fd = open(e->path, O_PATH | O_CLOEXEC);
+        if (e->fd < 0) return;
+        cache->stats.fd_opens++;
+        cache->nfds++;
+    }
+
+    e->fd_older = cache->fd_newest;
+    if (cache->fd_newest) cache->fd_newest->fd_newer = e;
+    cache->fd_newest = e;
+    if (!cache->fd_oldest) cache->fd_oldest = e;
+
+    if (cache->nfds > SH_EXEC_FDS)
+    {
+        path_fd_close(cache, cache->fd_oldest);
+        cache->stats.fd_evictions++;
+    }
+}
+
+/**
+ * @brief Create an empty command lookup cache
+ *
+ * @param a The allocator, NULL for the heap
+ * @return The cache, or NULL if memory ran out
+ */
+struct sh_path_cache *sh_path_cache_create_with(const struct sh_allocator *a)
+{
+    const size_t nbuckets = 64;
+    struct sh_path_cache *cache = sh_alloc(a, sizeof(*cache));
+    struct path_entry **buckets = sh_alloc(a, nbuckets * sizeof(*buckets));
+    if (!cache || !buckets)
+    {
+        perror("malloc");
+        sh_free(a, cache);
+        sh_free(a, buckets);
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    memset(buckets, 0, nbuckets * sizeof(*buckets));
+    cache->alloc = a;
+    cache->buckets = buckets;
+    cache->mask = nbuckets - 1;
+    cache->inotify_fd = -1;
+    return cache;
+}
+
+/**
+ * @brief Remove every entry from a command lookup cache
+ *
+ * @param cache The cache
+ */
+void sh_path_clear(struct sh_path_cache *cache)
+{
+    for (size_t i = 0; i <= cache->mask; i++)
+    {
+        for (struct path_entry *e = cache->buckets[i], *next; e; e = next)
+        {
+            next = e->chain;
+            path_entry_free(cache, e);
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->stats.entries = 0;
+}
+
+/**
+ * @brief Free a command lookup cache and all of its entries
+ *
+ * @param cache The cache to destroy
+ */
+static void path_unwatch(struct sh_path_cache *cache);
+
+void sh_path_cache_destroy(struct sh_path_cache *cache)
+{
+    if (cache == NULL) return;
+
+    path_unwatch(cache);
+    sh_path_clear(cache);
+    sh_free(cache->alloc, cache->buckets);
+    sh_free(cache->alloc, cache->path_env);
+    sh_free(cache->alloc, cache);
+}
+
+// Double the bucket count once the table is fuller than one entry per bucket
+static void path_grow(struct sh_path_cache *cache)
+{
+    size_t nbuckets = (cache->mask + 1) * 2;
+    struct path_entry **buckets = sh_alloc(cache->alloc, nbuckets * sizeof(*buckets));
+    if (!buckets) return; // keep the longer chains
+
+    memset(buckets, 0, nbuckets * sizeof(*buckets));
+    for (size_t i = 0; i <= cache->mask; i++)
+    {
+        for (struct path_entry *e = cache->buckets[i], *next; e; e = next)
+        {
+            next = e->chain;
+            e->chain = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+        }
+    }
+
+    sh_free(cache->alloc, cache->buckets);
+    cache->buckets = buckets;
+    cache->mask = nbuckets - 1;
+}
+
+static struct path_entry **path_find(struct sh_path_cache *cache, const char *name, uint64_t hash)
+{
+    struct path_entry **link = &cache->buckets[hash & cache->mask];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) link = &(*link)->chain;
+    return link;
+}
+
+// Stop watching the PATH directories
+static void path_unwatch(struct sh_path_cache *cache)
+{
+    if (cache->inotify_fd < 0) return;
+
+    sh_loop_cancel(cache->loop, cache->watch);
+    close(cache->inotify_fd);
+    cache->watch = NULL;
+    cache->inotify_fd = -1;
+}
+
+static void path_watch(struct sh_path_cache *cache);
+
+/**
+ * @brief Drain the inotify queue and drop the entries for every name that
+ * changed. Losing a directory or events means any entry may be wrong, so
+ * then everything goes. So does a new directory while one in PATH is
+ * missing, since it may be that one, already full of binaries. In both
+ * cases the directories are watched again, so one that was removed or
+ * replaced is watched once it is back.
+ *
+ * @param ctx The cache
+ */
+static void path_notify(void *ctx)
+{
+    struct sh_path_cache *cache = ctx;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool rewatch = false;
+
+    ssize_t len;
+    while (!rewatch && (len = read(cache->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                cache->stats.dropped += cache->stats.entries;
+                sh_path_clear(cache);
+            }
+            else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                // The directory is gone or was renamed away, and the watch
+                // with it: watch whatever now has its name, or its parent
+                rewatch = true;
+            }
+            else if (ev->mask & IN_ISDIR)
+            {
+                // A directory is never a command
+                rewatch |= cache->missing && (ev->mask & (IN_CREATE | IN_MOVED_TO));
+            }
+            else if (ev->len && sh_path_forget(cache, ev->name))
+            {
+                cache->stats.dropped++;
+            }
+        }
+    }
+
+    if (rewatch)
+    {
+        cache->stats.dropped += cache->stats.entries;
+        sh_path_clear(cache);
+        path_watch(cache);
+    }
+}
+
+/**
+ * @brief Watch the nearest existing parent of a PATH directory that does
+ * not exist, for the directory or one of its parents being created
+ *
+ * @param cache The cache
+ * @param dir The missing directory, cut short in place
+ */
+static void path_watch_parent(struct sh_path_cache *cache, char *dir)
+{
+    for (;;)
+    {
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL) strcpy(dir, ".");
+        else if (slash == dir) dir[1] = '\0';
+        else *slash = '\0';
+
+        // Added to the mask of a directory that is in PATH itself
+        uint32_t mask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD;
+        if (inotify_add_watch(cache->inotify_fd, dir, mask) >= 0 || errno != ENOENT) return;
+        if (strcmp(dir, "/") == 0 || strcmp(dir, ".") == 0) return;
+    }
+}
+
+// Watch every directory in path_env, or the parent of one that does not exist
+static void path_watch(struct sh_path_cache *cache)
+{
+    path_unwatch(cache);
+    cache->missing = false;
+    if (cache->loop == NULL || cache->path_env == NULL) return;
+
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd < 0)
+    {
+        perror("inotify_init1");
+        return;
+    }
+
+    char dir[PATH_MAX];
+    for (const char *start = cache->path_env;; start++)
+    {
+        const char *end = strchrnul(start, ':');
+        size_t len = (size_t)(end - start);
+        if (len == 0) dir[0] = '.', len = 1;
+        else if (len < sizeof(dir)) memcpy(dir, start, len);
+        if (len < sizeof(dir))
+        {
+            dir[len] = '\0';
+            if (inotify_add_watch(cache->inotify_fd, dir, PATH_EVENTS | IN_ONLYDIR) < 0 && errno == ENOENT)
+            {
+                cache->missing = true;
+                path_watch_parent(cache, dir);
+            }
+        }
+
+        if (*end == '\0') break;
+        start = end;
+    }
+
+    cache->watch = sh_loop_watch_event_fd(cache->loop, cache->inotify_fd, path_notify, cache);
+    if (cache->watch == NULL)
+    {
+        close(cache->inotify_fd);
+        cache->inotify_fd = -1;
+    }
+}
+
+/**
+ * @brief Keep a command lookup cache up to date through an event loop. The
+ * loop drops entries as PATH directories change; the cache must be
+ * destroyed before the loop.
+ *
+ * @param cache The cache
+ * @param loop The loop, NULL to stop watching
+ */
+void sh_path_cache_watch(struct sh_path_cache *cache, struct sh_loop *loop)
+{
+    path_unwatch(cache);
+    cache->loop = loop;
+    path_watch(cache);
+}
+
+// Start over if PATH changed since the entries were resolved
+static void path_check_env(struct sh_path_cache *cache)
+{
+    const char *env = getenv("PATH");
+    if (env == NULL) env = PATH_DEFAULT;
+    if (cache->path_env && strcmp(cache->path_env, env) == 0) return;
+
+    if (cache->stats.entries) cache->stats.invalidations++;
+    sh_path_clear(cache);
+    sh_free(cache->alloc, cache->path_env);
+
+    size_t len = strlen(env);
+    cache->path_env = sh_alloc(cache->alloc, len + 1);
+    if (cache->path_env) memcpy(cache->path_env, env, len + 1);
+    path_watch(cache);
+}
+
+/**
+ * @brief Add or replace an entry, as hash -p does. The path is not checked.
+ *
+ * @param cache The cache
+ * @param name The command name
+ * @param path The file to run for it
+ * @return The entry, or NULL if memory ran out
+ */
+static struct path_entry *path_insert(struct sh_path_cache *cache, const char *name, const char *path)
+{
+    path_check_env(cache);
+
+    size_t name_len = strlen(name);
+    size_t path_len = strlen(path);
+    uint64_t hash = cache_hash(name, name_len);
+    struct path_entry **link = path_find(cache, name, hash);
+
+    struct path_entry *e = sh_alloc(cache->alloc, sizeof(*e) + name_len + 1 + path_len + 1);
+    if (!e)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    e->hash = hash;
+    e->hits = 0;
+    e->fd = -1;
+    e->no_fd = false;
+    e->fd_newer = e->fd_older = NULL;
+    memcpy(e->name, name, name_len + 1);
+    e->path = e->name + name_len + 1;
+    memcpy(e->path, path, path_len + 1);
+
+    // Replace an old entry in place, otherwise push on the bucket
+    if (*link)
+    {
+        e->chain = (*link)->chain;
+        path_entry_free(cache, *link);
+        *link = e;
+        return e;
+    }
+
+    e->chain = cache->buckets[hash & cache->mask];
+    cache->buckets[hash & cache->mask] = e;
+    if (++cache->stats.entries > cache->mask + 1) path_grow(cache);
+    return e;
+}
+
+/**
+ * @brief Search PATH for an executable regular file called name
+ *
+ * @param dirs The PATH to search, a list of directories separated by ':'
+ * @param name The command name, without a '/'
+ * @param buf Receives the path
+ * @param size The size of buf
+ * @return True if the command was found
+ */
+static bool path_search(const char *dirs, const char *name, char *buf, size_t size)
+{
+    size_t name_len = strlen(name);
+
+    for (const char *dir = dirs;; dir++)
+    {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = (size_t)(end - dir);
+
+        // An empty entry means the current directory
+        if (dir_len == 0) dir = ".", dir_len = 1;
+        if (dir_len + 1 + name_len < size)
+        {
+            memcpy(buf, dir, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) return true;
+        }
+
+        if (*end == '\0') return false;
+        dir = end;
+    }
+}
+
+/**
+ * @brief Look a command up in PATH again and cache the result, without
+ * counting a hit
+ *
+ * @param cache The cache
+ * @param name The command name
+ * @param found Set to whether the command was found, or NULL
+ * @return The entry, or NULL if the command was not found or not cached
+ */
+static struct path_entry *path_resolve(struct sh_path_cache *cache, const char *name, bool *found)
+{
+    path_check_env(cache);
+
+    char buf[PATH_MAX];
+    bool hit = path_search(cache->path_env ? cache->path_env : PATH_DEFAULT, name, buf, sizeof(buf));
+    if (found) *found = hit;
+    // A relative PATH entry, like the empty one for the current directory,
+    // names another file after cd, so what it finds is not kept
+    if (!hit || buf[0] != '/') return NULL;
+    return path_insert(cache, name, buf);
+}
+
+// Find or resolve the entry for name and count the use
+static struct path_entry *path_lookup(struct sh_path_cache *cache, const char *name)
+{
+    path_check_env(cache);
+    struct path_entry *e = *path_find(cache, name, cache_hash(name, strlen(name)));
+    if (e) cache->stats.hits++;
+    else
+    {
+        cache->stats.misses++;
+        e = path_resolve(cache, name, NULL);
+        if (!e) return NULL;
+    }
+
+    e->hits++;
+    return e;
+}
+
+/**
+ * @brief Find the file to run for a command, searching PATH only the first
+ * time a name is seen. Names containing a '/' are not looked up.
+ *
+ * @param cache The cache
+ * @param name The command name
+ * @return The path, valid until the entry is dropped, or NULL if the
+ * command was not found
+ */
+const char *sh_path_lookup(struct sh_path_cache *cache, const char *name)
+{
+    if (strchr(name, '/')) return name;
+
+    struct path_entry *e = path_lookup(cache, name);
+    return e ? e->path : NULL;
+}
+
+/**
+ * @brief Like sh_path_lookup, but also hand back an open O_PATH fd of the
+ * binary once the command is hot
+ *
+ * @param cache The cache
+ * @param name The command name
+ * @param fd Set to the fd, valid until the entry is dropped, or to -1
+ * @return The path, or NULL if the command was not found
+ */
+const char *sh_path_lookup_fd(struct sh_path_cache *cache, const char *name, int *fd)
+{
+    *fd = -1;
+    if (strchr(name, '/')) return name;
+
+    struct path_entry *e = path_lookup(cache, name);
+    if (!e) return NULL;
+
+    path_fd_touch(cache, e);
+    *fd = e->fd;
+    return e->path;
+}
+
+/**
+ * @brief Add an entry without searching PATH, as hash -p does
+ *
+ * @param cache The cache
+ * @param name The command name
+ * @param path The file to run for it
+ * @return True on success, false if memory ran out
+ */
+bool sh_path_add(struct sh_path_cache *cache, const char *name, const char *path)
+{
+    return path_insert(cache, name, path) != NULL;
+}
+
+/**
+ * @brief Drop the entry for a command
+ *
+ * @param cache The cache
+ * @param name The command name
+ * @return True if there was an entry
+ */
+bool sh_path_forget(struct sh_path_cache *cache, const char *name)
+{
+    struct path_entry **link = path_find(cache, name, cache_hash(name, strlen(name)));
+    struct path_entry *e = *link;
+    if (!e) return false;
+
+    *link = e->chain;
+    path_entry_free(cache, e);
+    cache->stats.entries--;
+    return true;
+}
+
+/**
+ * @brief Stop keeping an fd for a command whose binary failed to exec from
+ * it, like a script, whose interpreter cannot open a close-on-exec fd. It
+ * would cost a failed execveat on every launch.
+ *
+ * @param cache The cache
+ * @param name The command name
+ */
+static void path_fd_refuse(struct sh_path_cache *cache, const char *name)
+{
+    struct path_entry *e = *path_find(cache, name, cache_hash(name, strlen(name)));
+    if (!e) return;
+
+    path_fd_close(cache, e);
+    e->no_fd = true;
+}
+
+// The path cached for name, without searching PATH
+static const char *path_cached(struct sh_path_cache *cache, const char *name)
+{
+    path_check_env(cache);
+    struct path_entry *e = *path_find(cache, name, cache_hash(name, strlen(name)));
+    return e ? e->path : NULL;
+}
+
+// Print the cache to out the way bash's hash does
+static void path_list(struct sh_path_cache *cache, bool reusable, FILE *out)
+{
+    path_check_env(cache);
+    if (cache->stats.entries == 0)
+    {
+        fprintf(out, "hash: hash table empty\n");
+        return;
+    }
+
+    if (!reusable) fprintf(out, "hits\tcommand\n");
+    for (size_t i = 0; i <= cache->mask; i++)
+    {
+        for (const struct path_entry *e = cache->buckets[i]; e; e = e->chain)
+        {
+            if (reusable) fprintf(out, "builtin hash -p %s %s\n", e->path, e->name);
+            else fprintf(out, "%4zu\t%s\n", e->hits, e->path);
+        }
+    }
+}
+
+/**
+ * @brief Get the counters kept by a command lookup cache
+ *
+ * @param cache The cache
+ * @return A copy of the counters
+ */
+struct sh_path_stats sh_path_get_stats(const struct sh_path_cache *cache)
+{
+    return cache->stats;
+}
+
+/*
+ * Process launch. fork() copies the page tables of the whole shell, which
+ * gets slower as history and caches grow, so external commands are started
+ * through a backend that does not copy the address space: posix_spawn (a
+ * CLONE_VM|CLONE_VFORK clone inside glibc) or vfork. Plain fork stays as a
+ * fallback. The shell ignores the job control signals, so every backend
+ * resets them to their defaults in the child.
+ */
+
+extern char **environ;
+
+// Signals the shell ignores and its children get back as SIG_DFL
+static const int child_default_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+// What to exec: a file, optionally searched for in PATH, or an open binary
+struct spawn_target
+{
+    const char *path;
+    bool search;
+    int fd;      // -1, or an O_PATH fd of path to execveat; reset to -1 if unused
+    bool via_fd; // set if the child was started from fd
+    const struct sh_spawn_attr *attr; // NULL to inherit everything
+};
+
+// Defined with the pre-fork pool
+static pid_t prefork_spawn(struct sh_prefork *p, struct spawn_target *t, char *const argv[], bool *used);
+
+// Defined with the fork server
+static bool server_alive(const struct sh_forkserver *server);
+static pid_t server_spawn(struct sh_forkserver *server, struct spawn_target *t, char *const argv[]);
+static bool server_watch(struct sh_forkserver *server, pid_t pid, void (*fn)(void *ctx, pid_t pid, int status),
+                         void *ctx);
+
+static const char *const spawn_backend_names[] = {
+    [SH_SPAWN_AUTO] = "auto",
+    [SH_SPAWN_POSIX] = "posix_spawn",
+    [SH_SPAWN_VFORK] = "vfork",
+    [SH_SPAWN_FORK] = "fork",
+    [SH_SPAWN_SERVER] = "forkserver",
+};
+
+/**
+ * @brief Get the name of a spawn backend
+ *
+ * @param backend The backend
+ * @return The name, as accepted by sh_spawn_backend_parse
+ */
+const char *sh_spawn_backend_name(enum sh_spawn_backend backend)
+{
+    if ((size_t)backend >= sizeof(spawn_backend_names) / sizeof(spawn_backend_names[0])) return "unknown";
+    return spawn_backend_names[backend];
+}
+
+/**
+ * @brief Look up a spawn backend by name
+ *
+ * @param name The name of the backend
+ * @return The backend, or SH_SPAWN_AUTO if name is NULL or unknown
+ */
+enum sh_spawn_backend sh_spawn_backend_parse(const char *name)
+{
+    if (name == NULL) return SH_SPAWN_AUTO;
+
+    for (size_t i = 0; i < sizeof(spawn_backend_names) / sizeof(spawn_backend_names[0]); i++)
+    {
+        if (strcmp(name, spawn_backend_names[i]) == 0) return (enum sh_spawn_backend)i;
+    }
+
+    fprintf(stderr, "unknown spawn backend '%s', using auto\n", name);
+    return SH_SPAWN_AUTO;
+}
+
+/**
+ * @brief Get the backend sh_spawn actually uses for a shell
+ *
+ * @param sh The shell
+ * @return The backend, never SH_SPAWN_AUTO
+ */
+enum sh_spawn_backend sh_spawn_backend_resolve(const struct shell *sh)
+{
+    // glibc's posix_spawn never copies the address space
+    if (sh->spawn == SH_SPAWN_AUTO) return SH_SPAWN_POSIX;
+    if (sh->spawn == SH_SPAWN_SERVER && !server_alive(sh->server)) return SH_SPAWN_POSIX;
+    return sh->spawn;
+}
+
+/**
+ * @brief Reset signal dispositions and the signal mask in a new child. Only
+ * async-signal-safe calls, so it can run after vfork.
+ */
+static void child_reset_signals(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < sizeof(child_default_signals) / sizeof(child_default_signals[0]); i++)
+    {
+        sigaction(child_default_signals[i], &sa, NULL);
+    }
+
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+// Put a child in its process group and install its stdio, as attr says
+static void child_apply_attr(const struct sh_spawn_attr *attr)
+{
+    if (attr == NULL) return;
+
+    if (attr->pgid >= 0) setpgid(0, attr->pgid);
+    for (int i = 0; i < 3; i++)
+    {
+        // dup2 onto itself would leave close-on-exec set
+        if (attr->fds[i] == i) fcntl(i, F_SETFD, 0);
+        else if (attr->fds[i] >= 0) dup2(attr->fds[i], i);
+    }
+}
+
+// Runs a file that has no #! line, as execvp does
+#define SCRIPT_SHELL "/bin/sh"
+
+/**
+ * @brief Build the argv that runs a script with SCRIPT_SHELL: the shell,
+ * the script's path, then argv without its argv[0]
+ *
+ * @param args Receives the new argv, room for argv_count(argv) + 2
+ * @param path The script's path
+ * @param argv The command's argv
+ */
+static void script_args(char **args, const char *path, char *const argv[])
+{
+    size_t n = 0;
+    args[n++] = (char *)SCRIPT_SHELL;
+    args[n++] = (char *)path;
+    for (size_t i = 1; argv[0] && argv[i]; i++) args[n++] = argv[i];
+    args[n] = NULL;
+}
+
+// The number of entries in argv, not counting the NULL
+static size_t argv_count(char *const argv[])
+{
+    size_t n = 0;
+    while (argv[n]) n++;
+    return n;
+}
+
+/**
+ * @brief Exec a command in a new child. A file the kernel rejects with
+ * ENOEXEC is run with SCRIPT_SHELL, which execvp already does but execve
+ * does not. Only async-signal-safe calls, so it can run after vfork.
+ * Returns only if the exec failed, with errno set.
+ *
+ * @param path The file, or the name to search PATH for
+ * @param search Search PATH for path
+ * @param argv The command's argv
+ * @param envp The environment
+ */
+static void child_exec(const char *path, bool search, char *const argv[], char *const envp[])
+{
+    if (search)
+    {
+        execvpe(path, argv, envp);
+        return;
+    }
+
+    execve(path, argv, envp);
+    if (errno != ENOEXEC) return;
+    char *args[argv_count(argv) + 2];
+    script_args(args, path, argv);
+    execve(SCRIPT_SHELL, args, envp);
+    errno = ENOEXEC;
+}
+
+/**
+ * @brief Start a script that posix_spawn turned down with ENOEXEC. Unlike
+ * execvp, posix_spawnp has no fallback to the shell, so the file is found
+ * in PATH again and handed to SCRIPT_SHELL.
+ *
+ * @param pid Receives the child's pid
+ * @param t What the command was, for its path and whether it was searched
+ * @param fa The file actions the first try used, or NULL
+ * @param attr The attributes the first try used
+ * @param argv The command's argv
+ * @return 0, or an error number
+ */
+static int spawn_posix_script(pid_t *pid, const struct spawn_target *t, const posix_spawn_file_actions_t *fa,
+                              const posix_spawnattr_t *attr, char *const argv[])
+{
+    char buf[PATH_MAX];
+    const char *path = t->path;
+    if (t->search && strchr(path, '/') == NULL)
+    {
+        const char *dirs = getenv("PATH");
+        if (!path_search(dirs ? dirs : PATH_DEFAULT, path, buf, sizeof(buf))) return ENOEXEC;
+        path = buf;
+    }
+
+    char *args[argv_count(argv) + 2];
+    script_args(args, path, argv);
+    return posix_spawn(pid, SCRIPT_SHELL, fa, attr, args, environ);
+}
+
+static pid_t spawn_posix(struct spawn_target *t, char *const argv[])
+{
+    posix_spawnattr_t attr;
+    int err = posix_spawnattr_init(&attr);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    for (size_t i = 0; i < sizeof(child_default_signals) / sizeof(child_default_signals[0]); i++)
+    {
+        sigaddset(&defaults, child_default_signals[i]);
+    }
+    sigset_t none;
+    sigemptyset(&none);
+
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &none);
+
+    // The process group and stdio are set up in the child by file actions
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *fa = NULL;
+    if (t->attr)
+    {
+        if (t->attr->pgid >= 0)
+        {
+            posix_spawnattr_setpgroup(&attr, t->attr->pgid);
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        posix_spawn_file_actions_init(&actions);
+        fa = &actions;
+        for (int i = 0; i < 3; i++)
+        {
+            if (t->attr->fds[i] >= 0) posix_spawn_file_actions_adddup2(fa, t->attr->fds[i], i);
+        }
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    if (t->search) err = posix_spawnp(&pid, t->path, fa, &attr, argv, environ);
+    else err = posix_spawn(&pid, t->path, fa, &attr, argv, environ);
+    if (err == ENOEXEC) err = spawn_posix_script(&pid, t, fa, &attr, argv);
+    posix_spawnattr_destroy(&attr);
+    if (fa) posix_spawn_file_actions_destroy(fa);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+
+    return pid;
+}
+
+static pid_t spawn_vfork(struct spawn_target *t, char *const argv[])
+{
+    // The child shares our memory until it execs, so it reports a failed
+    // exec by writing here before exiting
+    volatile int child_errno = 0;
+    volatile bool via_fd = false;
+
+    pid_t pid = vfork();
+    if (pid == 0)
+    {
+        child_reset_signals();
+        child_apply_attr(t->attr);
+        if (t->fd >= 0)
+        {
+            // A script cannot be run from a close-on-exec fd, since its
+            // interpreter opens it again by name, so fall back to the path
+            via_fd = true;
+            syscall(SYS_execveat, t->fd, "", argv, environ, AT_EMPTY_PATH);
+            via_fd = false;
+        }
+        child_exec(t->path, t->search, argv, environ);
+        child_errno = errno;
+        _exit(127);
+    }
+    if (pid < 0) return -1;
+
+    if (child_errno)
+    {
+        waitpid(pid, NULL, 0);
+        errno = child_errno;
+        return -1;
+    }
+
+    t->via_fd = via_fd;
+    return pid;
+}
+
+static pid_t spawn_fork(struct spawn_target *t, char *const argv[])
+{
+    // A close-on-exec pipe tells the parent whether exec worked: it reads
+    // EOF on success and the child's errno on failure
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) < 0) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(report[0]);
+        child_reset_signals();
+        child_apply_attr(t->attr);
+        child_exec(t->path, t->search, argv, environ);
+        int err = errno;
+        if (write(report[1], &err, sizeof(err)) < 0) _exit(127);
+        _exit(127);
+    }
+
+    close(report[1]);
+    if (pid < 0)
+    {
+        close(report[0]);
+        return -1;
+    }
+
+    int err = 0;
+    ssize_t n;
+    while ((n = read(report[0], &err, sizeof(err))) < 0 && errno == EINTR)
+        ;
+    close(report[0]);
+
+    if (n == sizeof(err))
+    {
+        waitpid(pid, NULL, 0);
+        errno = err;
+        return -1;
+    }
+
+    return pid;
+}
+
+static pid_t spawn_target(struct shell *sh, enum sh_spawn_backend backend, struct spawn_target *t,
+                          char *const argv[])
+{
+    if (backend == SH_SPAWN_SERVER) return server_spawn(sh->server, t, argv);
+
+    // Only a vfork child can execveat, and a backend the user picked is
+    // kept even then; every other way takes the path
+    bool use_fd = t->fd >= 0 && (backend == SH_SPAWN_VFORK || sh->spawn == SH_SPAWN_AUTO);
+    int fd = t->fd;
+    t->fd = -1;
+
+    // A spare that is already forked beats any way of forking, but it
+    // cannot change its stdio or process group
+    if (sh->prefork && t->attr == NULL)
+    {
+        bool used;
+        pid_t pid = prefork_spawn(sh->prefork, t, argv, &used);
+        if (used) return pid;
+    }
+
+    if (backend == SH_SPAWN_FORK) return spawn_fork(t, argv);
+    if (use_fd) t->fd = fd;
+    if (backend == SH_SPAWN_VFORK || use_fd) return spawn_vfork(t, argv);
+    return spawn_posix(t, argv);
+}
+
+/*
+ * Redirections. The shell opens every file itself, close-on-exec, and
+ * resolves a command's redirections into the three fds its child installs
+ * as stdio, so each backend (file actions for posix_spawn, dup2 in a vfork
+ * or fork child, SCM_RIGHTS for the fork server) applies them the way it
+ * already applies pipes, with one dup2 per fd. Builtins get the same fds
+ * installed over the shell's own stdio for as long as they run.
+ */
+
+// A command's stdio once its redirections are applied
+struct redir_fds
+{
+    int fds[3];    // -1 to keep the shell's own
+    bool owned[3]; // fds[i] was opened for the redirections
+};
+
+static int redir_flags(enum sh_redir_op op)
+{
+    switch (op)
+    {
+    case SH_REDIR_IN:
+        return O_RDONLY | O_CLOEXEC;
+    case SH_REDIR_OUT:
+        return O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    case SH_REDIR_APPEND:
+        return O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    default:
+        return O_RDWR | O_CREAT | O_CLOEXEC;
+    }
+}
+
+// Stop using fds[i], closing it if it was opened for the redirections and
+// no other slot shares it
+static void redir_release(struct redir_fds *r, int i)
+{
+    bool shared = false;
+    for (int j = 0; j < 3; j++) shared |= j != i && r->owned[j] && r->fds[j] == r->fds[i];
+    if (r->owned[i] && !shared) close(r->fds[i]);
+    r->owned[i] = false;
+}
+
+// Close the files opened by redir_open
+static void redir_close(struct redir_fds *r)
+{
+    for (int i = 0; i < 3; i++) redir_release(r, i);
+}
+
+/**
+ * @brief Apply redirections, in order, on top of a command's stdio
+ *
+ * @param redirs The redirections, NULL for none
+ * @param base The stdio before them, -1 for the shell's own
+ * @param r Receives the stdio after them. Files it opened are closed
+ * with redir_close.
+ * @return False if a file could not be opened, reported on stderr, with
+ * nothing left open
+ */
+static bool redir_open(const struct sh_redir *redirs, const int base[3], struct redir_fds *r)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        r->fds[i] = base[i];
+        r->owned[i] = false;
+    }
+
+    for (const struct sh_redir *p = redirs; p && p->op != SH_REDIR_END; p++)
+    {
+        int fd = -1;
+        bool owned = false;
+        if (p->op == SH_REDIR_DUP)
+        {
+            if (p->src == p->fd) continue;
+            fd = r->fds[p->src] >= 0 ? r->fds[p->src] : p->src;
+            owned = r->owned[p->src];
+        }
+        else
+        {
+            fd = open(p->path, redir_flags(p->op), 0666);
+            if (fd < 0)
+            {
+                perror(p->path);
+                redir_close(r);
+                return false;
+            }
+            owned = true;
+        }
+        redir_release(r, p->fd);
+        r->fds[p->fd] = fd;
+        r->owned[p->fd] = owned;
+    }
+
+    // In 2>&1 >file stderr wants the stdout from before the file, and
+    // installing the file replaces it, so stderr gets a copy of its own
+    for (int i = 0; i < 3; i++)
+    {
+        int k = r->fds[i];
+        if (k < 0 || k > 2 || k == i || r->fds[k] < 0 || r->fds[k] == k) continue;
+        int fd = fcntl(k, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+        {
+            perror("fcntl");
+            redir_close(r);
+            return false;
+        }
+        r->fds[i] = fd;
+        r->owned[i] = true;
+    }
+    return true;
+}
+
+/**
+ * @brief Start an external command in a new process using the shell's
+ * spawn backend. Commands without a '/' are found through the shell's
+ * command lookup cache when it has one, so a cached command costs exactly
+ * one exec. The job control signals are reset to their defaults in the
+ * child. Errors are reported on stderr.
+ *
+ * @param sh The shell
+ * @param argv The command, argv[0] is looked up in PATH
+ * @return The pid of the child, or -1 if it could not be started
+ */
+pid_t sh_spawn(struct shell *sh, char *const argv[])
+{
+    return sh_spawn_with_attr(sh, argv, NULL);
+}
+
+/**
+ * @brief Start an external command like sh_spawn, with its stdio and
+ * process group set up as attr says. Files named by attr->redirs are opened
+ * close-on-exec by the shell and handed to the child like the other fds, so
+ * a file that cannot be opened is reported before anything is started. Only
+ * the spawn backends honor attr, so a pre-forked spare is not used for it.
+ *
+ * @param sh The shell
+ * @param argv The command, argv[0] is looked up in PATH
+ * @param attr The setup, NULL to inherit everything
+ * @return The pid of the child, or -1 if it could not be started
+ */
+pid_t sh_spawn_with_attr(struct shell *sh, char *const argv[], const struct sh_spawn_attr *attr)
+{
+    if (attr && attr->redirs)
+    {
+        struct redir_fds r;
+        if (!redir_open(attr->redirs, attr->fds, &r)) return -1;
+        struct sh_spawn_attr opened = *attr;
+        memcpy(opened.fds, r.fds, sizeof(opened.fds));
+        opened.redirs = NULL;
+        pid_t pid = sh_spawn_with_attr(sh, argv, &opened);
+        redir_close(&r);
+        return pid;
+    }
+
+    enum sh_spawn_backend backend = sh_spawn_backend_resolve(sh);
+    if (sh->paths == NULL || strchr(argv[0], '/'))
+    {
+        struct spawn_target t = {argv[0], true, -1, false, attr};
+        pid_t pid = spawn_target(sh, backend, &t, argv);
+        if (pid < 0) perror(argv[0]);
+        return pid;
+    }
+
+    struct spawn_target t = {NULL, false, -1, false, attr};
+    t.path = sh_path_lookup_fd(sh->paths, argv[0], &t.fd);
+    pid_t pid = -1;
+    if (t.path) pid = spawn_target(sh, backend, &t, argv);
+
+    // The cached binary is gone: forget it and search PATH once more
+    if (t.path && pid < 0 && errno == ENOENT)
+    {
+        sh_path_forget(sh->paths, argv[0]);
+        t.path = sh_path_lookup_fd(sh->paths, argv[0], &t.fd);
+        if (t.path) pid = spawn_target(sh, backend, &t, argv);
+    }
+
+    // Not in the cache, as for a command found through a relative PATH
+    // entry: let exec search PATH itself
+    if (t.path == NULL)
+    {
+        t = (struct spawn_target){argv[0], true, -1, false, attr};
+        pid = spawn_target(sh, backend, &t, argv);
+    }
+
+    if (pid < 0) perror(argv[0]);
+    else if (t.via_fd) sh->paths->stats.fd_launches++;
+    else if (t.fd >= 0) path_fd_refuse(sh->paths, argv[0]);
+    return pid;
+}
+
+/*
+ * Event loop. The terminal, running children and timers are all file
+ * descriptors in one epoll set: children are watched through a pidfd and
+ * timers through a timerfd, so there is no SIGCHLD handler and no window
+ * between checking for an exit and going to sleep. A child is reaped only
+ * when its pidfd is readable, so waitpid never blocks.
+ *
+ * Watches cancelled while events are being dispatched are parked on a list
+ * and freed once the outermost batch is done, since a later event in the
+ * same batch may still point at them. Batches nest when a callback waits
+ * for a foreground child.
+ */
+
+#define LOOP_EVENTS 32
+
+enum watch_kind
+{
+    WATCH_FD,
+    WATCH_EVENT, // an fd that is not paused with the terminal
+    WATCH_CHILD,
+    WATCH_TIMER,
+};
+
+struct sh_watch
+{
+    struct sh_watch *prev; // all live watches
+    struct sh_watch *next;
+    enum watch_kind kind;
+    int fd;          // the watched fd, pidfd or timerfd
+    bool owns_fd;    // close fd when the watch goes away
+    bool registered; // in the epoll set; false for fds epoll refuses
+    bool dead;       // cancelled, freed after the current batch
+    pid_t pid;
+    bool repeat;
+    void *ctx;
+    union
+    {
+        void (*ready)(void *ctx);
+        void (*exited)(void *ctx, pid_t pid, int status);
+    } fn;
+};
+
+struct sh_loop
+{
+    const struct sh_allocator *alloc;
+    int epfd;
+    size_t paused;       // nesting depth of sh_loop_pause_fds
+    size_t always_ready; // fd watches that could not go in the epoll set
+    size_t depth;        // nesting depth of sh_loop_run_once
+    struct sh_watch *watches;
+    struct sh_watch *dead;
+};
+
+/**
+ * @brief Create an event loop
+ *
+ * @param a The allocator, NULL for the heap
+ * @return The loop, or NULL on failure
+ */
+struct sh_loop *sh_loop_create(const struct sh_allocator *a)
+{
+    struct sh_loop *loop = sh_alloc(a, sizeof(*loop));
+    if (!loop)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    memset(loop, 0, sizeof(*loop));
+    loop->alloc = a;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+    {
+        perror("epoll_create1");
+        sh_free(a, loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+static void loop_release(struct sh_loop *loop, struct sh_watch *w)
+{
+    if (w->owns_fd) close(w->fd);
+    sh_free(loop->alloc, w);
+}
+
+/**
+ * @brief Destroy an event loop and all of its watches. Children still being
+ * watched are not reaped.
+ *
+ * @param loop The loop to destroy
+ */
+void sh_loop_destroy(struct sh_loop *loop)
+{
+    if (loop == NULL) return;
+
+    for (struct sh_watch *w = loop->watches, *next; w; w = next)
+    {
+        next = w->next;
+        loop_release(loop, w);
+    }
+    for (struct sh_watch *w = loop->dead, *next; w; w = next)
+    {
+        next = w->next;
+        loop_release(loop, w);
+    }
+
+    close(loop->epfd);
+    sh_free(loop->alloc, loop);
+}
+
+static struct sh_watch *loop_add(struct sh_loop *loop, enum watch_kind kind, int fd, bool owns_fd, void *ctx)
+{
+    struct sh_watch *w = sh_alloc(loop->alloc, sizeof(*w));
+    if (!w)
+    {
+        perror("malloc");
+        if (owns_fd) close(fd);
+        return NULL;
+    }
+
+    memset(w, 0, sizeof(*w));
+    w->kind = kind;
+    w->fd = fd;
+    w->owns_fd = owns_fd;
+    w->ctx = ctx;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = w};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) w->registered = true;
+    else if (kind == WATCH_FD && errno == EPERM) loop->always_ready++; // a regular file is always readable
+    else
+    {
+        perror("epoll_ctl");
+        if (owns_fd) close(fd);
+        sh_free(loop->alloc, w);
+        return NULL;
+    }
+
+    if (w->registered && kind == WATCH_FD && loop->paused) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    w->next = loop->watches;
+    if (w->next) w->next->prev = w;
+    loop->watches = w;
+    return w;
+}
+
+/**
+ * @brief Call fn whenever fd is readable. A regular file, which epoll cannot
+ * watch, counts as always readable.
+ *
+ * @param loop The loop
+ * @param fd The fd to watch, it stays owned by the caller
+ * @param fn Called with ctx when fd is readable
+ * @param ctx Passed to fn
+ * @return The watch, or NULL on failure
+ */
+struct sh_watch *sh_loop_watch_fd(struct sh_loop *loop, int fd, void (*fn)(void *ctx), void *ctx)
+{
+    struct sh_watch *w = loop_add(loop, WATCH_FD, fd, false, ctx);
+    if (w) w->fn.ready = fn;
+    return w;
+}
+
+/**
+ * @brief Like sh_loop_watch_fd, but fn keeps being called while fds are
+ * paused. For kernel event sources the shell itself consumes, such as
+ * inotify, that must not wait for a foreground job to finish.
+ *
+ * @param loop The loop
+ * @param fd The fd to watch, it stays owned by the caller
+ * @param fn Called with ctx when fd is readable
+ * @param ctx Passed to fn
+ * @return The watch, or NULL on failure
+ */
+struct sh_watch *sh_loop_watch_event_fd(struct sh_loop *loop, int fd, void (*fn)(void *ctx), void *ctx)
+{
+    struct sh_watch *w = loop_add(loop, WATCH_EVENT, fd, false, ctx);
+    if (w) w->fn.ready = fn;
+    return w;
+}
+
+/**
+ * @brief Reap a child when it exits and call fn with its wait status. The
+ * watch goes away by itself once fn has been called.
+ *
+ * @param loop The loop
+ * @param pid A child of this process that has not been reaped
+ * @param fn Called with ctx, the pid and its waitpid status
+ * @param ctx Passed to fn
+ * @return The watch, or NULL if the child cannot be watched (errno is set)
+ */
+struct sh_watch *sh_loop_watch_child(struct sh_loop *loop, pid_t pid,
+                                     void (*fn)(void *ctx, pid_t pid, int status), void *ctx)
+{
+    // An unreaped child keeps its pid, so opening the pidfd after the
+    // spawn cannot race with pid reuse
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) return NULL;
+
+    struct sh_watch *w = loop_add(loop, WATCH_CHILD, pidfd, true, ctx);
+    if (w)
+    {
+        w->pid = pid;
+        w->fn.exited = fn;
+    }
+    return w;
+}
+
+/**
+ * @brief Call fn after ms milliseconds, and every ms milliseconds after that
+ * if repeat is set. A one shot timer goes away by itself once it fires.
+ *
+ * @param loop The loop
+ * @param ms The delay in milliseconds, at least 1
+ * @param repeat Whether the timer keeps firing
+ * @param fn Called with ctx when the timer fires
+ * @param ctx Passed to fn
+ * @return The watch, or NULL on failure
+ */
+struct sh_watch *sh_loop_add_timer(struct sh_loop *loop, unsigned ms, bool repeat, void (*fn)(void *ctx), void *ctx)
+{
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (tfd < 0)
+    {
+        perror("timerfd_create");
+        return NULL;
+    }
+
+    if (ms == 0) ms = 1;
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    struct itimerspec spec = {.it_value = ts};
+    if (repeat) spec.it_interval = ts;
+    if (timerfd_settime(tfd, 0, &spec, NULL) < 0)
+    {
+        perror("timerfd_settime");
+        close(tfd);
+        return NULL;
+    }
+
+    struct sh_watch *w = loop_add(loop, WATCH_TIMER, tfd, true, ctx);
+    if (w)
+    {
+        w->repeat = repeat;
+        w->fn.ready = fn;
+    }
+    return w;
+}
+
+/**
+ * @brief Remove a watch. Safe to call from any callback, including the
+ * watch's own. A cancelled child watch leaves the child unreaped.
+ *
+ * @param loop The loop
+ * @param w The watch to remove
+ */
+void sh_loop_cancel(struct sh_loop *loop, struct sh_watch *w)
+{
+    if (w == NULL || w->dead) return;
+
+    if (!w->registered) loop->always_ready--;
+    else if (w->kind != WATCH_FD || !loop->paused) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+    if (w->prev) w->prev->next = w->next;
+    else loop->watches = w->next;
+    if (w->next) w->next->prev = w->prev;
+
+    w->dead = true;
+    w->prev = NULL;
+    w->next = loop->dead;
+    loop->dead = w;
+}
+
+/**
+ * @brief Stop or resume dispatching fd watches. A foreground job owns the
+ * terminal, so the shell must not read it until the job is done. Calls
+ * nest; fds are watched again after the last resume.
+ *
+ * @param loop The loop
+ * @param paused True to pause, false to resume
+ */
+void sh_loop_pause_fds(struct sh_loop *loop, bool paused)
+{
+    if (paused ? loop->paused++ > 0 : --loop->paused > 0) return;
+
+    // The fds leave the epoll set altogether, since epoll reports a hangup
+    // even on an fd that is not waiting for anything
+    for (struct sh_watch *w = loop->watches; w; w = w->next)
+    {
+        if (w->kind != WATCH_FD || !w->registered) continue;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = w};
+        epoll_ctl(loop->epfd, paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, w->fd, &ev);
+    }
+}
+
+static void loop_dispatch(struct sh_loop *loop, struct sh_watch *w)
+{
+    if (w->dead) return;
+
+    switch (w->kind)
+    {
+    case WATCH_FD:
+        if (!loop->paused) w->fn.ready(w->ctx);
+        break;
+    case WATCH_EVENT:
+        w->fn.ready(w->ctx);
+        break;
+    case WATCH_TIMER:
+    {
+        uint64_t expirations;
+        if (read(w->fd, &expirations, sizeof(expirations)) < 0) return;
+        if (!w->repeat) sh_loop_cancel(loop, w);
+        w->fn.ready(w->ctx);
+        break;
+    }
+    case WATCH_CHILD:
+    {
+        int status;
+        pid_t pid = waitpid(w->pid, &status, WNOHANG);
+        if (pid == 0) return;
+        // Someone else reaped it and its status is lost: never report
+        // that as a clean exit
+        if (pid < 0) status = W_EXITCODE(255, 0);
+        sh_loop_cancel(loop, w);
+        w->fn.exited(w->ctx, w->pid, status);
+        break;
+    }
+    }
+}
+
+/**
+ * @brief Wait for events and dispatch them
+ *
+ * @param loop The loop
+ * @param timeout_ms How long to wait, -1 to wait until something happens
+ * @return The number of events dispatched, or -1 on error
+ */
+int sh_loop_run_once(struct sh_loop *loop, int timeout_ms)
+{
+    // Watches on regular files never block
+    if (loop->always_ready && !loop->paused) timeout_ms = 0;
+
+    struct epoll_event events[LOOP_EVENTS];
+    int n = epoll_wait(loop->epfd, events, LOOP_EVENTS, timeout_ms);
+    if (n < 0)
+    {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+
+    loop->depth++;
+    for (int i = 0; i < n; i++) loop_dispatch(loop, events[i].data.ptr);
+
+    if (loop->always_ready && !loop->paused)
+    {
+        for (struct sh_watch *w = loop->watches, *next; w; w = next)
+        {
+            next = w->next;
+            if (w->kind == WATCH_FD && !w->registered)
+            {
+                loop_dispatch(loop, w);
+                n++;
+            }
+        }
+    }
+
+    if (--loop->depth == 0)
+    {
+        for (struct sh_watch *w = loop->dead, *next; w; w = next)
+        {
+            next = w->next;
+            loop_release(loop, w);
+        }
+        loop->dead = NULL;
+    }
+
+    return n;
+}
+
+
+/*
+ * Fork server. Launch cost follows the size of the process that forks, and
+ * a long lived shell keeps growing (history, caches). With the forkserver
+ * backend sh_init forks a helper while the shell is still small, and every
+ * external command is forked by the helper instead. The two talk over a
+ * SOCK_SEQPACKET socket:
+ *
+ *   shell -> helper  spawn request: header, path, argv, environ, plus the
+ *                    shell's stdin, stdout, stderr and cwd (and the exec fd
+ *                    of a hot command) as SCM_RIGHTS
+ *   helper -> shell  SERVER_SPAWNED with the pid and a pidfd, or an errno
+ *   helper -> shell  SERVER_EXITED with the wait status once it reaps a child
+ *
+ * The commands are children of the helper, so the shell cannot waitpid
+ * them; it learns their status from SERVER_EXITED, either through its event
+ * loop or by reading the socket directly. If the helper goes away, the
+ * shell goes back to spawning locally.
+ */
+
+// Largest spawn request; longer command lines are spawned locally
+#define SERVER_MSG_MAX 65536
+
+// fds passed with a request: stdin, stdout, stderr, cwd and the exec fd
+#define SERVER_FDS 5
+
+enum server_reply_type
+{
+    SERVER_SPAWNED,
+    SERVER_EXITED,
+};
+
+struct server_request
+{
+    uint32_t argc;
+    uint32_t envc;
+    uint8_t search;  // look path up in PATH
+    uint8_t exec_fd; // the fifth fd is the binary
+    int32_t pgid;    // process group to put the child in, -1 for none
+};
+
+struct server_reply
+{
+    uint32_t type;
+    pid_t pid;
+    int32_t value; // SERVER_SPAWNED: errno, or on success whether the exec fd was used
+                   // SERVER_EXITED: the wait status
+};
+
+// A command the helper started for us
+struct server_child
+{
+    struct server_child *next;
+    pid_t pid;
+    int pidfd;
+    bool exited;
+    int status;
+    void (*fn)(void *ctx, pid_t pid, int status); // set by sh_watch_child
+    void *ctx;
+};
+
+struct sh_forkserver
+{
+    const struct sh_allocator *alloc;
+    pid_t pid;
+    int sock;
+    bool dead;
+    char *buf; // SERVER_MSG_MAX bytes for building requests
+    struct sh_loop *loop;
+    struct sh_watch *watch;
+    struct server_child *children;
+};
+
+/**
+ * @brief Pack a spawn request: the header, then the path, argv and environ
+ * back to back, NUL terminated
+ *
+ * @param buf SERVER_MSG_MAX bytes
+ * @param t What to exec
+ * @param argv The arguments
+ * @param len Receives the length of the request
+ * @return False with errno E2BIG if it does not fit
+ */
+static bool request_pack(char *buf, const struct spawn_target *t, char *const argv[], size_t *len)
+{
+    struct server_request req = {0, 0, t->search, t->fd >= 0, t->attr ? t->attr->pgid : -1};
+    const char *const *lists[] = {(const char *const[]){t->path, NULL}, (const char *const *)argv,
+                                  (const char *const *)environ};
+    uint32_t counts[3] = {0, 0, 0};
+
+    size_t used = sizeof(req);
+    for (size_t l = 0; l < 3; l++)
+    {
+        for (const char *const *s = lists[l]; s && *s; s++, counts[l]++)
+        {
+            size_t n = strlen(*s) + 1;
+            if (used + n > SERVER_MSG_MAX)
+            {
+                errno = E2BIG;
+                return false;
+            }
+            memcpy(buf + used, *s, n);
+            used += n;
+        }
+    }
+
+    req.argc = counts[1];
+    req.envc = counts[2];
+    memcpy(buf, &req, sizeof(req));
+    *len = used;
+    return true;
+}
+
+/**
+ * @brief Unpack a spawn request in place
+ *
+ * @param buf The request
+ * @param len Its length
+ * @param req Receives the header
+ * @return The path, then argv and envp each NULL terminated, in one
+ * malloc'd array; or NULL with errno set
+ */
+static char **request_unpack(char *buf, size_t len, struct server_request *req)
+{
+    if (len < sizeof(*req))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(req, buf, sizeof(*req));
+
+    char **strs = malloc((1 + req->argc + 1 + req->envc + 1) * sizeof(char *));
+    if (!strs) return NULL;
+
+    char *p = buf + sizeof(*req), *end = buf + len;
+    size_t n = 0;
+    for (; n < 1 + req->argc + req->envc && p < end; n++)
+    {
+        strs[n] = p;
+        p += strnlen(p, (size_t)(end - p)) + 1;
+    }
+    if (n < 1 + req->argc + req->envc)
+    {
+        free(strs);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    memmove(strs + 1 + req->argc + 1, strs + 1 + req->argc, req->envc * sizeof(char *));
+    strs[1 + req->argc] = NULL;
+    strs[1 + req->argc + 1 + req->envc] = NULL;
+    return strs;
+}
+
+// Send a reply, attaching fd if it is not -1
+static void server_reply(int sock, uint32_t type, pid_t pid, int32_t value, int fd)
+{
+    struct server_reply reply = {type, pid, value};
+    struct iovec iov = {&reply, sizeof(reply)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (fd >= 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * @brief Start one requested command in the helper and report the result
+ *
+ * @param sock The socket to the shell
+ * @param buf The request
+ * @param len Its length
+ * @param fds The fds that came with it
+ */
+static void server_start(int sock, char *buf, size_t len, const int fds[SERVER_FDS])
+{
+    struct server_request req;
+    char **strs = request_unpack(buf, len, &req);
+    if (!strs)
+    {
+        server_reply(sock, SERVER_SPAWNED, -1, errno, -1);
+        return;
+    }
+    const char *path = strs[0];
+    char **argv = strs + 1;
+    char **envp = strs + 1 + req.argc + 1;
+
+    volatile int child_errno = 0;
+    volatile bool via_fd = false;
+    pid_t pid = vfork();
+    if (pid == 0)
+    {
+        if (req.pgid >= 0) setpgid(0, req.pgid);
+        dup2(fds[0], STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[2], STDERR_FILENO);
+        // Running the command in the helper's directory would be wrong
+        if (fchdir(fds[3]) < 0)
+        {
+            child_errno = errno;
+            _exit(127);
+        }
+        child_reset_signals();
+        if (req.exec_fd)
+        {
+            via_fd = true;
+            syscall(SYS_execveat, fds[4], "", argv, envp, AT_EMPTY_PATH);
+            via_fd = false;
+        }
+        child_exec(path, req.search, argv, envp);
+        child_errno = errno;
+        _exit(127);
+    }
+    free(strs);
+
+    if (pid < 0)
+    {
+        server_reply(sock, SERVER_SPAWNED, -1, errno, -1);
+        return;
+    }
+    if (child_errno)
+    {
+        waitpid(pid, NULL, 0);
+        server_reply(sock, SERVER_SPAWNED, -1, child_errno, -1);
+        return;
+    }
+
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    server_reply(sock, SERVER_SPAWNED, pid, via_fd, pidfd);
+    if (pidfd >= 0) close(pidfd);
+}
+
+/**
+ * @brief The helper: start commands on request and report their exits
+ * until the shell closes its end of the socket
+ *
+ * @param sock The socket to the shell
+ */
+static void server_main(int sock)
+{
+    // Exits are read from a signalfd, never from a handler
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sigfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sigfd < 0) _exit(1);
+
+    char *buf = malloc(SERVER_MSG_MAX);
+    if (!buf) _exit(1);
+
+    struct pollfd pfd[2] = {{sock, POLLIN, 0}, {sigfd, POLLIN, 0}};
+    for (;;)
+    {
+        if (poll(pfd, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (pfd[1].revents)
+        {
+            struct signalfd_siginfo si;
+            while (read(sigfd, &si, sizeof(si)) > 0)
+                ;
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) server_reply(sock, SERVER_EXITED, pid, status, -1);
+        }
+
+        if (pfd[0].revents)
+        {
+            union
+            {
+                char buf[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+                struct cmsghdr align;
+            } control;
+            struct iovec iov = {buf, SERVER_MSG_MAX};
+            struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                                 .msg_controllen = sizeof(control.buf)};
+            ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (len <= 0)
+            {
+                if (len < 0 && errno == EINTR) continue;
+                break;
+            }
+
+            int fds[SERVER_FDS] = {-1, -1, -1, -1, -1};
+            size_t nfds = 0;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                if (nfds > SERVER_FDS) nfds = SERVER_FDS;
+                memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+            }
+
+            if (nfds >= 4) server_start(sock, buf, (size_t)len, fds);
+            else server_reply(sock, SERVER_SPAWNED, -1, EINVAL, -1);
+            for (size_t i = 0; i < nfds; i++) close(fds[i]);
+        }
+    }
+
+    _exit(0);
+}
+
+static void server_finish(struct sh_forkserver *server, struct server_child *c)
+{
+    struct server_child **link = &server->children;
+    while (*link != c) link = &(*link)->next;
+    *link = c->next;
+
+    if (c->pidfd >= 0) close(c->pidfd);
+    void (*fn)(void *, pid_t, int) = c->fn;
+    void *ctx = c->ctx;
+    pid_t pid = c->pid;
+    int status = c->status;
+    sh_free(server->alloc, c);
+
+    if (fn) fn(ctx, pid, status);
+}
+
+// Record an exit, and report it if someone is watching for it
+static void server_exited(struct sh_forkserver *server, pid_t pid, int status)
+{
+    for (struct server_child *c = server->children; c; c = c->next)
+    {
+        if (c->pid != pid) continue;
+        c->exited = true;
+        c->status = status;
+        if (c->fn) server_finish(server, c);
+        return;
+    }
+}
+
+// The helper is gone: its children can no longer be waited for
+static void server_lost(struct sh_forkserver *server)
+{
+    server->dead = true;
+    if (server->watch) sh_loop_cancel(server->loop, server->watch);
+    server->watch = NULL;
+
+    // Reap it now, or its zombie sits in front of every job the reaper
+    // looks for
+    kill(server->pid, SIGKILL);
+    waitpid(server->pid, NULL, 0);
+    server->pid = -1;
+
+    for (struct server_child *c = server->children; c; c = c->next)
+    {
+        if (c->exited) continue;
+        c->exited = true;
+        c->status = W_EXITCODE(255, 0);
+    }
+    for (struct server_child *c = server->children, *next; c; c = next)
+    {
+        next = c->next;
+        if (c->fn) server_finish(server, c);
+    }
+}
+
+/**
+ * @brief Read one message from the helper and handle it
+ *
+ * @param server The server
+ * @param block Wait for a message
+ * @param reply Receives the message
+ * @param pidfd Receives the fd that came with it, or -1
+ * @return 1 if a message was read, 0 if none was waiting, -1 if the helper
+ * is gone
+ */
+static int server_recv(struct sh_forkserver *server, bool block, struct server_reply *reply, int *pidfd)
+{
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {reply, sizeof(*reply)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+
+    ssize_t len;
+    while ((len = recvmsg(server->sock, &msg, MSG_CMSG_CLOEXEC | (block ? 0 : MSG_DONTWAIT))) < 0 && errno == EINTR)
+        ;
+    if (len < 0 && errno == EAGAIN) return 0;
+    if (len != sizeof(*reply))
+    {
+        server_lost(server);
+        return -1;
+    }
+
+    *pidfd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(pidfd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (reply->type == SERVER_EXITED)
+    {
+        if (*pidfd >= 0) close(*pidfd);
+        server_exited(server, reply->pid, reply->value);
+    }
+    return 1;
+}
+
+// Handle every message that is waiting, from the event loop
+static void server_ready(void *ctx)
+{
+    struct sh_forkserver *server = ctx;
+    struct server_reply reply;
+    int pidfd;
+    while (!server->dead && server_recv(server, false, &reply, &pidfd) > 0)
+    {
+        // Spawn replies are read by server_spawn, so one here is stray
+        if (reply.type == SERVER_SPAWNED && pidfd >= 0) close(pidfd);
+    }
+}
+
+// Wait for and handle one message from the helper, for callers without a loop
+static int server_pump(struct sh_forkserver *server)
+{
+    struct server_reply reply;
+    int pidfd;
+    int n = server_recv(server, true, &reply, &pidfd);
+    if (n > 0 && reply.type == SERVER_SPAWNED && pidfd >= 0) close(pidfd);
+    return n;
+}
+
+/**
+ * @brief Start a fork server while the shell is still small. Commands
+ * spawned through it are forked by the helper, so their launch cost does
+ * not grow with the shell.
+ *
+ * @param a The allocator, NULL for the heap
+ * @param loop The shell's event loop to receive exits through, or NULL to
+ * read them only while waiting
+ * @return The server, or NULL on failure
+ */
+struct sh_forkserver *sh_forkserver_start(const struct sh_allocator *a, struct sh_loop *loop)
+{
+    struct sh_forkserver *server = sh_alloc(a, sizeof(*server));
+    char *buf = sh_alloc(a, SERVER_MSG_MAX);
+    if (!server || !buf)
+    {
+        perror("malloc");
+        sh_free(a, server);
+        sh_free(a, buf);
+        return NULL;
+    }
+    memset(server, 0, sizeof(*server));
+    server->alloc = a;
+    server->loop = loop;
+    server->buf = buf;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        perror("socketpair");
+        sh_free(a, buf);
+        sh_free(a, server);
+        return NULL;
+    }
+
+    server->pid = fork();
+    if (server->pid == 0)
+    {
+        close(sv[0]);
+        server_main(sv[1]);
+    }
+    close(sv[1]);
+    if (server->pid < 0)
+    {
+        perror("fork");
+        close(sv[0]);
+        sh_free(a, buf);
+        sh_free(a, server);
+        return NULL;
+    }
+
+    server->sock = sv[0];
+    if (loop) server->watch = sh_loop_watch_event_fd(loop, server->sock, server_ready, server);
+    return server;
+}
+
+/**
+ * @brief Stop a fork server. Commands it started keep running but can no
+ * longer be waited for.
+ *
+ * @param server The server
+ */
+void sh_forkserver_stop(struct sh_forkserver *server)
+{
+    if (server == NULL) return;
+
+    if (server->watch) sh_loop_cancel(server->loop, server->watch);
+    close(server->sock);
+    if (server->pid > 0) waitpid(server->pid, NULL, 0);
+
+    for (struct server_child *c = server->children, *next; c; c = next)
+    {
+        next = c->next;
+        if (c->pidfd >= 0) close(c->pidfd);
+        sh_free(server->alloc, c);
+    }
+    sh_free(server->alloc, server->buf);
+    sh_free(server->alloc, server);
+}
+
+/**
+ * @brief Have the helper start a command
+ *
+ * @param server The server
+ * @param t What to exec
+ * @param argv The arguments
+ * @return The pid, or -1 with errno set
+ */
+static pid_t server_spawn(struct sh_forkserver *server, struct spawn_target *t, char *const argv[])
+{
+    struct server_child *c = sh_alloc(server->alloc, sizeof(*c));
+    char *buf = server->buf;
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    pid_t pid = -1;
+    if (!c || cwd < 0)
+    {
+        if (!c) errno = ENOMEM;
+        goto out;
+    }
+
+    size_t len;
+    if (!request_pack(buf, t, argv, &len)) goto out;
+
+    int fds[SERVER_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd, t->fd};
+    for (int i = 0; t->attr && i < 3; i++)
+    {
+        if (t->attr->fds[i] >= 0) fds[i] = t->attr->fds[i];
+    }
+    size_t nfds = t->fd >= 0 ? 5 : 4;
+    union
+    {
+        char buf[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    ssize_t sent;
+    while ((sent = sendmsg(server->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (sent < 0)
+    {
+        server_lost(server);
+        errno = EAGAIN;
+        goto out;
+    }
+
+    // Exits of earlier commands may arrive before the reply
+    struct server_reply reply;
+    int pidfd;
+    do
+    {
+        if (server_recv(server, true, &reply, &pidfd) < 0)
+        {
+            errno = EAGAIN;
+            goto out;
+        }
+    } while (reply.type != SERVER_SPAWNED);
+
+    if (reply.pid < 0)
+    {
+        errno = reply.value;
+        goto out;
+    }
+
+    c->pid = pid = reply.pid;
+    c->pidfd = pidfd;
+    c->exited = false;
+    c->fn = NULL;
+    c->next = server->children;
+    server->children = c;
+    c = NULL;
+    t->via_fd = reply.value;
+
+out:
+    if (cwd >= 0) close(cwd);
+    sh_free(server->alloc, c);
+    return pid;
+}
+
+static bool server_alive(const struct sh_forkserver *server)
+{
+    return server && !server->dead;
+}
+
+/**
+ * @brief Call fn once a command started by the helper exits
+ *
+ * @param server The server
+ * @param pid The command
+ * @param fn Called with ctx, the pid and its wait status
+ * @param ctx Passed to fn
+ * @return False if the helper did not start pid
+ */
+static bool server_watch(struct sh_forkserver *server, pid_t pid, void (*fn)(void *ctx, pid_t pid, int status),
+                         void *ctx)
+{
+    for (struct server_child *c = server->children; c; c = c->next)
+    {
+        if (c->pid != pid) continue;
+        c->fn = fn;
+        c->ctx = ctx;
+        if (c->exited) server_finish(server, c);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Call fn with the wait status of a child once it exits, whether the
+ * shell or its fork server started it. The child must not be waited for
+ * any other way.
+ *
+ * @param sh The shell
+ * @param pid The child
+ * @param fn Called with ctx, the pid and its wait status
+ * @param ctx Passed to fn
+ * @return True if the child is being watched, false if it cannot be
+ */
+bool sh_watch_child(struct shell *sh, pid_t pid, void (*fn)(void *ctx, pid_t pid, int status), void *ctx)
+{
+    if (sh->server && server_watch(sh->server, pid, fn, ctx)) return true;
+    return sh->loop && sh_loop_watch_child(sh->loop, pid, fn, ctx);
+}
+
+/*
+ * Speculative pre-fork. An interactive user pays for fork between pressing
+ * Enter and seeing output, while the shell sat idle just before. So while
+ * readline waits, the shell keeps one spare child forked, with signals
+ * reset, blocked on a socket. Running a command then only sends the
+ * request (the same format as the fork server uses) and the spare execs.
+ *
+ * The spare blocks the job control signals while it waits, so a Ctrl-C at
+ * the prompt does not kill it, and drops any that arrived before it execs.
+ * It replies with one byte when it is about to exec and with an errno if
+ * the exec fails, so the shell can tell a spare that died from a command
+ * that started. A spare is a snapshot of the shell, so state the request
+ * does not carry (the cwd) must not change under it: cd discards it.
+ */
+
+struct sh_prefork
+{
+    const struct sh_allocator *alloc;
+    pid_t pid; // the spare, -1 if there is none
+    int sock;
+    char *buf; // SERVER_MSG_MAX bytes for building requests
+    struct sh_prefork_stats stats;
+};
+
+/**
+ * @brief Create a pre-fork pool. No spare is forked until sh_prefork_arm.
+ *
+ * @param a The allocator, NULL for the heap
+ * @return The pool, or NULL if memory ran out
+ */
+struct sh_prefork *sh_prefork_create(const struct sh_allocator *a)
+{
+    struct sh_prefork *p = sh_alloc(a, sizeof(*p));
+    char *buf = sh_alloc(a, SERVER_MSG_MAX);
+    if (!p || !buf)
+    {
+        perror("malloc");
+        sh_free(a, p);
+        sh_free(a, buf);
+        return NULL;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->alloc = a;
+    p->pid = -1;
+    p->sock = -1;
+    p->buf = buf;
+    return p;
+}
+
+/**
+ * @brief The spare: wait for one command and exec it
+ *
+ * @param sock The socket to the shell
+ * @param buf SERVER_MSG_MAX bytes to receive the request in
+ */
+static void spare_main(int sock, char *buf)
+{
+    sigset_t job;
+    sigemptyset(&job);
+    for (size_t i = 0; i < sizeof(child_default_signals) / sizeof(child_default_signals[0]); i++)
+    {
+        sigaddset(&job, child_default_signals[i]);
+    }
+    sigprocmask(SIG_BLOCK, &job, NULL);
+
+    ssize_t len;
+    while ((len = recv(sock, buf, SERVER_MSG_MAX, 0)) < 0 && errno == EINTR)
+        ;
+    if (len <= 0) _exit(0);
+
+    struct server_request req;
+    char **strs = request_unpack(buf, (size_t)len, &req);
+    if (!strs)
+    {
+        int err = errno;
+        send(sock, "", 1, MSG_NOSIGNAL);
+        send(sock, &err, sizeof(err), MSG_NOSIGNAL);
+        _exit(127);
+    }
+
+    // Signals sent while this was a spare were meant for the shell
+    struct timespec now = {0, 0};
+    while (sigtimedwait(&job, NULL, &now) > 0)
+        ;
+    sigprocmask(SIG_UNBLOCK, &job, NULL);
+
+    send(sock, "", 1, MSG_NOSIGNAL);
+    char **argv = strs + 1;
+    char **envp = strs + 1 + req.argc + 1;
+    child_exec(strs[0], req.search, argv, envp);
+    int err = errno;
+    send(sock, &err, sizeof(err), MSG_NOSIGNAL);
+    _exit(127);
+}
+
+/**
+ * @brief Make sure a spare is waiting. Call it before waiting for input.
+ *
+ * @param p The pool
+ * @return True if a spare is ready
+ */
+bool sh_prefork_arm(struct sh_prefork *p)
+{
+    if (p->pid > 0) return true;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return false;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sv[0]);
+        child_reset_signals();
+        spare_main(sv[1], p->buf);
+    }
+    close(sv[1]);
+    if (pid < 0)
+    {
+        close(sv[0]);
+        return false;
+    }
+
+    p->pid = pid;
+    p->sock = sv[0];
+    p->stats.spares++;
+    return true;
+}
+
+// Let go of the spare, which has exec'd or died, without waiting for it
+static void prefork_release(struct sh_prefork *p)
+{
+    close(p->sock);
+    p->sock = -1;
+    p->pid = -1;
+}
+
+/**
+ * @brief Get rid of the spare, because the shell changed in a way it would
+ * not see. The next sh_prefork_arm forks a new one.
+ *
+ * @param p The pool, may be NULL
+ */
+void sh_prefork_discard(struct sh_prefork *p)
+{
+    if (p == NULL || p->pid < 0) return;
+
+    // Closing the socket makes the spare exit
+    pid_t pid = p->pid;
+    prefork_release(p);
+    waitpid(pid, NULL, 0);
+    p->stats.discards++;
+}
+
+/**
+ * @brief Free a pre-fork pool, reaping its spare
+ *
+ * @param p The pool
+ */
+void sh_prefork_destroy(struct sh_prefork *p)
+{
+    if (p == NULL) return;
+
+    sh_prefork_discard(p);
+    sh_free(p->alloc, p->buf);
+    sh_free(p->alloc, p);
+}
+
+/**
+ * @brief Get the counters kept by a pre-fork pool
+ *
+ * @param p The pool
+ * @return A copy of the counters
+ */
+struct sh_prefork_stats sh_prefork_get_stats(const struct sh_prefork *p)
+{
+    return p->stats;
+}
+
+/**
+ * @brief Run a command in the spare, if there is one
+ *
+ * @param p The pool
+ * @param t What to exec
+ * @param argv The arguments
+ * @param used Set if the spare took the command; if not, the caller should
+ * spawn it another way
+ * @return The pid, or -1 with errno set
+ */
+static pid_t prefork_spawn(struct sh_prefork *p, struct spawn_target *t, char *const argv[], bool *used)
+{
+    *used = false;
+    if (p->pid < 0) return -1;
+
+    size_t len;
+    if (!request_pack(p->buf, t, argv, &len)) return -1;
+
+    pid_t pid = p->pid;
+    char ack;
+    int err;
+    ssize_t n = send(p->sock, p->buf, len, MSG_NOSIGNAL);
+    if (n > 0)
+    {
+        while ((n = recv(p->sock, &ack, 1, 0)) < 0 && errno == EINTR)
+            ;
+    }
+    if (n <= 0)
+    {
+        // The spare died before it got the command
+        prefork_release(p);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    *used = true;
+    p->stats.launches++;
+    while ((n = recv(p->sock, &err, sizeof(err), 0)) < 0 && errno == EINTR)
+        ;
+    prefork_release(p);
+
+    // End of file: the socket was closed by a successful exec
+    if (n == sizeof(err))
+    {
+        waitpid(pid, NULL, 0);
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Defined with the job table
+static size_t jobs_reap(struct shell *sh);
+
+struct wait_result
+{
+    bool done;
+    int status;
+};
+
+static void wait_done(void *ctx, pid_t pid, int status)
+{
+    UNUSED(pid);
+    struct wait_result *r = ctx;
+    r->done = true;
+    r->status = status;
+}
+
+/**
+ * @brief Wait for a foreground child. The shell's event loop keeps running
+ * timers and reaping other children meanwhile, but does not read the
+ * terminal. Without a loop, or if the child cannot be watched, this is a
+ * plain blocking waitpid.
+ *
+ * @param sh The shell
+ * @param pid The child
+ * @return The waitpid status of the child, or -1 on error
+ */
+int sh_wait(struct shell *sh, pid_t pid)
+{
+    struct wait_result r = {false, -1};
+    struct sh_watch *w = NULL;
+    bool served = sh->server && server_watch(sh->server, pid, wait_done, &r);
+    if (!served && sh->loop) w = sh_loop_watch_child(sh->loop, pid, wait_done, &r);
+    if (!served && w == NULL)
+    {
+        int status;
+        while (waitpid(pid, &status, 0) < 0)
+        {
+            if (errno != EINTR) return -1;
+        }
+        return status;
+    }
+
+    // Without a loop, exits from the fork server are read off its socket
+    bool use_loop = sh->loop && (!served || sh->server->watch);
+    if (use_loop) sh_loop_pause_fds(sh->loop, true);
+    while (!r.done)
+    {
+        int n = use_loop ? sh_loop_run_once(sh->loop, -1) : server_pump(sh->server);
+        if (n < 0)
+        {
+            if (w == NULL) break;
+            sh_loop_cancel(sh->loop, w);
+            waitpid(pid, &r.status, 0);
+            break;
+        }
+    }
+    if (use_loop) sh_loop_pause_fds(sh->loop, false);
+
+    // Jobs that exited while this child sat unreaped in front of them
+    jobs_reap(sh);
+    return r.status;
+}
+
+/*
+ * Background jobs. A script can keep thousands of jobs in flight, so no
+ * operation walks the table: jobs are kept in an array indexed by id for
+ * %n lookups, in a hash table keyed by pid for the reaper (one entry for
+ * each stage of a pipeline), and the ids of removed jobs go on a min-heap
+ * so a new job takes the smallest free one in O(log n). The array, the
+ * hash table and the heap all grow by doubling.
+ *
+ * Children are reaped in batches by sh_jobs_watch: one SIGCHLD signalfd in
+ * the event loop, and on each wakeup waitid(P_ALL, WNOHANG | WNOWAIT) to
+ * find the next zombie, which is reaped if it is a job. So the loop notices
+ * exits while the shell waits for input or a foreground job, ten thousand
+ * jobs need no more fds than one, and a storm of exits is drained in a
+ * single pass. P_ALL cannot skip a zombie, so the pass stops at a child
+ * that is not a job (a foreground command about to be reaped by its own
+ * watch) and sh_wait runs it again once that child is gone. The spare and
+ * the fork server's helper are reaped on the spot. Any other zombie gets
+ * one more look on the next turn of the loop; if it is still there, the
+ * live jobs are each given a pidfd watch until it goes away.
+ *
+ * Without the reaper a job is watched through sh_watch_child, and if that
+ * fails too (no loop, or out of fds) it is polled with waitpid when jobs
+ * are reported, the one case that walks the table. Finished
+ * jobs are queued in exit order, so reporting them or waiting for the
+ * next one (wait -n) costs nothing per job still running. Jobs are also
+ * linked in the order they started, which gives the current job (%+) and
+ * the previous one (%-) that fg and bg default to.
+ */
+
+// How often jobs that cannot be watched are polled while the shell waits
+#define JOB_POLL_MS 10
+
+struct job_proc
+{
+    struct job_proc *chain;   // next process in the same pid bucket
+    struct job_entry *job;
+    pid_t pid;
+    bool done;
+    int status;
+};
+
+struct job_entry
+{
+    struct sh_job job;        // first, so a struct sh_job * is a struct job_entry *
+    struct job_entry *done_prev; // list of finished jobs not reported yet
+    struct job_entry *done_next;
+    struct job_entry *older;  // list of all jobs in the order they started
+    struct job_entry *newer;
+    bool polled;              // reaped by jobs_poll, not by a watch
+    bool watched;             // reaped by its own watch, not the reaper
+    size_t nprocs;            // one per pipeline stage, job.pid is the last
+    size_t nlive;             // processes not reaped yet
+    struct job_proc procs[];  // followed by the command
+};
+
+struct sh_jobs
+{
+    const struct sh_allocator *alloc;
+    struct job_entry **slots; // slots[id - 1]
+    size_t nslots;            // ids below nslots + 1 have been handed out
+    size_t cap;
+    struct job_proc **buckets;
+    size_t mask;
+    size_t nprocs;            // processes in the buckets
+    int *free_ids;            // min-heap of the ids up to nslots not in use
+    size_t nfree;
+    size_t count;
+    size_t polled;            // jobs with polled set
+    size_t ndone;             // jobs with done set
+    int waiting;              // builtins blocked in sh_jobs_wait, see job_exited
+    struct sh_loop *loop;     // set by sh_jobs_watch
+    struct sh_watch *reaper;
+    int sigfd;                // SIGCHLD signalfd, -1 without the reaper
+    pid_t stalled;            // zombie in front of the reaper that is not a job
+    bool direct;              // it stayed, so jobs are watched one by one
+    struct sh_watch *retry;   // timer to look at it again
+    struct sh_jobs_stats stats;
+    struct job_entry *newest; // the current job
+    struct job_entry *done_head; // finished jobs in the order they exited
+    struct job_entry *done_tail;
+};
+
+// Double an array of elements of size bytes, keeping its contents
+static bool jobs_grow_array(const struct sh_allocator *a, void **array, size_t *cap, size_t size)
+{
+    size_t n = *cap ? *cap * 2 : 16;
+    void *grown = sh_alloc(a, n * size);
+    if (!grown) return false;
+
+    memset(grown, 0, n * size);
+    if (*array) memcpy(grown, *array, *cap * size);
+    sh_free(a, *array);
+    *array = grown;
+    *cap = n;
+    return true;
+}
+
+static size_t job_bucket(const struct sh_jobs *jobs, pid_t pid)
+{
+    return ((uint32_t)pid * 2654435761u) & jobs->mask;
+}
+
+// Double the bucket count once the table holds more than one process per
+// bucket
+static void jobs_grow_buckets(struct sh_jobs *jobs)
+{
+    size_t nbuckets = (jobs->mask + 1) * 2;
+    struct job_proc **old = jobs->buckets;
+    size_t old_mask = jobs->mask;
+    struct job_proc **buckets = sh_alloc(jobs->alloc, nbuckets * sizeof(*buckets));
+    if (!buckets) return; // keep the longer chains
+
+    memset(buckets, 0, nbuckets * sizeof(*buckets));
+    jobs->buckets = buckets;
+    jobs->mask = nbuckets - 1;
+    for (size_t i = 0; i <= old_mask; i++)
+    {
+        for (struct job_proc *p = old[i], *next; p; p = next)
+        {
+            next = p->chain;
+            size_t b = job_bucket(jobs, p->pid);
+            p->chain = buckets[b];
+            buckets[b] = p;
+        }
+    }
+    sh_free(jobs->alloc, old);
+}
+
+static void free_id_push(struct sh_jobs *jobs, int id)
+{
+    size_t i = jobs->nfree++;
+    while (i > 0 && jobs->free_ids[(i - 1) / 2] > id)
+    {
+        jobs->free_ids[i] = jobs->free_ids[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    jobs->free_ids[i] = id;
+}
+
+static int free_id_pop(struct sh_jobs *jobs)
+{
+    int top = jobs->free_ids[0];
+    int last = jobs->free_ids[--jobs->nfree];
+    size_t i = 0;
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= jobs->nfree) break;
+        if (c + 1 < jobs->nfree && jobs->free_ids[c + 1] < jobs->free_ids[c]) c++;
+        if (jobs->free_ids[c] >= last) break;
+        jobs->free_ids[i] = jobs->free_ids[c];
+        i = c;
+    }
+    if (jobs->nfree) jobs->free_ids[i] = last;
+    return top;
+}
+
+/**
+ * @brief Create an empty job table
+ *
+ * @param a The allocator, NULL for the heap
+ * @return The table, or NULL if memory ran out
+ */
+struct sh_jobs *sh_jobs_create(const struct sh_allocator *a)
+{
+    const size_t nbuckets = 64;
+    struct sh_jobs *jobs = sh_alloc(a, sizeof(*jobs));
+    struct job_proc **buckets = sh_alloc(a, nbuckets * sizeof(*buckets));
+    if (!jobs || !buckets)
+    {
+        perror("malloc");
+        sh_free(a, jobs);
+        sh_free(a, buckets);
+        return NULL;
+    }
+
+    memset(jobs, 0, sizeof(*jobs));
+    memset(buckets, 0, nbuckets * sizeof(*buckets));
+    jobs->alloc = a;
+    jobs->buckets = buckets;
+    jobs->mask = nbuckets - 1;
+    jobs->sigfd = -1;
+    return jobs;
+}
+
+/**
+ * @brief Free a job table and its jobs. Their processes are left alone.
+ *
+ * @param jobs The table to destroy
+ */
+void sh_jobs_destroy(struct sh_jobs *jobs)
+{
+    if (jobs == NULL) return;
+
+    if (jobs->reaper)
+    {
+        sigset_t chld;
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sh_loop_cancel(jobs->loop, jobs->reaper);
+        if (jobs->retry) sh_loop_cancel(jobs->loop, jobs->retry);
+        close(jobs->sigfd);
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+    }
+    for (size_t i = 0; i < jobs->nslots; i++) sh_free(jobs->alloc, jobs->slots[i]);
+    sh_free(jobs->alloc, jobs->slots);
+    sh_free(jobs->alloc, jobs->buckets);
+    sh_free(jobs->alloc, jobs->free_ids);
+    sh_free(jobs->alloc, jobs);
+}
+
+// Take a free id and allocate an entry for a job of n processes whose
+// command is len bytes. Nothing is linked in yet.
+static struct job_entry *job_alloc(struct sh_jobs *jobs, size_t n, size_t len)
+{
+    // Make room first so nothing fails once the id is taken. The heap is
+    // kept as big as the array so freeing an id never allocates.
+    if (jobs->nfree == 0 && jobs->nslots == jobs->cap)
+    {
+        size_t cap = jobs->cap;
+        if (!jobs_grow_array(jobs->alloc, (void **)&jobs->free_ids, &cap, sizeof(*jobs->free_ids)) ||
+            !jobs_grow_array(jobs->alloc, (void **)&jobs->slots, &jobs->cap, sizeof(*jobs->slots)))
+        {
+            perror("malloc");
+            return NULL;
+        }
+    }
+    struct job_entry *e = sh_alloc(jobs->alloc, sizeof(*e) + n * sizeof(e->procs[0]) + len + 1);
+    if (!e)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    e->job.id = jobs->nfree ? free_id_pop(jobs) : (int)++jobs->nslots;
+    e->job.command = (char *)&e->procs[n];
+    return e;
+}
+
+// Link a job allocated by job_alloc into the table
+static struct sh_job *job_link(struct sh_jobs *jobs, struct job_entry *e, const pid_t *pids, size_t n, pid_t pgid)
+{
+    e->job = (struct sh_job){e->job.id, pids[n - 1], pgid, false, false, 0, e->job.command};
+    e->done_prev = e->done_next = NULL;
+    e->polled = false;
+    e->watched = false;
+    e->nprocs = e->nlive = n;
+    e->newer = NULL;
+    e->older = jobs->newest;
+    if (jobs->newest) jobs->newest->newer = e;
+    jobs->newest = e;
+    jobs->slots[e->job.id - 1] = e;
+    jobs->stats.started++;
+    jobs->count++;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (jobs->nprocs >= jobs->mask + 1) jobs_grow_buckets(jobs);
+        struct job_proc *p = &e->procs[i];
+        size_t b = job_bucket(jobs, pids[i]);
+        *p = (struct job_proc){jobs->buckets[b], e, pids[i], false, 0};
+        jobs->buckets[b] = p;
+        jobs->nprocs++;
+    }
+    return &e->job;
+}
+
+/**
+ * @brief Add a job for a running child. It gets the smallest free id.
+ *
+ * @param jobs The table
+ * @param pid The child
+ * @param pgid Its process group, 0 if it is in the shell's
+ * @param argv The command it runs, kept as one string
+ * @return The job, or NULL if memory ran out
+ */
+struct sh_job *sh_job_add(struct sh_jobs *jobs, pid_t pid, pid_t pgid, char *const argv[])
+{
+    size_t len = 0;
+    for (size_t i = 0; argv[i]; i++) len += strlen(argv[i]) + 1;
+
+    struct job_entry *e = job_alloc(jobs, 1, len);
+    if (!e) return NULL;
+
+    char *p = e->job.command;
+    for (size_t i = 0; argv[i]; i++)
+    {
+        if (i) *p++ = ' ';
+        size_t n = strlen(argv[i]);
+        memcpy(p, argv[i], n);
+        p += n;
+    }
+    *p = '\0';
+    return job_link(jobs, e, &pid, 1, pgid);
+}
+
+/**
+ * @brief Add a job made of several processes, such as the stages of a
+ * pipeline. It is done once all of them have exited, with the status of
+ * the last one.
+ *
+ * @param jobs The table
+ * @param pids The processes, at least one
+ * @param n How many there are
+ * @param pgid Their process group, 0 if they are in the shell's
+ * @param command The command line they run
+ * @return The job, or NULL if memory ran out
+ */
+struct sh_job *sh_job_add_procs(struct sh_jobs *jobs, const pid_t *pids, size_t n, pid_t pgid, const char *command)
+{
+    if (n == 0) return NULL;
+
+    size_t len = strlen(command);
+    struct job_entry *e = job_alloc(jobs, n, len);
+    if (!e) return NULL;
+
+    memcpy(e->job.command, command, len + 1);
+    return job_link(jobs, e, pids, n, pgid);
+}
+
+/**
+ * @brief Remove a job from its table and free it. Its id can be reused.
+ *
+ * @param jobs The table
+ * @param job The job
+ */
+void sh_job_remove(struct sh_jobs *jobs, struct sh_job *job)
+{
+    struct job_entry *e = (struct job_entry *)job;
+    for (size_t i = 0; i < e->nprocs; i++)
+    {
+        struct job_proc **link = &jobs->buckets[job_bucket(jobs, e->procs[i].pid)];
+        while (*link != &e->procs[i]) link = &(*link)->chain;
+        *link = e->procs[i].chain;
+    }
+    jobs->nprocs -= e->nprocs;
+
+    if (job->done)
+    {
+        if (e->done_prev) e->done_prev->done_next = e->done_next;
+        else jobs->done_head = e->done_next;
+        if (e->done_next) e->done_next->done_prev = e->done_prev;
+        else jobs->done_tail = e->done_prev;
+        jobs->ndone--;
+    }
+    if (e->newer) e->newer->older = e->older;
+    else jobs->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+
+    jobs->slots[job->id - 1] = NULL;
+    jobs->count--;
+    if (e->polled) jobs->polled--;
+    if (jobs->count == 0)
+    {
+        // Start over at %1 once every job is gone
+        jobs->nslots = 0;
+        jobs->nfree = 0;
+    }
+    else
+    {
+        free_id_push(jobs, job->id);
+    }
+    sh_free(jobs->alloc, e);
+}
+
+/**
+ * @brief Look up a job by id
+ *
+ * @return The job, or NULL if there is none with that id
+ */
+struct sh_job *sh_job_get(const struct sh_jobs *jobs, int id)
+{
+    if (id < 1 || (size_t)id > jobs->nslots || jobs->slots[id - 1] == NULL) return NULL;
+    return &jobs->slots[id - 1]->job;
+}
+
+// Look up the process of a job by pid
+static struct job_proc *job_proc_find(const struct sh_jobs *jobs, pid_t pid)
+{
+    for (struct job_proc *p = jobs->buckets[job_bucket(jobs, pid)]; p; p = p->chain)
+    {
+        if (p->pid == pid) return p;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Look up a job by the pid of one of its processes
+ *
+ * @return The job, or NULL if no job runs that pid
+ */
+struct sh_job *sh_job_find(const struct sh_jobs *jobs, pid_t pid)
+{
+    struct job_proc *p = job_proc_find(jobs, pid);
+    return p ? &p->job->job : NULL;
+}
+
+/**
+ * @brief Step through the jobs in id order
+ *
+ * @param jobs The table
+ * @param job The previous job, or NULL for the first
+ * @return The next job, or NULL after the last
+ */
+struct sh_job *sh_job_next(const struct sh_jobs *jobs, const struct sh_job *job)
+{
+    for (size_t i = job ? (size_t)job->id : 0; i < jobs->nslots; i++)
+    {
+        if (jobs->slots[i]) return &jobs->slots[i]->job;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Count the jobs in a table, finished ones included
+ */
+size_t sh_jobs_count(const struct sh_jobs *jobs)
+{
+    return jobs->count;
+}
+
+/**
+ * @brief Look up a job the way the job builtins name them: %n or n for
+ * job n, and %%, %+ or % for the current job (the most recently
+ * started one), %- for the one before it.
+ *
+ * @param jobs The table
+ * @param spec The job spec
+ * @return The job, or NULL if there is no such job
+ */
+struct sh_job *sh_job_parse(const struct sh_jobs *jobs, const char *spec)
+{
+    if (spec[0] == '%') spec++;
+    if (strcmp(spec, "") == 0 || strcmp(spec, "%") == 0 || strcmp(spec, "+") == 0)
+        return jobs->newest ? &jobs->newest->job : NULL;
+    if (strcmp(spec, "-") == 0)
+        return jobs->newest && jobs->newest->older ? &jobs->newest->older->job : NULL;
+
+    char *end;
+    errno = 0;
+    long id = strtol(spec, &end, 10);
+    if (errno || end == spec || *end || id < 1 || id > INT_MAX) return NULL;
+    return sh_job_get(jobs, (int)id);
+}
+
+// Exit status of a job as $? would show it
+static int job_exit_code(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Describe a job the way jobs and the Done notices do
+static void job_state(const struct sh_job *job, char *buf, size_t size)
+{
+    if (!job->done) snprintf(buf, size, "%s", job->stopped ? "Stopped" : "Running");
+    else if (WIFSIGNALED(job->status)) snprintf(buf, size, "%s", strsignal(WTERMSIG(job->status)));
+    else if (WEXITSTATUS(job->status)) snprintf(buf, size, "Exit %d", WEXITSTATUS(job->status));
+    else snprintf(buf, size, "Done");
+}
+
+// Pick up whether a running job has been stopped or continued since the
+// shell last looked. Exits are left for the reaper.
+static void job_refresh(struct sh_job *job)
+{
+    idtype_t type = job->pgid > 0 ? P_PGID : P_PID;
+    id_t id = (id_t)(job->pgid > 0 ? job->pgid : job->pid);
+    siginfo_t info;
+    for (int i = 0; !job->done && i < 4; i++)
+    {
+        info.si_pid = 0;
+        if (waitid(type, id, &info, WSTOPPED | WCONTINUED | WNOHANG) < 0 || info.si_pid == 0) break;
+        job->stopped = info.si_code != CLD_CONTINUED;
+    }
+}
+
+/**
+ * @brief Find the job a builtin was given: a job spec starting with %, or
+ * the pid of a job. Unknown ones are reported on stderr unless builtin is
+ * NULL.
+ *
+ * @return The job, or NULL
+ */
+static struct sh_job *job_lookup(struct sh_jobs *jobs, const char *builtin, const char *id)
+{
+    if (id[0] == '%')
+    {
+        struct sh_job *job = sh_job_parse(jobs, id);
+        if (job == NULL && builtin) fprintf(stderr, "%s: %s: no such job\n", builtin, id);
+        return job;
+    }
+
+    char *end;
+    errno = 0;
+    long pid = strtol(id, &end, 10);
+    struct sh_job *job = NULL;
+    if (errno || end == id || *end || pid < 1 || pid > INT_MAX)
+    {
+        if (builtin) fprintf(stderr, "%s: `%s': not a pid or valid job spec\n", builtin, id);
+    }
+    else if ((job = sh_job_find(jobs, (pid_t)pid)) == NULL && builtin)
+    {
+        fprintf(stderr, "%s: pid %ld is not a child of this shell\n", builtin, pid);
+    }
+    return job;
+}
+
+// With set -b, report finished jobs unless a builtin is waiting for them:
+// it may hold a job, and decides how it is reported
+static void jobs_report(struct shell *sh)
+{
+    if (!sh->notify || sh->jobs->waiting) return;
+    if (sh->job_notify) sh->job_notify(sh);
+    else sh_jobs_notify(sh);
+}
+
+// Record the exit of a job and queue it to be reported
+static void job_finish(struct sh_jobs *jobs, struct job_entry *e, int status)
+{
+    if (e->job.done) return;
+
+    e->job.done = true;
+    e->job.stopped = false;
+    e->job.status = status;
+    jobs->ndone++;
+    e->done_next = NULL;
+    e->done_prev = jobs->done_tail;
+    if (jobs->done_tail) jobs->done_tail->done_next = e;
+    else jobs->done_head = e;
+    jobs->done_tail = e;
+}
+
+// Record the exit of one process of a job. The job is finished once all
+// of them are, with the status of the last stage.
+static void job_proc_exited(struct sh_jobs *jobs, struct job_proc *p, int status)
+{
+    if (p->done) return;
+
+    p->done = true;
+    p->status = status;
+    struct job_entry *e = p->job;
+    if (--e->nlive == 0) job_finish(jobs, e, e->procs[e->nprocs - 1].status);
+}
+
+/**
+ * @brief Called by the event loop or the fork server when a watched job
+ * exits
+ *
+ * @param ctx The shell
+ */
+static void job_exited(void *ctx, pid_t pid, int status)
+{
+    struct shell *sh = ctx;
+    struct sh_jobs *jobs = sh->jobs;
+    struct job_proc *p = jobs ? job_proc_find(jobs, pid) : NULL;
+    if (p == NULL || p->done) return;
+
+    job_proc_exited(jobs, p, status);
+    if (p->job->job.done) jobs_report(sh);
+}
+
+// Reap pid if it is the spare or the fork server's helper. Neither is a
+// job, and a dead one would sit in front of every job the reaper looks for.
+static bool jobs_reap_helper(struct shell *sh, pid_t pid)
+{
+    if (sh->server && sh->server->pid == pid)
+    {
+        server_lost(sh->server);
+        return true;
+    }
+    if (sh->prefork && sh->prefork->pid == pid)
+    {
+        sh_prefork_discard(sh->prefork);
+        return true;
+    }
+    return false;
+}
+
+// Give each process of a job a watch of its own, or poll the job if that
+// cannot be done
+static void job_watch_procs(struct shell *sh, struct job_entry *e)
+{
+    e->watched = sh->loop != NULL;
+    for (size_t i = 0; e->watched && i < e->nprocs; i++)
+    {
+        if (e->procs[i].done) continue;
+        e->watched = sh_loop_watch_child(sh->loop, e->procs[i].pid, job_exited, sh) != NULL;
+    }
+    e->polled = !e->watched;
+    if (e->polled) sh->jobs->polled++;
+}
+
+static void jobs_retry(void *ctx)
+{
+    struct shell *sh = ctx;
+    sh->jobs->retry = NULL;
+    jobs_reap(sh);
+}
+
+// Whether jobs are still watched one by one, which lasts as long as the
+// zombie that made them so
+static bool jobs_direct(struct sh_jobs *jobs)
+{
+    if (!jobs->direct) return false;
+
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, jobs->stalled, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == jobs->stalled)
+        return true;
+    jobs->direct = false;
+    jobs->stalled = 0;
+    return false;
+}
+
+/**
+ * @brief Reap every finished job in one pass. waitid with WNOWAIT peeks at
+ * the next zombie without reaping it, so children that are not jobs are
+ * left to whoever waits for them. P_ALL always shows the oldest zombie
+ * first, so one that is not ours hides the rest. It is looked at again on
+ * the next turn of the loop, since its owner most likely reaps it by then,
+ * and if it is still there the live jobs are switched to a watch each
+ * until it is gone. No pass walks the table more than once for it.
+ *
+ * @param sh The shell
+ * @return The number of jobs reaped
+ */
+static size_t jobs_reap(struct shell *sh)
+{
+    struct sh_jobs *jobs = sh->jobs;
+    // While jobs are watched one by one, every live job has a watch
+    if (jobs == NULL || jobs->reaper == NULL || jobs_direct(jobs)) return 0;
+    if (jobs->count == jobs->ndone) return 0;
+
+    size_t n = 0;
+    pid_t stalled = 0;
+    for (;;)
+    {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) break;
+
+        struct job_proc *p = job_proc_find(jobs, info.si_pid);
+        int status;
+        if (p == NULL || p->done || p->job->watched)
+        {
+            if (p == NULL && jobs_reap_helper(sh, info.si_pid)) continue;
+            stalled = info.si_pid;
+            break;
+        }
+        if (waitpid(info.si_pid, &status, WNOHANG) <= 0) break;
+        job_proc_exited(jobs, p, status);
+        n++;
+    }
+
+    if (stalled && stalled != jobs->stalled)
+    {
+        // Give its owner a turn of the loop to reap it
+        jobs->stalled = stalled;
+        if (jobs->retry == NULL) jobs->retry = sh_loop_add_timer(jobs->loop, 1, false, jobs_retry, sh);
+    }
+    else if (stalled)
+    {
+        // Nobody did, so stop relying on P_ALL until it is gone
+        jobs->direct = true;
+        for (size_t i = 0; i < jobs->nslots; i++)
+        {
+            struct job_entry *e = jobs->slots[i];
+            if (e && !e->watched && !e->polled && !e->job.done) job_watch_procs(sh, e);
+        }
+    }
+    else
+    {
+        jobs->stalled = 0;
+    }
+
+    if (n)
+    {
+        jobs->stats.reaped += n;
+        jobs->stats.batches++;
+        if (n > jobs->stats.max_batch) jobs->stats.max_batch = n;
+        jobs_report(sh);
+    }
+    return n;
+}
+
+// SIGCHLD arrived: drain the signalfd and reap what finished
+static void jobs_sigchld(void *ctx)
+{
+    struct shell *sh = ctx;
+    struct signalfd_siginfo si[16];
+    while (read(sh->jobs->sigfd, si, sizeof(si)) > 0)
+        ;
+    jobs_reap(sh);
+}
+
+/**
+ * @brief Reap the children of sh->jobs in batches from sh->loop. SIGCHLD
+ * is blocked and read from a signalfd, and each time it is ready every
+ * finished job is reaped with waitid(P_ALL, WNOHANG) in one pass, so
+ * jobs need no pidfd each and a storm of exits costs one wakeup. sh_init
+ * calls this; jobs added before it keep their own watches.
+ *
+ * @param sh The shell, with its loop and job table
+ * @return True if the reaper is running
+ */
+bool sh_jobs_watch(struct shell *sh)
+{
+    struct sh_jobs *jobs = sh->jobs;
+    if (jobs == NULL || sh->loop == NULL) return false;
+    if (jobs->reaper) return true;
+
+    // Spawned children get an empty mask, so this only affects the shell
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    jobs->sigfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (jobs->sigfd < 0)
+    {
+        perror("signalfd");
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+        return false;
+    }
+
+    jobs->reaper = sh_loop_watch_event_fd(sh->loop, jobs->sigfd, jobs_sigchld, sh);
+    if (jobs->reaper == NULL)
+    {
+        close(jobs->sigfd);
+        jobs->sigfd = -1;
+        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+        return false;
+    }
+    jobs->loop = sh->loop;
+
+    // Jobs that finished before this have no SIGCHLD left to wake it
+    jobs_reap(sh);
+    return true;
+}
+
+/**
+ * @brief Get the counters of a job table
+ */
+struct sh_jobs_stats sh_jobs_get_stats(const struct sh_jobs *jobs)
+{
+    return jobs->stats;
+}
+
+// Reap the jobs that are not watched by the event loop
+static void jobs_poll(struct sh_jobs *jobs)
+{
+    for (size_t i = 0; jobs->polled && i < jobs->nslots; i++)
+    {
+        struct job_entry *e = jobs->slots[i];
+        if (e == NULL || !e->polled || e->job.done) continue;
+        for (size_t j = 0; j < e->nprocs; j++)
+        {
+            int status;
+            if (!e->procs[j].done && waitpid(e->procs[j].pid, &status, WNOHANG) > 0)
+                job_proc_exited(jobs, &e->procs[j], status);
+        }
+    }
+}
+
+/**
+ * @brief Wait for something that may finish a job: one round of the event
+ * loop, or without a loop a message from the fork server or any child.
+ *
+ * @return False if nothing can finish a job any more
+ */
+static bool jobs_block(struct shell *sh)
+{
+    struct sh_jobs *jobs = sh->jobs;
+    if (sh->loop) return sh_loop_run_once(sh->loop, jobs->polled ? JOB_POLL_MS : -1) >= 0;
+    if (sh->server && !jobs->polled && server_alive(sh->server)) return server_pump(sh->server) >= 0;
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) return errno == EINTR;
+    job_exited(sh, pid, status);
+    return true;
+}
+
+/**
+ * @brief Block until a background job finishes. The event loop keeps
+ * running meanwhile, without reading the terminal. The job stays in the
+ * table.
+ *
+ * @param sh The shell
+ * @param job The job to wait for, or NULL for whichever finishes first
+ * @return The finished job (for NULL the one that finished first of
+ * those not yet reported), or NULL if there is none to wait for
+ */
+struct sh_job *sh_jobs_wait(struct shell *sh, struct sh_job *job)
+{
+    struct sh_jobs *jobs = sh->jobs;
+    if (jobs == NULL) return NULL;
+
+    if (sh->loop) sh_loop_pause_fds(sh->loop, true);
+    jobs->waiting++;
+    for (;;)
+    {
+        jobs_poll(jobs);
+        jobs_reap(sh);
+        if (job ? job->done : jobs->done_head || jobs->ndone == jobs->count) break;
+        if (!jobs_block(sh)) break;
+    }
+    jobs->waiting--;
+    if (sh->loop) sh_loop_pause_fds(sh->loop, false);
+
+    if (job) return job->done ? job : NULL;
+    return jobs->done_head ? &jobs->done_head->job : NULL;
+}
+
+/**
+ * @brief Block until one of the jobs named by ids (job specs or pids) is
+ * done. Each wakeup only rechecks the named jobs.
+ *
+ * @return The first of them found done, or NULL if none of them exist
+ */
+static struct sh_job *jobs_wait_any(struct shell *sh, char **ids)
+{
+    struct sh_jobs *jobs = sh->jobs;
+    struct sh_job *found = NULL;
+    bool any = true;
+
+    if (sh->loop) sh_loop_pause_fds(sh->loop, true);
+    jobs->waiting++;
+    for (bool first = true; any && !found; first = false)
+    {
+        jobs_poll(jobs);
+        jobs_reap(sh);
+        any = false;
+        for (char **id = ids; *id && !found; id++)
+        {
+            // Unknown ids are reported once
+            struct sh_job *job = job_lookup(jobs, first ? "wait" : NULL, *id);
+            if (job == NULL) continue;
+            any = true;
+            if (job->done) found = job;
+        }
+        if (any && !found && !jobs_block(sh)) break;
+    }
+    jobs->waiting--;
+    if (sh->loop) sh_loop_pause_fds(sh->loop, false);
+
+    return found;
+}
+
+// Arrange for the processes of a new job to be reaped. Children of the
+// fork server are reported by it, the shell's own by the reaper, and
+// failing that each gets a watch or the job is polled.
+static void job_watch(struct shell *sh, struct job_entry *e)
+{
+    bool served = sh->server != NULL;
+    for (size_t i = 0; served && i < e->nprocs; i++)
+        served = server_watch(sh->server, e->procs[i].pid, job_exited, sh);
+    if (served)
+    {
+        e->watched = true;
+        return;
+    }
+    if (sh->jobs->reaper && !jobs_direct(sh->jobs)) return;
+
+    // A watch that cannot be set up leaves the rest of the job polled
+    job_watch_procs(sh, e);
+}
+
+/**
+ * @brief Start a command in the background and add it to sh->jobs. Prints
+ * "[id] pid" like other shells. The command leads a process group of its
+ * own, so a Ctrl-C meant for the foreground does not reach it. The job is
+ * marked done when the child exits, which the event loop notices while the
+ * shell waits for input or for a foreground job.
+ *
+ * @param sh The shell
+ * @param argv The command to run
+ * @return The job, or NULL if the command could not be started
+ */
+struct sh_job *sh_run_background(struct shell *sh, char *const argv[])
+{
+    return sh_run_background_with_attr(sh, argv, NULL);
+}
+
+/**
+ * @brief Start a command in the background like sh_run_background, with its
+ * stdio set up as attr says
+ *
+ * @param sh The shell
+ * @param argv The command to run
+ * @param attr The setup, NULL to inherit everything. Its pgid is ignored:
+ * the command always leads a new group.
+ * @return The job, or NULL if the command could not be started
+ */
+struct sh_job *sh_run_background_with_attr(struct shell *sh, char *const argv[], const struct sh_spawn_attr *attr)
+{
+    struct sh_spawn_attr own = SH_SPAWN_ATTR_INIT;
+    if (attr) own = *attr;
+    own.pgid = 0;
+    pid_t pid = sh_spawn_with_attr(sh, argv, &own);
+    if (pid < 0) return NULL;
+
+    // Both sides set the group, so it is right whichever runs first
+    setpgid(pid, pid);
+    struct sh_job *job = sh->jobs ? sh_job_add(sh->jobs, pid, pid, argv) : NULL;
+    if (job == NULL)
+    {
+        // Nothing would ever reap it, so run it in the foreground instead
+        sh_wait(sh, pid);
+        return NULL;
+    }
+
+    job_watch(sh, (struct job_entry *)job);
+    printf("[%d] %d\n", job->id, (int)pid);
+    fflush(stdout);
+    return job;
+}
+
+// Hand the terminal to a process group. Only a shell that has the terminal
+// hands it on, and it always takes it back.
+static bool terminal_give(pid_t pgid)
+{
+    if (!isatty(STDIN_FILENO)) return false;
+    if (pgid != getpgrp() && tcgetpgrp(STDIN_FILENO) != getpgrp()) return false;
+    return tcsetpgrp(STDIN_FILENO, pgid) == 0;
+}
+
+static bool is_builtin(char *const argv[])
+{
+    for (size_t i = 0; argv[0] && i < num_builtins; i++)
+    {
+        if (strcmp(argv[0], builtins[i].name) == 0) return true;
+    }
+    return false;
+}
+
+// Whether a pipeline may run a builtin on a thread instead of forking
+static bool builtin_threads(char *const argv[])
+{
+    for (size_t i = 0; argv[0] && i < num_builtins; i++)
+    {
+        if (strcmp(argv[0], builtins[i].name) == 0) return builtins[i].threads;
+    }
+    return false;
+}
+
+// Run a builtin stage of a pipeline in a forked copy of the shell. There
+// is no exec to close the pipes, so the child closes every pipe end of the
+// pipeline in fds once it has its own stdio.
+static pid_t pipeline_builtin(struct shell *sh, char **argv, const struct sh_spawn_attr *attr, const int *fds,
+                              size_t nfds)
+{
+    fflush(stdout); // or the child would print it again
+    pid_t pid = fork();
+    if (pid < 0) perror("fork");
+    if (pid != 0) return pid;
+
+    // The epoll set, the fork server's socket and the spare are shared
+    // with the shell, so the copy drops them and everything watched
+    // through them. Its commands are plain children it waits for.
+    sh->loop = NULL;
+    sh->server = NULL;
+    sh->prefork = NULL;
+    sh->paths = NULL;
+    if (sh->jobs)
+    {
+        sh->jobs->loop = NULL;
+        sh->jobs->reaper = NULL;
+        sh->jobs->retry = NULL;
+        sh->jobs->direct = false;
+    }
+    child_reset_signals();
+    child_apply_attr(attr);
+    for (size_t i = 0; i < nfds; i++)
+    {
+        if (fds[i] > 2) close(fds[i]);
+    }
+    sh->status = 0; // for a stage of redirections alone
+    do_builtin(sh, argv);
+    fflush(stdout);
+    _exit(sh->status);
+}
+
+/**
+ * @brief Parse a pipe size: a positive number of bytes, optionally
+ * followed by k, m or g for KiB, MiB or GiB
+ *
+ * @param text The size
+ * @param size Set to the size in bytes
+ * @return False if text is not a valid size
+ */
+bool sh_pipe_size_parse(const char *text, size_t *size)
+{
+    if (!isdigit((unsigned char)text[0])) return false;
+
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(text, &end, 10);
+    unsigned shift = 0;
+    if (*end == 'k' || *end == 'K') shift = 10;
+    else if (*end == 'm' || *end == 'M') shift = 20;
+    else if (*end == 'g' || *end == 'G') shift = 30;
+    if (shift) end++;
+    if (errno || *end || n == 0 || n > (SIZE_MAX >> shift)) return false;
+
+    *size = (size_t)n << shift;
+    return true;
+}
+
+/**
+ * @brief Read the largest pipe size an unprivileged process may ask for,
+ * from /proc/sys/fs/pipe-max-size
+ *
+ * @return The size in bytes, or 0 if it cannot be read
+ */
+size_t sh_pipe_max_size(void)
+{
+    int fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    char buf[32];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    return (size_t)strtoull(buf, NULL, 10);
+}
+
+// Make a pipe for a pipeline and give it size bytes, when not 0. Growing
+// a pipe past what the user's pipes may use in total fails with EPERM, and
+// then the pipe keeps the kernel's size.
+static int pipeline_pipe(struct shell *sh, int fds[2], size_t size)
+{
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+
+    sh->pipe_stats.pipes++;
+    if (size && fcntl(fds[1], F_SETPIPE_SZ, (int)size) >= 0) sh->pipe_stats.resized++;
+    else if (size) sh->pipe_stats.refused++;
+    int got = fcntl(fds[1], F_GETPIPE_SZ);
+    if (got > 0) sh->pipe_stats.last = (size_t)got;
+    return 0;
+}
+
+// Join the stages of a pipeline into the command line jobs shows
+static char *pipeline_command(const struct sh_allocator *a, char **const argvs[], size_t n)
+{
+    size_t len = 1;
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; argvs[i][j]; j++) len += strlen(argvs[i][j]) + 1;
+        len += 2;
+    }
+    char *command = sh_alloc(a, len);
+    if (command == NULL) return NULL;
+
+    char *p = command;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i) p = stpcpy(p, " | ");
+        for (size_t j = 0; argvs[i][j]; j++)
+        {
+            if (j) *p++ = ' ';
+            p = stpcpy(p, argvs[i][j]);
+        }
+    }
+    *p = '\0';
+    return command;
+}
+
+/*
+ * In-process pipes. Two builtin stages next to each other in a pipeline
+ * run on threads of the shell and are joined by a ring buffer instead of
+ * a kernel pipe, so a pipeline of builtins needs no fork and no pipe.
+ * Each ring has one writer and one reader. Each side only advances its own
+ * counter, so neither takes a lock. A side with nothing to do sleeps on a
+ * futex that the other side bumps after every change, and the wake
+ * syscall is skipped while nobody sleeps. The stages see the rings as
+ * FILE streams made with fopencookie.
+ */
+
+struct pipe_ring
+{
+    size_t mask;              // capacity - 1, a power of two
+    _Atomic size_t head;      // bytes written so far
+    _Atomic size_t tail;      // bytes read so far
+    _Atomic bool wclosed;     // the writer is done: EOF once drained
+    _Atomic bool rclosed;     // the reader is gone: writes fail with EPIPE
+    _Atomic uint32_t seq;     // futex word, bumped on every change
+    _Atomic uint32_t waiters; // sides asleep or about to be
+    char buf[];
+};
+
+static struct pipe_ring *ring_create(const struct sh_allocator *a, size_t size)
+{
+    size_t cap = 4096;
+    while (cap < size) cap *= 2;
+    struct pipe_ring *r = sh_alloc(a, sizeof(*r) + cap);
+    if (r == NULL) return NULL;
+
+    r->mask = cap - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->wclosed, false);
+    atomic_init(&r->rclosed, false);
+    atomic_init(&r->seq, 0);
+    atomic_init(&r->waiters, 0);
+    return r;
+}
+
+// Tell the other side something changed, waking it if it sleeps
+static void ring_notify(struct pipe_ring *r)
+{
+    atomic_fetch_add(&r->seq, 1);
+    if (atomic_load(&r->waiters)) syscall(SYS_futex, &r->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Sleep until the other side changes something. seq was read before the
+// caller last looked, so a change made since then returns at once.
+static void ring_wait(struct pipe_ring *r, uint32_t seq, _Atomic size_t *counter, size_t seen)
+{
+    atomic_fetch_add(&r->waiters, 1);
+    if (atomic_load(counter) == seen && !atomic_load(&r->wclosed) && !atomic_load(&r->rclosed))
+        syscall(SYS_futex, &r->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    atomic_fetch_sub(&r->waiters, 1);
+}
+
+static ssize_t ring_write(void *cookie, const char *buf, size_t size)
+{
+    struct pipe_ring *r = cookie;
+    size_t done = 0;
+    while (done < size)
+    {
+        uint32_t seq = atomic_load(&r->seq);
+        if (atomic_load(&r->rclosed))
+        {
+            errno = EPIPE;
+            return done ? (ssize_t)done : -1;
+        }
+
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load(&r->tail);
+        size_t n = r->mask + 1 - (head - tail);
+        if (n == 0)
+        {
+            ring_wait(r, seq, &r->tail, tail);
+            continue;
+        }
+
+        // Copy up to the end of the buffer, then from its start
+        if (n > size - done) n = size - done;
+        size_t at = head & r->mask;
+        size_t first = n < r->mask + 1 - at ? n : r->mask + 1 - at;
+        memcpy(r->buf + at, buf + done, first);
+        memcpy(r->buf, buf + done + first, n - first);
+        atomic_store(&r->head, head + n);
+        ring_notify(r);
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t ring_read(void *cookie, char *buf, size_t size)
+{
+    struct pipe_ring *r = cookie;
+    for (;;)
+    {
+        // Closed is read before head, so no bytes written before the close
+        // are missed
+        uint32_t seq = atomic_load(&r->seq);
+        bool closed = atomic_load(&r->wclosed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load(&r->head);
+        if (head == tail)
+        {
+            if (closed) return 0;
+            ring_wait(r, seq, &r->head, head);
+            continue;
+        }
+
+        size_t n = head - tail < size ? head - tail : size;
+        size_t at = tail & r->mask;
+        size_t first = n < r->mask + 1 - at ? n : r->mask + 1 - at;
+        memcpy(buf, r->buf + at, first);
+        memcpy(buf + first, r->buf, n - first);
+        atomic_store(&r->tail, tail + n);
+        ring_notify(r);
+        return (ssize_t)n;
+    }
+}
+
+static int ring_close_write(void *cookie)
+{
+    struct pipe_ring *r = cookie;
+    atomic_store(&r->wclosed, true);
+    ring_notify(r);
+    return 0;
+}
+
+static int ring_close_read(void *cookie)
+{
+    struct pipe_ring *r = cookie;
+    atomic_store(&r->rclosed, true);
+    ring_notify(r);
+    return 0;
+}
+
+static const cookie_io_functions_t ring_writer = {NULL, ring_write, NULL, ring_close_write};
+static const cookie_io_functions_t ring_reader = {ring_read, NULL, NULL, ring_close_read};
+
+// A stage of a pipeline being started
+struct pipeline_stage
+{
+    char **argv;
+    const struct sh_redir *redirs; // NULL for none
+    bool thread;            // a builtin run on a thread of the shell
+    bool started;
+    pid_t pid;              // a process, or -1
+    int in;                 // pipe end it reads, -1 for the shell's stdin
+    int out;                // pipe end it writes, -1 for the shell's stdout
+    struct pipe_ring *rin;  // instead of in, from a thread before it
+    struct pipe_ring *rout; // instead of out, to a thread after it
+    pthread_t tid;
+    struct shell copy;      // the shell as the thread's builtin sees it
+};
+
+/**
+ * @brief Run one builtin stage on its thread. It gets its own copy of the
+ * shell with sh->in and sh->out pointing at its input and output. Builtins
+ * that run here only read the shell, so they can share it with the other
+ * stages.
+ */
+static void *pipeline_thread(void *arg)
+{
+    struct pipeline_stage *st = arg;
+
+    // Writing to a pipe whose reader is gone fails with EPIPE instead of
+    // killing the shell
+    sigset_t pipe;
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+    do_builtin(&st->copy, st->argv);
+    if (st->copy.out == stdout) fflush(stdout);
+    else fclose(st->copy.out);
+    if (st->copy.in) fclose(st->copy.in);
+    return NULL;
+}
+
+// Open the streams of a thread stage and start it. Its pipe ends are
+// handed over to the streams.
+static bool pipeline_thread_start(struct shell *sh, struct pipeline_stage *st)
+{
+    st->copy = *sh;
+    st->copy.out = stdout;
+    st->copy.in = NULL;
+    if (st->rout) st->copy.out = fopencookie(st->rout, "w", ring_writer);
+    else if (st->out >= 0) st->copy.out = fdopen(st->out, "w");
+    if (st->rin) st->copy.in = fopencookie(st->rin, "r", ring_reader);
+    else if (st->in >= 0) st->copy.in = fdopen(st->in, "r");
+
+    bool opened = st->copy.out && (st->copy.in || (!st->rin && st->in < 0));
+    if (opened && (errno = pthread_create(&st->tid, NULL, pipeline_thread, st)) == 0)
+    {
+        st->in = st->out = -1;
+        sh->pipe_stats.threads++;
+        return true;
+    }
+
+    // Close what was opened, and let the neighbours see EOF or EPIPE
+    perror(st->argv[0]);
+    if (st->copy.out && st->copy.out != stdout) fclose(st->copy.out);
+    else if (st->rout) ring_close_write(st->rout);
+    else if (st->out >= 0) close(st->out);
+    if (st->copy.in) fclose(st->copy.in);
+    else if (st->rin) ring_close_read(st->rin);
+    else if (st->in >= 0) close(st->in);
+    st->in = st->out = -1;
+    return false;
+}
+
+/**
+ * @brief Run a pipeline. Every stage is started before any is waited for,
+ * each stage's stdout is connected to the next one's stdin with a
+ * pipe2(O_CLOEXEC) pipe, and all of them join one new process group,
+ * which gets the terminal while it runs in the foreground. Builtins that
+ * only print run on threads of the shell, joined to each other by rings
+ * rather than pipes; other builtins, and builtins with redirections, run in
+ * a forked copy of the shell. A stage's redirections apply after its pipes,
+ * so 2>&1 sends stderr down the pipe too. In the background the pipeline
+ * becomes one job.
+ *
+ * @param sh The shell
+ * @param argvs The command of every stage
+ * @param n The number of stages
+ * @param attr How to run it, NULL for SH_PIPELINE_ATTR_INIT
+ * @return The exit status of the last stage, or for a background pipeline
+ * 0 if it started and 127 if not
+ */
+int sh_run_pipeline(struct shell *sh, char **const argvs[], size_t n, const struct sh_pipeline_attr *attr)
+{
+    const struct sh_pipeline_attr defaults = SH_PIPELINE_ATTR_INIT;
+    if (attr == NULL) attr = &defaults;
+    const struct sh_redir *const *redirs = attr->redirs;
+    bool background = attr->background;
+    size_t pipe_size = attr->pipe_size;
+    int *statuses = attr->statuses;
+
+    struct pipeline_stage *st = sh_alloc(sh->alloc, n * sizeof(*st));
+    int *fds = sh_alloc(sh->alloc, 2 * n * sizeof(*fds));
+    pid_t *pids = sh_alloc(sh->alloc, n * sizeof(*pids));
+    if (st == NULL || fds == NULL || pids == NULL)
+    {
+        perror("malloc");
+        sh_free(sh->alloc, st);
+        sh_free(sh->alloc, fds);
+        sh_free(sh->alloc, pids);
+        return 127;
+    }
+
+    // The limit is read each time, so a sysctl change applies right away
+    if (pipe_size == 0) pipe_size = sh->pipe_size;
+    if (pipe_size && n > 1)
+    {
+        size_t max = sh_pipe_max_size();
+        if (max && pipe_size > max) pipe_size = max;
+        if (pipe_size > INT_MAX) pipe_size = INT_MAX;
+    }
+
+    // A job is made of processes, so the background forks every builtin.
+    // So do redirections, which a thread could only apply to the whole shell.
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct sh_redir *r = redirs ? redirs[i] : NULL;
+        st[i] = (struct pipeline_stage){.argv = argvs[i], .redirs = r, .pid = -1, .in = -1, .out = -1};
+        st[i].thread = !background && !sh->fork_builtins && (r == NULL || r->op == SH_REDIR_END) &&
+                       builtin_threads(argvs[i]);
+    }
+
+    // Connect the stages first, so forked builtins can close every pipe
+    // end before any thread exists. A pipe that cannot be made fails the
+    // whole pipeline.
+    size_t nfds = 0;
+    bool connected = true;
+    for (size_t i = 0; connected && i + 1 < n; i++)
+    {
+        int pipefd[2];
+        if (st[i].thread && st[i + 1].thread)
+        {
+            struct pipe_ring *r = ring_create(sh->alloc, pipe_size ? pipe_size : 65536);
+            connected = r != NULL;
+            if (!connected) perror("malloc");
+            st[i].rout = st[i + 1].rin = r;
+            if (r) sh->pipe_stats.rings++;
+        }
+        else if (pipeline_pipe(sh, pipefd, pipe_size) == 0)
+        {
+            st[i + 1].in = fds[nfds++] = pipefd[0];
+            st[i].out = fds[nfds++] = pipefd[1];
+        }
+        else
+        {
+            perror("pipe2");
+            connected = false;
+        }
+    }
+
+    // Processes first, in order, so the first one leads the group. The
+    // parent closes each pipe end once the process that uses it started.
+    // A stage that fails to start leaves its neighbours an EOF or EPIPE.
+    pid_t pgid = 0;
+    bool tty = false;
+    size_t started = 0;
+    for (size_t i = 0; connected && i < n; i++)
+    {
+        if (st[i].thread) continue;
+
+        int base[3] = {st[i].in, st[i].out, -1};
+        struct redir_fds r;
+        struct sh_spawn_attr spawn = SH_SPAWN_ATTR_INIT;
+        spawn.pgid = pgid;
+        char **argv = st[i].argv;
+        if (redir_open(st[i].redirs, base, &r))
+        {
+            memcpy(spawn.fds, r.fds, sizeof(spawn.fds));
+            if (argv[0] == NULL || is_builtin(argv)) st[i].pid = pipeline_builtin(sh, argv, &spawn, fds, nfds);
+            else st[i].pid = sh_spawn_with_attr(sh, argv, &spawn);
+            redir_close(&r);
+        }
+
+        if (st[i].pid > 0)
+        {
+            // Both sides set the group, so it is right whichever runs first
+            if (pgid == 0) pgid = st[i].pid;
+            setpgid(st[i].pid, pgid);
+            if (started++ == 0 && !background) tty = terminal_give(pgid);
+        }
+        for (size_t j = 0; j < nfds; j++)
+        {
+            if (fds[j] >= 0 && (fds[j] == st[i].in || fds[j] == st[i].out))
+            {
+                close(fds[j]);
+                fds[j] = -1;
+            }
+        }
+        st[i].in = st[i].out = -1;
+    }
+
+    // Then the threads, which own their pipe ends from here on
+    for (size_t i = 0; connected && i < n; i++)
+    {
+        if (st[i].thread) st[i].started = pipeline_thread_start(sh, &st[i]);
+    }
+    if (!connected)
+    {
+        for (size_t j = 0; j < nfds; j++) close(fds[j]);
+    }
+
+    int status = 127 << 8;
+    if (background && started)
+    {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (st[i].pid > 0) pids[m++] = st[i].pid;
+        }
+
+        char *command = pipeline_command(sh->alloc, argvs, n);
+        struct sh_job *job = sh->jobs && command ? sh_job_add_procs(sh->jobs, pids, m, pgid, command) : NULL;
+        sh_free(sh->alloc, command);
+        if (job)
+        {
+            job_watch(sh, (struct job_entry *)job);
+            printf("[%d] %d\n", job->id, (int)job->pid);
+            fflush(stdout);
+        }
+        else
+        {
+            // Nothing would ever reap it, so run it in the foreground instead
+            for (size_t i = 0; i < m; i++) sh_wait(sh, pids[i]);
+        }
+        status = 0;
+    }
+    else
+    {
+        // The threads go first: until they are done they read the shell,
+        // which the event loop changes while waiting for a process
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!st[i].started) continue;
+            pthread_join(st[i].tid, NULL);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if (st[i].started) status = (st[i].copy.status & 0xff) << 8;
+            else status = st[i].pid > 0 ? sh_wait(sh, st[i].pid) : 127 << 8;
+            if (statuses) statuses[i] = status;
+        }
+        if (tty) terminal_give(getpgrp());
+        status = status < 0 ? 1 : job_exit_code(status);
+    }
+
+    for (size_t i = 0; i + 1 < n; i++) sh_free(sh->alloc, st[i].rout);
+    sh_free(sh->alloc, st);
+    sh_free(sh->alloc, fds);
+    sh_free(sh->alloc, pids);
+    return status;
+}
+
+/**
+ * @brief Report every finished background job as "[id]  Done  command"
+ * and remove it from sh->jobs
+ *
+ * @param sh The shell
+ * @return The number of jobs reported
+ */
+size_t sh_jobs_notify(struct shell *sh)
+{
+    struct sh_jobs *jobs = sh->jobs;
+    if (jobs == NULL) return 0;
+
+    jobs_poll(jobs);
+
+    size_t n = 0;
+    while (jobs->done_head)
+    {
+        struct sh_job *job = &jobs->done_head->job;
+        char state[32];
+        job_state(job, state, sizeof(state));
+
+        printf("[%d]  %-24s%s\n", job->id, state, job->command);
+        sh_job_remove(jobs, job);
+        n++;
+    }
+    if (n) fflush(stdout);
+    return n;
+}
+
+/**
+ * @brief Takes an argument list and checks if the first argument is a
+ * built in command such as exit, cd, jobs, etc. If the command is a
+ * built in command this function will handle the command and then return
+ * true. If the first argument is NOT a built in command this function will
+ * return false.
+ *
+ * @param sh The shell
+ * @param argv The command to check
+ * @return True if the command was a built in command
+ */
+bool do_builtin(struct shell *sh, char **argv)
+{
+    if (argv == NULL || argv[0] == NULL) return false;
+
+    for (size_t i = 0; i < num_builtins; i++)
+    {
+        if (strcmp(argv[0], builtins[i].name) == 0)
+        {
+            sh->status = 0;
+            return builtins[i].func(sh, argv); // Execute the built-in command
+        }
+    }
+
+    return false; // Command is not a built-in
+}
+
+/**
+ * @brief Run a builtin like do_builtin with redirections, in the shell
+ * itself. Each fd redirected is saved, replaced and put back afterwards, so
+ * nothing is forked. A command of redirections alone (argv[0] is NULL) just
+ * opens its files. A file that cannot be opened is reported on stderr, the
+ * builtin is not run and sh->status is 1.
+ *
+ * @param sh The shell
+ * @param argv The command to check
+ * @param redirs The redirections, NULL for none
+ * @return True if the command was a builtin or had no words
+ */
+bool sh_run_builtin(struct shell *sh, char **argv, const struct sh_redir *redirs)
+{
+    if (argv[0] && !is_builtin(argv)) return false;
+    sh->status = 0;
+    if (redirs == NULL || redirs->op == SH_REDIR_END) return argv[0] == NULL || do_builtin(sh, argv);
+
+    static const int shell_fds[3] = {-1, -1, -1};
+    struct redir_fds r;
+    if (!redir_open(redirs, shell_fds, &r))
+    {
+        sh->status = 1;
+        return true;
+    }
+    if (argv[0] == NULL)
+    {
+        redir_close(&r);
+        return true;
+    }
+
+    // A builtin that prints through sh->out takes a lone > as its stream,
+    // which needs no dup at all
+    if (builtin_threads(argv) && sh->out == NULL && r.owned[1] && r.fds[0] < 0 && r.fds[2] < 0)
+    {
+        FILE *out = fdopen(r.fds[1], "w");
+        if (out)
+        {
+            sh->out = out;
+            do_builtin(sh, argv);
+            sh->out = NULL;
+            fclose(out);
+            return true;
+        }
+    }
+
+    // Anything buffered was written before the redirections
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3] = {-1, -1, -1};
+    bool installed = true;
+    for (int i = 0; installed && i < 3; i++)
+    {
+        if (r.fds[i] < 0 || r.fds[i] == i) continue;
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        installed = saved[i] >= 0 && dup2(r.fds[i], i) >= 0;
+        if (!installed) perror("dup2");
+    }
+
+    // The spare was forked with the shell's stdio, so it must not run
+    // anything the builtin starts while that is redirected
+    struct sh_prefork *prefork = sh->prefork;
+    sh->prefork = NULL;
+    if (installed) do_builtin(sh, argv);
+    else sh->status = 1;
+    sh->prefork = prefork;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++)
+    {
+        if (saved[i] < 0) continue;
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    redir_close(&r);
+    return true;
+}
+
+/**
+ * @brief Initialize the shell for use. Allocate all data structures
+ * Grab control of the terminal and put the shell in its own
+ * process group. NOTE: This function will block until the shell is
+ * in its own program group. Attaching a debugger will always cause
+ * this function to fail because the debugger maintains control of
+ * the subprocess it is debugging. State that lives as long as the shell
+ * is on the heap; sh->alloc is only used for memory that lives for one
+ * command line, so it can be an arena that is reset after each line.
+ *
+ * @param sh
+ */
+void sh_init(struct shell *sh)
+{
+    // Ignore signals in the parent process (shell)
+    signal(SIGINT, SIG_IGN);  // Ignore Ctrl+C (SIGINT)
+    signal(SIGQUIT, SIG_IGN); // Ignore Ctrl+\ (SIGQUIT)
+    signal(SIGTSTP, SIG_IGN); // Ignore Ctrl+Z (SIGTSTP)
+    signal(SIGTTIN, SIG_IGN); // Ignore SIGTTIN (background input)
+    signal(SIGTTOU, SIG_IGN); // Ignore SIGTTOU (background output)
+
+    sh->prompt = get_prompt("MY_PROMPT");
+    sh->spawn = sh_spawn_backend_parse(getenv("MY_SPAWN"));
+    sh->cache = sh_cache_create(SH_CACHE_SIZE);
+    sh->loop = sh_loop_create(NULL);
+    sh->paths = sh_path_cache_create_with(NULL);
+    if (sh->paths && sh->loop) sh_path_cache_watch(sh->paths, sh->loop);
+    if (sh->spawn == SH_SPAWN_SERVER) sh->server = sh_forkserver_start(NULL, sh->loop);
+    sh->jobs = sh_jobs_create(NULL);
+    sh_jobs_watch(sh);
+    const char *threads = getenv("MY_PIPE_THREADS");
+    sh->fork_builtins = threads && strcmp(threads, "0") == 0;
+
+    // Keep a spare child for interactive use, or when MY_PREFORK asks for one
+    const char *prefork = getenv("MY_PREFORK");
+    if (prefork ? strcmp(prefork, "0") != 0 : isatty(STDIN_FILENO)) sh->prefork = sh_prefork_create(NULL);
 }
 
 /**
@@ -373,6 +6635,18 @@ void sh_init(struct shell *sh)
 void sh_destroy(struct shell *sh)
 {
     free(sh->prompt);
+    sh_cache_destroy(sh->cache);
+    sh->cache = NULL;
+    sh_path_cache_destroy(sh->paths);
+    sh->paths = NULL;
+    sh_forkserver_stop(sh->server);
+    sh->server = NULL;
+    sh_prefork_destroy(sh->prefork);
+    sh->prefork = NULL;
+    sh_jobs_destroy(sh->jobs);
+    sh->jobs = NULL;
+    sh_loop_destroy(sh->loop);
+    sh->loop = NULL;
 }
 
 /**
@@ -1,7 +1,9 @@
 #ifndef LAB_H
 #define LAB_H
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
@@ -9,7 +11,22 @@
 #define lab_VERSION_MAJOR 1
 #define lab_VERSION_MINOR 0
 
-#define MAX_JOBS 100
+// A stack argv size that holds typical lines for cmd_tokenize and
+// cmd_lex_inplace
+#define CMD_ARGV_INLINE 64
+
+// Number of argv slots (including the NULL) that always hold every token
+// of a line that is len bytes long
+#define CMD_ARGV_BOUND(len) ((len) / 2 + 2)
+
+// Number of parsed lines the shell keeps in its parse cache
+#define SH_CACHE_SIZE 128
+
+// Number of hot commands the shell keeps an open fd of, see sh_path_lookup_fd
+#define SH_EXEC_FDS 16
+
+// Index used by struct sh_ast for "no node"
+#define SH_NODE_NONE UINT32_MAX
 
 #define UNUSED(x) (void)x;
 
@@ -17,6 +34,173 @@
 extern "C"
 {
 #endif
+    // Hook for every allocation the shell makes. alloc and free get ctx as
+    // their first argument.
+    struct sh_allocator
+    {
+        void *(*alloc)(void *ctx, size_t size);
+        void (*free)(void *ctx, void *ptr);
+        void *ctx;
+    };
+
+    // The default allocator: malloc and free
+    extern const struct sh_allocator sh_malloc_allocator;
+
+    // A heap block handed out by a full arena, see struct sh_arena
+    struct sh_arena_block;
+
+    // A bump arena for memory that lives for one command line. Allocations
+    // are never freed individually; sh_arena_reset reclaims all of them.
+    // Once the arena is full allocations overflow to the heap, and those
+    // blocks are freed by sh_arena_reset too.
+    struct sh_arena
+    {
+        char *base;
+        size_t size;
+        size_t used;
+        size_t overflows;
+        struct sh_arena_block *overflow; // heap blocks not freed yet
+        struct sh_allocator allocator;   // allocates from this arena
+    };
+
+    // Bounded LRU cache of parsed lines, see sh_cache_create
+    struct sh_cache;
+
+    // Counters kept by a parse cache
+    struct sh_cache_stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+    };
+
+    // Event loop over the terminal, child pidfds and timers, see sh_loop_create
+    struct sh_loop;
+
+    // A registration in an event loop
+    struct sh_watch;
+
+    // Command name to path cache, see sh_path_cache_create_with
+    struct sh_path_cache;
+
+    // Counters kept by a command lookup cache
+    struct sh_path_stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t entries;
+        size_t invalidations; // times PATH changed under a non-empty cache
+        size_t dropped;       // entries dropped because their directory changed
+        size_t fd_opens;      // binaries opened for the exec fast path
+        size_t fd_evictions;  // fds closed to make room for hotter commands
+        size_t fd_launches;   // commands started with execveat on a cached fd
+    };
+
+    // Helper process that forks commands for the shell, see sh_forkserver_start
+    struct sh_forkserver;
+
+    // A spare child forked ahead of time, see sh_prefork_create
+    struct sh_prefork;
+
+    // Table of background jobs, see sh_jobs_create
+    struct sh_jobs;
+
+    // Counters kept by a job table
+    struct sh_jobs_stats
+    {
+        size_t started;   // jobs added
+        size_t reaped;    // jobs reaped by the batch reaper
+        size_t batches;   // reaper passes that reaped at least one job
+        size_t max_batch; // most jobs reaped in one pass
+    };
+
+    // A background job. The table owns it and its command.
+    struct sh_job
+    {
+        int id;        // the smallest id that was free when it started
+        pid_t pid;     // its process, the last stage of a pipeline
+        pid_t pgid;    // its own process group, 0 if it is in the shell's
+        bool done;     // it exited and status holds its wait status
+        bool stopped;  // stopped by a signal when the shell last looked
+        int status;
+        char *command; // its argv joined by spaces
+    };
+
+    // Counters kept by a pre-fork pool
+    struct sh_prefork_stats
+    {
+        size_t spares;   // children forked to wait as the spare
+        size_t launches; // commands run by a spare
+        size_t discards; // spares thrown away unused
+    };
+
+    // How external commands are started, see sh_spawn
+    enum sh_spawn_backend
+    {
+        SH_SPAWN_AUTO,   // pick the fastest backend available
+        SH_SPAWN_POSIX,  // posix_spawn, the address space is never copied
+        SH_SPAWN_VFORK,  // vfork and exec
+        SH_SPAWN_FORK,   // fork and exec, copies the page tables
+        SH_SPAWN_SERVER, // forked by a helper started in sh_init, see sh_forkserver_start
+    };
+
+    // What a redirection does to its fd, see struct sh_redir
+    enum sh_redir_op
+    {
+        SH_REDIR_END,    // ends a list of redirections
+        SH_REDIR_IN,     // <   read the file
+        SH_REDIR_OUT,    // >   write the file, created or truncated
+        SH_REDIR_APPEND, // >>  append to the file, created if missing
+        SH_REDIR_RDWR,   // <>  read and write the file, created if missing
+        SH_REDIR_DUP,    // >& and <&  make the fd a copy of another one
+    };
+
+    // One redirection of a command, like 2>err or 2>&1. A command's
+    // redirections are applied in order and the list ends with SH_REDIR_END.
+    struct sh_redir
+    {
+        enum sh_redir_op op;
+        int fd;           // the fd redirected: 0, 1 or 2
+        const char *path; // the file, NULL for SH_REDIR_DUP
+        int src;          // SH_REDIR_DUP: the fd copied, 0, 1 or 2
+    };
+
+    // How sh_spawn_with_attr sets up a child
+    struct sh_spawn_attr
+    {
+        int fds[3]; // installed as stdin, stdout and stderr, -1 to inherit
+        pid_t pgid; // -1 for the shell's process group, 0 to lead a new one
+        const struct sh_redir *redirs; // applied on top of fds, NULL for none
+    };
+
+    // Inherit everything, like sh_spawn
+#define SH_SPAWN_ATTR_INIT {{-1, -1, -1}, -1, NULL}
+
+    // How sh_run_pipeline runs a pipeline
+    struct sh_pipeline_attr
+    {
+        const struct sh_redir *const *redirs; // per stage, NULL if no stage has any
+        bool background; // start it as a job instead of waiting for it
+        size_t pipe_size; // bytes per pipe, 0 for sh->pipe_size, capped at sh_pipe_max_size
+        int *statuses;    // if not NULL, receives the wait status of every stage
+                          // of a foreground pipeline, 127 << 8 for one that did not start
+    };
+
+    // A foreground pipeline with no redirections and the shell's pipe size
+#define SH_PIPELINE_ATTR_INIT {NULL, false, 0, NULL}
+
+    // Counters kept for the pipes of pipelines
+    struct sh_pipe_stats
+    {
+        size_t pipes;   // pipes created
+        size_t resized; // pipes grown or shrunk with F_SETPIPE_SZ
+        size_t refused; // resizes the kernel refused, left at its size
+        size_t last;    // capacity of the last pipe created, in bytes
+        size_t threads; // builtin stages run on a thread of the shell
+        size_t rings;   // rings joining two such stages instead of a pipe
+    };
+
     // Represents a shell
     struct shell
     {
@@ -25,20 +209,72 @@ extern "C"
         struct termios shell_tmodes;
         int shell_terminal;
         char *prompt;
-        int run_in_background;
+        const struct sh_allocator *alloc; // per-line memory, NULL for the heap
+        struct sh_cache *cache;
+        enum sh_spawn_backend spawn; // MY_SPAWN overrides it in sh_init
+        struct sh_loop *loop;
+        struct sh_path_cache *paths; // NULL to search PATH on every exec
+        struct sh_forkserver *server; // started by sh_init for SH_SPAWN_SERVER
+        struct sh_prefork *prefork;   // interactive shells or MY_PREFORK, else NULL
+        struct sh_jobs *jobs;         // background jobs started with &
+        int status;                   // exit status of the last builtin
+        bool notify;                  // set -b: report jobs as soon as they finish
+        size_t pipe_size;             // set -o pipesize: pipeline pipe size, 0 for the kernel's
+        struct sh_pipe_stats pipe_stats;
+        bool fork_builtins;           // fork every builtin stage of a pipeline, MY_PIPE_THREADS=0
+        FILE *out;                    // where builtins print, NULL for stdout
+        FILE *in;                     // where builtins read, NULL for stdin
+        // Reports finished jobs for set -b, for example around a prompt being
+        // edited. NULL calls sh_jobs_notify.
+        void (*job_notify)(struct shell *sh);
     };
 
-    // Represents a job
-    typedef struct
+    // Instruction sets available for whitespace scanning
+    enum scan_isa
     {
-        int job_id;
-        pid_t pid;
-        char *command;
-    } job;
+        SCAN_ISA_SCALAR,
+        SCAN_ISA_SSE2,
+        SCAN_ISA_AVX2,
+    };
 
+    // Kinds of nodes in a parsed command line
+    enum sh_node_kind
+    {
+        SH_NODE_PIPELINE, // commands connected by |, child is the first one
+        SH_NODE_CMD,      // a simple command, arg is its argv in words,
+                          // child its first redirection
+        SH_NODE_REDIR,    // a redirection of the command it follows
+    };
 
-    job jobs[MAX_JOBS]; // Array to store background jobs
-    int job_count;  // Counter for job IDs
+    // How a pipeline is joined to the pipeline after it
+    enum sh_list_op
+    {
+        SH_OP_END, // last pipeline of the line
+        SH_OP_SEQ, // ;  run the next one unconditionally
+        SH_OP_AND, // && run the next one if this one succeeded
+        SH_OP_OR,  // || run the next one if this one failed
+        SH_OP_BG,  // &  run this one in the background and go on
+    };
+
+    // A parsed command line. Nodes are stored struct-of-arrays style and
+    // linked by index, and everything (the node arrays, the argv arrays and
+    // the strings) lives in the one allocation this struct heads.
+    struct sh_ast
+    {
+        uint32_t nnodes;
+        uint32_t nwords;
+        char **words;    // every command's argv, each NULL terminated
+        uint32_t *next;  // next sibling or SH_NODE_NONE
+        uint32_t *child; // first child or SH_NODE_NONE,
+                         // redirections: the fd redirected
+        uint32_t *arg;   // commands: index of the argv in words,
+                         // pipelines: pipe size from a pipesize prefix or 0,
+                         // redirections: index of the file in words, or
+                         // the fd copied for SH_REDIR_DUP
+        uint8_t *kind;   // enum sh_node_kind
+        uint8_t *op;     // pipelines: enum sh_list_op,
+                         // redirections: enum sh_redir_op
+    };
 
     /**
      * @brief Set the shell prompt. This function will attempt to load a prompt
@@ -51,6 +287,58 @@ extern "C"
      */
     char *get_prompt(const char *env);
 
+    /**
+     * @brief Get the shell prompt like get_prompt, allocating it with a. The
+     * caller must free the resulting string with the same allocator.
+     *
+     * @param a The allocator, or NULL for the heap
+     * @param env The environment variable
+     * @return const char* The prompt
+     */
+    char *get_prompt_with(const struct sh_allocator *a, const char *env);
+
+    /**
+     * @brief Allocate through a, or the heap if a is NULL
+     *
+     * @param a The allocator
+     * @param size The number of bytes
+     * @return The memory, or NULL if it ran out
+     */
+    void *sh_alloc(const struct sh_allocator *a, size_t size);
+
+    /**
+     * @brief Free through a, or the heap if a is NULL
+     *
+     * @param a The allocator the memory came from
+     * @param ptr The memory, or NULL
+     */
+    void sh_free(const struct sh_allocator *a, void *ptr);
+
+    /**
+     * @brief Set up a bump arena. Use arena->allocator to allocate from it.
+     *
+     * @param arena The arena
+     * @param size The number of bytes it hands out before overflowing to the
+     * heap
+     * @return True on success
+     */
+    bool sh_arena_init(struct sh_arena *arena, size_t size);
+
+    /**
+     * @brief Release everything allocated from the arena at once, heap
+     * blocks it overflowed to included
+     *
+     * @param arena The arena
+     */
+    void sh_arena_reset(struct sh_arena *arena);
+
+    /**
+     * @brief Free the memory behind an arena
+     *
+     * @param arena The arena
+     */
+    void sh_arena_destroy(struct sh_arena *arena);
+
     /**
      * Changes the current working directory of the shell. Uses the linux system
      * call chdir. With no arguments the users home directory is used as the
@@ -65,8 +353,10 @@ extern "C"
     /**
      * @brief Convert line read from the user into to format that will work with
      * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
-     * This function allocates memory that must be reclaimed with the cmd_free
-     * function.
+     * The argv array and every token are packed into a single allocation
+     * sized to the actual line, which must be reclaimed with the cmd_free
+     * function. This function keeps no hidden state so it is safe to call
+     * from several threads at once.
      *
      * @param line The line to process
      *
@@ -75,12 +365,268 @@ extern "C"
     char **cmd_parse(char const *line);
 
     /**
-     * @brief Free the line that was constructed with parse_cmd
+     * @brief Convert a line like cmd_parse, allocating the result with a. It
+     * must be reclaimed with cmd_free_with and the same allocator.
+     *
+     * @param a The allocator, or NULL for the heap
+     * @param line The line to process
+     * @return The line read in a format suitable for exec
+     */
+    char **cmd_parse_with(const struct sh_allocator *a, char const *line);
+
+    /**
+     * @brief Split a line in place into a format that will work with execvp
+     * without allocating. The delimiter following each token is overwritten
+     * with '\0' and argv points into line, so line must outlive argv. At most
+     * n - 1 tokens are stored and argv is always NULL terminated. Use
+     * cmd_parse instead when an owning copy is needed. Like cmd_parse this
+     * function is reentrant.
+     *
+     * @param line The line to split, modified in place
+     * @param argv Caller owned array to fill
+     * @param n The number of slots in argv
+     * @return The number of tokens in line. If this is >= n the line is left
+     * untouched and the caller should retry with a larger argv.
+     */
+    size_t cmd_tokenize(char *line, char **argv, size_t n);
+
+    /**
+     * @brief Lex a line with shell quoting rules into a format that will work
+     * with execvp. Single quotes preserve everything, double quotes allow \"
+     * and \\ escapes, a backslash outside quotes escapes the next character
+     * and a # at the start of a word comments out the rest of the line. The
+     * lexer is a single pass over the line driven by a state table. The
+     * result uses the same single block layout as cmd_parse and must be
+     * reclaimed with cmd_free.
+     *
+     * @param line The line to process
+     * @return The argument list, or NULL with errno set to EINVAL if the line
+     * ends inside a quote or escape
+     */
+    char **cmd_lex(char const *line);
+
+    /**
+     * @brief Lex a line like cmd_lex, allocating the result with a. It must
+     * be reclaimed with cmd_free_with and the same allocator.
+     *
+     * @param a The allocator, or NULL for the heap
+     * @param line The line to process
+     * @return The argument list, or NULL on a syntax error
+     */
+    char **cmd_lex_with(const struct sh_allocator *a, char const *line);
+
+    /**
+     * @brief Lex a line with the same rules as cmd_lex, but in place and
+     * without allocating. The unquoted tokens are written back over line and
+     * argv points into it, so line must outlive argv. At most n - 1 tokens
+     * are stored and argv is always NULL terminated; an argv of
+     * CMD_ARGV_BOUND(strlen(line)) slots always holds every token.
+     *
+     * @param line The line to lex, modified in place
+     * @param argv Caller owned array to fill
+     * @param n The number of slots in argv
+     * @return The number of tokens, or -1 with errno set to EINVAL if the
+     * line ends inside a quote or escape
+     */
+    ssize_t cmd_lex_inplace(char *line, char **argv, size_t n);
+
+    /**
+     * @brief Parse a command line into a flat tree of pipelines (commands
+     * joined by |, with their redirections) joined by ;, &, && and ||.
+     * Words follow the quoting rules of cmd_lex. The tree lives in one
+     * exactly sized allocation that is freed with sh_ast_free and is walked
+     * with sh_ast_first, sh_ast_next, sh_ast_child, sh_ast_op, sh_ast_argv
+     * and sh_ast_redir. Syntax errors are reported on stderr.
+     *
+     * @param line The line to parse
+     * @return The tree, or NULL on a syntax error (errno is EINVAL) or if
+     * memory ran out
+     */
+    struct sh_ast *sh_parse(const char *line);
+
+    /**
+     * @brief Parse a command line like sh_parse, allocating the tree with a.
+     * It must be freed with sh_ast_free_with and the same allocator.
+     *
+     * @param a The allocator, or NULL for the heap
+     * @param line The line to parse
+     * @return The tree, or NULL on a syntax error or if memory ran out
+     */
+    struct sh_ast *sh_parse_with(const struct sh_allocator *a, const char *line);
+
+    /**
+     * @brief Free a tree returned by sh_parse
+     *
+     * @param ast The tree to free
+     */
+    void sh_ast_free(struct sh_ast *ast);
+
+    /**
+     * @brief Free a tree returned by sh_parse_with
+     *
+     * @param a The allocator the tree came from
+     * @param ast The tree to free
+     */
+    void sh_ast_free_with(const struct sh_allocator *a, struct sh_ast *ast);
+
+    /**
+     * @brief Get the first pipeline of a parsed line
+     *
+     * @param ast The tree
+     * @return The node index, or SH_NODE_NONE for an empty line
+     */
+    uint32_t sh_ast_first(const struct sh_ast *ast);
+
+    /**
+     * @brief Get the node that follows node in its list: the next pipeline
+     * of the line or the next command of a pipeline
+     *
+     * @param ast The tree
+     * @param node The current node
+     * @return The node index, or SH_NODE_NONE at the end of the list
+     */
+    uint32_t sh_ast_next(const struct sh_ast *ast, uint32_t node);
+
+    /**
+     * @brief Get the first command of a pipeline, or the first redirection
+     * of a command
+     *
+     * @param ast The tree
+     * @param node The pipeline or command node
+     * @return The node index, or SH_NODE_NONE for a command without
+     * redirections
+     */
+    uint32_t sh_ast_child(const struct sh_ast *ast, uint32_t node);
+
+    /**
+     * @brief Get how a pipeline is joined to the one after it. The last
+     * pipeline has SH_OP_END, or SH_OP_BG if the line ends with &.
+     *
+     * @param ast The tree
+     * @param pipeline The pipeline node
+     * @return The list operator
+     */
+    enum sh_list_op sh_ast_op(const struct sh_ast *ast, uint32_t pipeline);
+
+    /**
+     * @brief Get the NULL terminated argument list of a command, ready for
+     * execvp. It points into the tree and lives as long as the tree does.
+     *
+     * @param ast The tree
+     * @param cmd The command node
+     * @return The argument list
+     */
+    char **sh_ast_argv(const struct sh_ast *ast, uint32_t cmd);
+
+    /**
+     * @brief Get the pipe size a pipeline asked for with a pipesize prefix
+     *
+     * @param ast The tree
+     * @param pipeline The pipeline node
+     * @return The size in bytes, or 0 if it has no prefix
+     */
+    size_t sh_ast_pipe_size(const struct sh_ast *ast, uint32_t pipeline);
+
+    /**
+     * @brief Get a redirection node as a struct sh_redir. Its path points
+     * into the tree and lives as long as the tree does.
+     *
+     * @param ast The tree
+     * @param redir The redirection node
+     * @return The redirection
+     */
+    struct sh_redir sh_ast_redir(const struct sh_ast *ast, uint32_t redir);
+
+    /**
+     * @brief Parse a pipe size: a positive number of bytes, optionally
+     * followed by k, m or g for KiB, MiB or GiB
+     *
+     * @param text The size
+     * @param size Set to the size in bytes
+     * @return False if text is not a valid size
+     */
+    bool sh_pipe_size_parse(const char *text, size_t *size);
+
+    /**
+     * @brief Read the largest pipe size an unprivileged process may ask
+     * for, from /proc/sys/fs/pipe-max-size
+     *
+     * @return The size in bytes, or 0 if it cannot be read
+     */
+    size_t sh_pipe_max_size(void);
+
+    /**
+     * @brief Create a bounded LRU cache of parsed lines keyed by a hash of
+     * the line. The cache is not thread safe.
+     *
+     * @param capacity The most lines to keep
+     * @return The cache, or NULL if memory ran out
+     */
+    struct sh_cache *sh_cache_create(size_t capacity);
+
+    /**
+     * @brief Create a parse cache that allocates the cache and every entry
+     * with a. The allocator must outlive the cache.
+     *
+     * @param a The allocator, or NULL for the heap
+     * @param capacity The most lines to keep
+     * @return The cache, or NULL if memory ran out
+     */
+    struct sh_cache *sh_cache_create_with(const struct sh_allocator *a, size_t capacity);
+
+    /**
+     * @brief Destroy a parse cache and every tree in it, including trees
+     * that were not released yet.
+     *
+     * @param cache The cache to destroy
+     */
+    void sh_cache_destroy(struct sh_cache *cache);
+
+    /**
+     * @brief Look a trimmed line up in the cache, parsing and inserting it
+     * on a miss. The tree is shared with the cache and must not be modified;
+     * it stays valid, even if it is evicted meanwhile, until it is handed
+     * back with sh_cache_release.
+     *
+     * @param cache The cache
+     * @param line The trimmed line
+     * @return The tree, or NULL on a syntax error or if memory ran out
+     */
+    const struct sh_ast *sh_cache_parse(struct sh_cache *cache, const char *line);
+
+    /**
+     * @brief Hand back a tree returned by sh_cache_parse
+     *
+     * @param cache The cache
+     * @param ast The tree
+     */
+    void sh_cache_release(struct sh_cache *cache, const struct sh_ast *ast);
+
+    /**
+     * @brief Get the hit and miss counters of a parse cache
+     *
+     * @param cache The cache
+     * @return The counters
+     */
+    struct sh_cache_stats sh_cache_get_stats(const struct sh_cache *cache);
+
+    /**
+     * @brief Free the line that was constructed with cmd_parse. This is a
+     * single free since the result of cmd_parse is one allocation.
      *
      * @param line the line to free
      */
     void cmd_free(char **line);
 
+    /**
+     * @brief Free a line that was constructed with cmd_parse_with or
+     * cmd_lex_with
+     *
+     * @param a The allocator the line came from
+     * @param line the line to free
+     */
+    void cmd_free_with(const struct sh_allocator *a, char **line);
+
     /**
      * @brief Trim the whitespace from the start and end of a string.
      * For example "   ls -a   " becomes "ls -a". This function modifies
@@ -92,6 +638,33 @@ extern "C"
      */
     char *trim_white(char *line);
 
+    /**
+     * @brief Check if the running CPU can execute the given instruction set
+     * for whitespace scanning.
+     *
+     * @param isa The instruction set
+     * @return True if it is supported
+     */
+    bool scan_isa_supported(enum scan_isa isa);
+
+    /**
+     * @brief Select the instruction set used by cmd_parse, cmd_tokenize and
+     * trim_white to scan for whitespace. The best supported one is selected
+     * automatically at startup, so this is only needed by tests and
+     * benchmarks. It must not be called while other threads are parsing.
+     *
+     * @param isa The instruction set to use
+     * @return True on success, false if the CPU does not support isa
+     */
+    bool scan_set_isa(enum scan_isa isa);
+
+    /**
+     * @brief Get the instruction set currently used for whitespace scanning
+     *
+     * @return The instruction set
+     */
+    enum scan_isa scan_get_isa(void);
+
     /**
      * @brief Takes an argument list and checks if the first argument is a
      * built in command such as exit, cd, jobs, etc. If the command is a
@@ -105,13 +678,530 @@ extern "C"
      */
     bool do_builtin(struct shell *sh, char **argv);
 
+    /**
+     * @brief Run a builtin like do_builtin with redirections, in the shell
+     * itself. Each fd redirected is saved, replaced and put back afterwards,
+     * so nothing is forked. A command of redirections alone (argv[0] is
+     * NULL) just opens its files. A file that cannot be opened is reported
+     * on stderr, the builtin is not run and sh->status is 1.
+     *
+     * @param sh The shell
+     * @param argv The command to check
+     * @param redirs The redirections, NULL for none
+     * @return True if the command was a builtin or had no words
+     */
+    bool sh_run_builtin(struct shell *sh, char **argv, const struct sh_redir *redirs);
+
+    /**
+     * @brief Create an empty command lookup cache. It maps command names to
+     * the file found for them in PATH and is emptied when PATH changes.
+     *
+     * @param a The allocator, NULL for the heap
+     * @return The cache, or NULL if memory ran out
+     */
+    struct sh_path_cache *sh_path_cache_create_with(const struct sh_allocator *a);
+
+    /**
+     * @brief Free a command lookup cache and all of its entries
+     *
+     * @param cache The cache to destroy
+     */
+    void sh_path_cache_destroy(struct sh_path_cache *cache);
+
+    /**
+     * @brief Keep a command lookup cache up to date through an event loop.
+     * Every PATH directory is watched with inotify and the loop drops the
+     * entry for any name that is created, removed, renamed or chmodded in
+     * one of them, so lookups never need to stat. The cache must be
+     * destroyed before the loop.
+     *
+     * @param cache The cache
+     * @param loop The loop, NULL to stop watching
+     */
+    void sh_path_cache_watch(struct sh_path_cache *cache, struct sh_loop *loop);
+
+    /**
+     * @brief Find the file to run for a command, searching PATH only the
+     * first time a name is seen. Names containing a '/' are returned as is.
+     *
+     * @param cache The cache
+     * @param name The command name
+     * @return The path, valid until the entry is dropped, or NULL if the
+     * command was not found
+     */
+    const char *sh_path_lookup(struct sh_path_cache *cache, const char *name);
+
+    /**
+     * @brief Like sh_path_lookup, but also hand back an open O_PATH fd of
+     * the binary once the command is hot (run at least twice). The fds of
+     * the SH_EXEC_FDS most recently used commands are kept, close-on-exec,
+     * so a launch can execveat the fd and skip path resolution entirely.
+     *
+     * @param cache The cache
+     * @param name The command name
+     * @param fd Set to the fd, valid until the entry is dropped, or to -1
+     * @return The path, or NULL if the command was not found
+     */
+    const char *sh_path_lookup_fd(struct sh_path_cache *cache, const char *name, int *fd);
+
+    /**
+     * @brief Add an entry without searching PATH, as hash -p does
+     *
+     * @param cache The cache
+     * @param name The command name
+     * @param path The file to run for it
+     * @return True on success, false if memory ran out
+     */
+    bool sh_path_add(struct sh_path_cache *cache, const char *name, const char *path);
+
+    /**
+     * @brief Drop the entry for a command
+     *
+     * @param cache The cache
+     * @param name The command name
+     * @return True if there was an entry
+     */
+    bool sh_path_forget(struct sh_path_cache *cache, const char *name);
+
+    /**
+     * @brief Remove every entry from a command lookup cache
+     *
+     * @param cache The cache
+     */
+    void sh_path_clear(struct sh_path_cache *cache);
+
+    /**
+     * @brief Get the counters kept by a command lookup cache
+     *
+     * @param cache The cache
+     * @return A copy of the counters
+     */
+    struct sh_path_stats sh_path_get_stats(const struct sh_path_cache *cache);
+
+    /**
+     * @brief Get the name of a spawn backend
+     *
+     * @param backend The backend
+     * @return The name, as accepted by sh_spawn_backend_parse
+     */
+    const char *sh_spawn_backend_name(enum sh_spawn_backend backend);
+
+    /**
+     * @brief Look up a spawn backend by name: auto, posix_spawn, vfork,
+     * fork or forkserver. Unknown names are reported on stderr.
+     *
+     * @param name The name of the backend
+     * @return The backend, or SH_SPAWN_AUTO if name is NULL or unknown
+     */
+    enum sh_spawn_backend sh_spawn_backend_parse(const char *name);
+
+    /**
+     * @brief Get the backend sh_spawn actually uses for a shell
+     *
+     * @param sh The shell
+     * @return The backend, never SH_SPAWN_AUTO
+     */
+    enum sh_spawn_backend sh_spawn_backend_resolve(const struct shell *sh);
+
+    /**
+     * @brief Start an external command in a new process using the shell's
+     * spawn backend. Commands without a '/' are found through sh->paths
+     * when it is set, so a cached command costs exactly one exec, and a hot
+     * one is started from its cached fd without any path resolution. The job
+     * control signals the shell ignores are reset to their defaults in the
+     * child. Errors are reported on stderr.
+     *
+     * @param sh The shell
+     * @param argv The command, argv[0] is looked up in PATH
+     * @return The pid of the child, or -1 if it could not be started
+     */
+    pid_t sh_spawn(struct shell *sh, char *const argv[]);
+
+    /**
+     * @brief Start an external command like sh_spawn, with its stdio and
+     * process group set up as attr says. Files named by attr->redirs are
+     * opened close-on-exec by the shell and handed to the child like the
+     * other fds, so a file that cannot be opened is reported before anything
+     * is started. Only the spawn backends honor attr, so a pre-forked spare
+     * is not used for it.
+     *
+     * @param sh The shell
+     * @param argv The command, argv[0] is looked up in PATH
+     * @param attr The setup, NULL to inherit everything
+     * @return The pid of the child, or -1 if it could not be started
+     */
+    pid_t sh_spawn_with_attr(struct shell *sh, char *const argv[], const struct sh_spawn_attr *attr);
+
+    /**
+     * @brief Run a pipeline. Every stage is started before any is waited
+     * for, each stage's stdout is connected to the next one's stdin with a
+     * pipe2(O_CLOEXEC) pipe, and all of them join one new process group,
+     * which gets the terminal while it runs in the foreground. Builtins that
+     * only print run on threads of the shell, joined to each other by rings
+     * rather than pipes; other builtins, and builtins with redirections, run
+     * in a forked copy of the shell. A stage's redirections apply after its
+     * pipes, so 2>&1 sends stderr down the pipe too. In the background the
+     * pipeline becomes one job.
+     *
+     * @param sh The shell
+     * @param argvs The command of every stage
+     * @param n The number of stages
+     * @param attr How to run it, NULL for SH_PIPELINE_ATTR_INIT
+     * @return The exit status of the last stage, or for a background
+     * pipeline 0 if it started and 127 if not
+     */
+    int sh_run_pipeline(struct shell *sh, char **const argvs[], size_t n, const struct sh_pipeline_attr *attr);
+
+    /**
+     * @brief Create an event loop. The terminal, children and timers are all
+     * watched through file descriptors in one epoll set, so children are
+     * reaped without a SIGCHLD handler.
+     *
+     * @param a The allocator, NULL for the heap
+     * @return The loop, or NULL on failure
+     */
+    struct sh_loop *sh_loop_create(const struct sh_allocator *a);
+
+    /**
+     * @brief Destroy an event loop and all of its watches. Children still
+     * being watched are not reaped.
+     *
+     * @param loop The loop to destroy
+     */
+    void sh_loop_destroy(struct sh_loop *loop);
+
+    /**
+     * @brief Call fn whenever fd is readable. A regular file, which epoll
+     * cannot watch, counts as always readable.
+     *
+     * @param loop The loop
+     * @param fd The fd to watch, it stays owned by the caller
+     * @param fn Called with ctx when fd is readable
+     * @param ctx Passed to fn
+     * @return The watch, or NULL on failure
+     */
+    struct sh_watch *sh_loop_watch_fd(struct sh_loop *loop, int fd, void (*fn)(void *ctx), void *ctx);
+
+    /**
+     * @brief Like sh_loop_watch_fd, but fn keeps being called while fds are
+     * paused. For kernel event sources the shell itself consumes, such as
+     * inotify, that must not wait for a foreground job to finish.
+     *
+     * @param loop The loop
+     * @param fd The fd to watch, it stays owned by the caller
+     * @param fn Called with ctx when fd is readable
+     * @param ctx Passed to fn
+     * @return The watch, or NULL on failure
+     */
+    struct sh_watch *sh_loop_watch_event_fd(struct sh_loop *loop, int fd, void (*fn)(void *ctx), void *ctx);
+
+    /**
+     * @brief Reap a child through a pidfd when it exits and call fn with its
+     * wait status. The watch goes away by itself once fn has been called.
+     *
+     * @param loop The loop
+     * @param pid A child of this process that has not been reaped
+     * @param fn Called with ctx, the pid and its waitpid status
+     * @param ctx Passed to fn
+     * @return The watch, or NULL if the child cannot be watched (errno is set)
+     */
+    struct sh_watch *sh_loop_watch_child(struct sh_loop *loop, pid_t pid,
+                                         void (*fn)(void *ctx, pid_t pid, int status), void *ctx);
+
+    /**
+     * @brief Call fn after ms milliseconds, and every ms milliseconds after
+     * that if repeat is set. A one shot timer goes away by itself once it
+     * fires.
+     *
+     * @param loop The loop
+     * @param ms The delay in milliseconds, at least 1
+     * @param repeat Whether the timer keeps firing
+     * @param fn Called with ctx when the timer fires
+     * @param ctx Passed to fn
+     * @return The watch, or NULL on failure
+     */
+    struct sh_watch *sh_loop_add_timer(struct sh_loop *loop, unsigned ms, bool repeat, void (*fn)(void *ctx),
+                                       void *ctx);
+
+    /**
+     * @brief Remove a watch. Safe to call from any callback, including the
+     * watch's own. A cancelled child watch leaves the child unreaped.
+     *
+     * @param loop The loop
+     * @param w The watch to remove
+     */
+    void sh_loop_cancel(struct sh_loop *loop, struct sh_watch *w);
+
+    /**
+     * @brief Stop or resume dispatching fd watches, for while a foreground
+     * job owns the terminal. Calls nest.
+     *
+     * @param loop The loop
+     * @param paused True to pause, false to resume
+     */
+    void sh_loop_pause_fds(struct sh_loop *loop, bool paused);
+
+    /**
+     * @brief Wait for events and dispatch them. Callbacks may run the loop
+     * again, for example to wait for a foreground child.
+     *
+     * @param loop The loop
+     * @param timeout_ms How long to wait, -1 to wait until something happens
+     * @return The number of events dispatched, or -1 on error
+     */
+    int sh_loop_run_once(struct sh_loop *loop, int timeout_ms);
+
+    /**
+     * @brief Wait for a foreground child. The shell's event loop keeps
+     * running timers and reaping other children meanwhile, but does not read
+     * the terminal. Without a loop this is a plain blocking waitpid.
+     *
+     * @param sh The shell
+     * @param pid The child
+     * @return The waitpid status of the child, or -1 on error
+     */
+    int sh_wait(struct shell *sh, pid_t pid);
+
+    /**
+     * @brief Start a fork server: a helper process, forked while the shell
+     * is still small, that forks and execs commands on the shell's behalf
+     * so launch cost does not grow with the shell's memory. Commands get
+     * the shell's stdin, stdout, stderr, cwd and environment at the time of
+     * the spawn. The helper sends back a pidfd and, later, the exit status.
+     *
+     * @param a The allocator, NULL for the heap
+     * @param loop The event loop to receive exits through, or NULL to read
+     * them only while waiting
+     * @return The server, or NULL on failure
+     */
+    struct sh_forkserver *sh_forkserver_start(const struct sh_allocator *a, struct sh_loop *loop);
+
+    /**
+     * @brief Stop a fork server. Commands it started keep running but can
+     * no longer be waited for.
+     *
+     * @param server The server
+     */
+    void sh_forkserver_stop(struct sh_forkserver *server);
+
+    /**
+     * @brief Create a pre-fork pool. While the shell waits for input it
+     * keeps one spare child forked and blocked, so running a command only
+     * costs sending it to the spare. No spare is forked until
+     * sh_prefork_arm.
+     *
+     * @param a The allocator, NULL for the heap
+     * @return The pool, or NULL if memory ran out
+     */
+    struct sh_prefork *sh_prefork_create(const struct sh_allocator *a);
+
+    /**
+     * @brief Free a pre-fork pool, reaping its spare
+     *
+     * @param p The pool
+     */
+    void sh_prefork_destroy(struct sh_prefork *p);
+
+    /**
+     * @brief Make sure a spare is waiting. Call it before waiting for
+     * input; the next sh_spawn uses the spare instead of forking.
+     *
+     * @param p The pool
+     * @return True if a spare is ready
+     */
+    bool sh_prefork_arm(struct sh_prefork *p);
+
+    /**
+     * @brief Get rid of the spare because the shell changed in a way it
+     * would not see, such as its working directory
+     *
+     * @param p The pool, may be NULL
+     */
+    void sh_prefork_discard(struct sh_prefork *p);
+
+    /**
+     * @brief Get the counters kept by a pre-fork pool
+     *
+     * @param p The pool
+     * @return A copy of the counters
+     */
+    struct sh_prefork_stats sh_prefork_get_stats(const struct sh_prefork *p);
+
+    /**
+     * @brief Call fn with the wait status of a child once it exits, whether
+     * the shell or its fork server started it. The child must not be
+     * waited for any other way.
+     *
+     * @param sh The shell
+     * @param pid The child
+     * @param fn Called with ctx, the pid and its wait status
+     * @param ctx Passed to fn
+     * @return True if the child is being watched, false if it cannot be
+     */
+    bool sh_watch_child(struct shell *sh, pid_t pid, void (*fn)(void *ctx, pid_t pid, int status), void *ctx);
+
+    /**
+     * @brief Create an empty job table
+     *
+     * @param a The allocator, NULL for the heap
+     * @return The table, or NULL if memory ran out
+     */
+    struct sh_jobs *sh_jobs_create(const struct sh_allocator *a);
+
+    /**
+     * @brief Free a job table and its jobs. Their processes are left alone.
+     *
+     * @param jobs The table to destroy
+     */
+    void sh_jobs_destroy(struct sh_jobs *jobs);
+
+    /**
+     * @brief Add a job for a running child. It gets the smallest free id.
+     *
+     * @param jobs The table
+     * @param pid The child
+     * @param pgid Its process group, 0 if it is in the shell's
+     * @param argv The command it runs, kept as one string
+     * @return The job, or NULL if memory ran out
+     */
+    struct sh_job *sh_job_add(struct sh_jobs *jobs, pid_t pid, pid_t pgid, char *const argv[]);
+
+    /**
+     * @brief Add a job made of several processes, such as a pipeline. It is
+     * done once all of them have exited, and its status is the last one's.
+     *
+     * @param jobs The table
+     * @param pids The processes, in pipeline order
+     * @param n The number of processes, at least one
+     * @param pgid The process group they are in, 0 for the shell's
+     * @param command The command line, copied
+     * @return The job, or NULL if memory ran out
+     */
+    struct sh_job *sh_job_add_procs(struct sh_jobs *jobs, const pid_t *pids, size_t n, pid_t pgid,
+                                    const char *command);
+
+    /**
+     * @brief Remove a job from its table and free it. Its id can be reused.
+     *
+     * @param jobs The table
+     * @param job The job
+     */
+    void sh_job_remove(struct sh_jobs *jobs, struct sh_job *job);
+
+    /**
+     * @brief Look up a job by id
+     *
+     * @return The job, or NULL if there is none with that id
+     */
+    struct sh_job *sh_job_get(const struct sh_jobs *jobs, int id);
+
+    /**
+     * @brief Look up a job by the pid of its process
+     *
+     * @return The job, or NULL if no job runs that pid
+     */
+    struct sh_job *sh_job_find(const struct sh_jobs *jobs, pid_t pid);
+
+    /**
+     * @brief Step through the jobs in id order
+     *
+     * @param jobs The table
+     * @param job The previous job, or NULL for the first
+     * @return The next job, or NULL after the last
+     */
+    struct sh_job *sh_job_next(const struct sh_jobs *jobs, const struct sh_job *job);
+
+    /**
+     * @brief Count the jobs in a table, finished ones included
+     */
+    size_t sh_jobs_count(const struct sh_jobs *jobs);
+
+    /**
+     * @brief Reap the children of sh->jobs in batches from sh->loop. SIGCHLD
+     * is blocked and read from a signalfd, and each time it is ready every
+     * finished job is reaped with waitid(P_ALL, WNOHANG) in one pass, so
+     * jobs need no pidfd each and a storm of exits costs one wakeup. sh_init
+     * calls this; jobs added before it keep their own watches.
+     *
+     * @param sh The shell, with its loop and job table
+     * @return True if the reaper is running
+     */
+    bool sh_jobs_watch(struct shell *sh);
+
+    /**
+     * @brief Get the counters of a job table
+     */
+    struct sh_jobs_stats sh_jobs_get_stats(const struct sh_jobs *jobs);
+
+    /**
+     * @brief Look up a job the way the job builtins name them: %n or n for
+     * job n, and %%, %+ or % for the current job (the most recently
+     * started one), %- for the one before it.
+     *
+     * @param jobs The table
+     * @param spec The job spec
+     * @return The job, or NULL if there is no such job
+     */
+    struct sh_job *sh_job_parse(const struct sh_jobs *jobs, const char *spec);
+
+    /**
+     * @brief Block until a background job finishes. The event loop keeps
+     * running meanwhile, without reading the terminal. The job stays in the
+     * table.
+     *
+     * @param sh The shell
+     * @param job The job to wait for, or NULL for whichever finishes first
+     * @return The finished job (for NULL the one that finished first of
+     * those not yet reported), or NULL if there is none to wait for
+     */
+    struct sh_job *sh_jobs_wait(struct shell *sh, struct sh_job *job);
+
+    /**
+     * @brief Start a command in the background and add it to sh->jobs. Prints
+     * "[id] pid" like other shells. The command leads a process group of its
+     * own, so a Ctrl-C meant for the foreground does not reach it. The job is
+     * marked done when the child exits, which the event loop notices while
+     * the shell waits for input or for a foreground job.
+     *
+     * @param sh The shell
+     * @param argv The command to run
+     * @return The job, or NULL if the command could not be started
+     */
+    struct sh_job *sh_run_background(struct shell *sh, char *const argv[]);
+
+    /**
+     * @brief Start a command in the background like sh_run_background, with
+     * its stdio set up as attr says
+     *
+     * @param sh The shell
+     * @param argv The command to run
+     * @param attr The setup, NULL to inherit everything. Its pgid is
+     * ignored: the command always leads a new group.
+     * @return The job, or NULL if the command could not be started
+     */
+    struct sh_job *sh_run_background_with_attr(struct shell *sh, char *const argv[],
+                                               const struct sh_spawn_attr *attr);
+
+    /**
+     * @brief Report every finished background job as "[id]  Done  command"
+     * and remove it from sh->jobs. The shell calls this before each prompt,
+     * and with set -b (sh->notify) as soon as a job finishes, except while a
+     * builtin such as wait or fg is waiting for jobs.
+     *
+     * @param sh The shell
+     * @return The number of jobs reported
+     */
+    size_t sh_jobs_notify(struct shell *sh);
+
     /**
      * @brief Initialize the shell for use. Allocate all data structures
      * Grab control of the terminal and put the shell in its own
      * process group. NOTE: This function will block until the shell is
      * in its own program group. Attaching a debugger will always cause
      * this function to fail because the debugger maintains control of
-     * the subprocess it is debugging.
+     * the subprocess it is debugging. Everything the shell allocates goes
+     * through sh->alloc, which must be set (or NULL for the heap) before
+     * calling this function.
      *
      * @param sh
      */
@@ -1,4 +1,13 @@
 #include <string.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <readline/history.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -38,13 +47,7 @@ void test_cmd_parse2(void)
   free(expected[1]);
   free(expected);
 
-  // GRADER'S NOTE: When I ran this through the test suite,
-  // it said that the test passes, but was leaking memory.
-  // This extra section should free the allocated memory. 
-  for (int i = 0; actual[i] != NULL; i++) {
-      free(actual[i]);
-  }
-  free(actual); // Free the argv array itself
+  cmd_free(actual);
   free(stng);
 }
 
@@ -60,6 +63,1644 @@ void test_cmd_parse(void)
   cmd_free(rval);
 }
 
+void test_cmd_tokenize(void)
+{
+  char line[] = "  ls\t-a   -l ";
+  char *argv[8];
+  size_t argc = cmd_tokenize(line, argv, 8);
+  TEST_ASSERT_EQUAL_UINT(3, argc);
+  TEST_ASSERT_EQUAL_STRING("ls", argv[0]);
+  TEST_ASSERT_EQUAL_STRING("-a", argv[1]);
+  TEST_ASSERT_EQUAL_STRING("-l", argv[2]);
+  TEST_ASSERT_FALSE(argv[3]);
+  // Tokens point into the caller's buffer
+  TEST_ASSERT_TRUE(argv[0] >= line && argv[0] < line + sizeof(line));
+}
+
+void test_cmd_tokenize_too_small(void)
+{
+  char line[] = "a b c";
+  char *argv[3];
+  TEST_ASSERT_EQUAL_UINT(3, cmd_tokenize(line, argv, 3));
+  TEST_ASSERT_FALSE(argv[0]);
+  TEST_ASSERT_EQUAL_STRING("a b c", line);
+}
+
+void test_cmd_lex_quotes(void)
+{
+  char **rval = cmd_lex("echo 'a  b' \"c \\\"d\\\" \\n\" e\\ f g''h \"\"");
+  TEST_ASSERT_TRUE(rval);
+  TEST_ASSERT_EQUAL_STRING("echo", rval[0]);
+  TEST_ASSERT_EQUAL_STRING("a  b", rval[1]);
+  TEST_ASSERT_EQUAL_STRING("c \"d\" \\n", rval[2]);
+  TEST_ASSERT_EQUAL_STRING("e f", rval[3]);
+  TEST_ASSERT_EQUAL_STRING("gh", rval[4]);
+  TEST_ASSERT_EQUAL_STRING("", rval[5]);
+  TEST_ASSERT_NULL(rval[6]);
+  cmd_free(rval);
+}
+
+void test_cmd_lex_comment(void)
+{
+  char line[] = "ls a#b # the rest 'is ignored";
+  char *argv[CMD_ARGV_INLINE];
+  TEST_ASSERT_EQUAL_INT(2, cmd_lex_inplace(line, argv, CMD_ARGV_INLINE));
+  TEST_ASSERT_EQUAL_STRING("ls", argv[0]);
+  TEST_ASSERT_EQUAL_STRING("a#b", argv[1]);
+  TEST_ASSERT_NULL(argv[2]);
+}
+
+void test_cmd_lex_unterminated(void)
+{
+  TEST_ASSERT_NULL(cmd_lex("echo 'oops"));
+  TEST_ASSERT_NULL(cmd_lex("echo \"oops"));
+  TEST_ASSERT_NULL(cmd_lex("echo oops\\"));
+}
+
+void test_sh_parse_list(void)
+{
+  struct sh_ast *ast = sh_parse("make&&./run 'a;b' || echo failed ; ls -l;");
+  TEST_ASSERT_NOT_NULL(ast);
+
+  static const char *argv0[] = {"make", "./run", "echo", "ls"};
+  static const enum sh_list_op ops[] = {SH_OP_AND, SH_OP_OR, SH_OP_SEQ, SH_OP_END};
+  size_t count = 0;
+  for (uint32_t p = sh_ast_first(ast); p != SH_NODE_NONE; p = sh_ast_next(ast, p))
+  {
+    TEST_ASSERT_TRUE(count < 4);
+    TEST_ASSERT_EQUAL_UINT8(SH_NODE_PIPELINE, ast->kind[p]);
+    TEST_ASSERT_EQUAL_INT(ops[count], sh_ast_op(ast, p));
+    uint32_t cmd = sh_ast_child(ast, p);
+    TEST_ASSERT_EQUAL_UINT8(SH_NODE_CMD, ast->kind[cmd]);
+    TEST_ASSERT_EQUAL_UINT32(SH_NODE_NONE, sh_ast_next(ast, cmd));
+    TEST_ASSERT_EQUAL_STRING(argv0[count], sh_ast_argv(ast, cmd)[0]);
+    count++;
+  }
+  TEST_ASSERT_EQUAL_UINT(4, count);
+
+  // Quoted operators are plain words
+  char **run = sh_ast_argv(ast, sh_ast_child(ast, sh_ast_next(ast, 0)));
+  TEST_ASSERT_EQUAL_STRING("a;b", run[1]);
+  TEST_ASSERT_NULL(run[2]);
+  sh_ast_free(ast);
+}
+
+void test_sh_parse_background(void)
+{
+  struct sh_ast *ast = sh_parse("sleep 1& make && ./run &");
+  TEST_ASSERT_NOT_NULL(ast);
+
+  uint32_t p = sh_ast_first(ast);
+  TEST_ASSERT_EQUAL_INT(SH_OP_BG, sh_ast_op(ast, p));
+  TEST_ASSERT_EQUAL_STRING("1", sh_ast_argv(ast, sh_ast_child(ast, p))[1]);
+  p = sh_ast_next(ast, p);
+  TEST_ASSERT_EQUAL_INT(SH_OP_AND, sh_ast_op(ast, p));
+  p = sh_ast_next(ast, p);
+  // A trailing & is kept, unlike a trailing ;
+  TEST_ASSERT_EQUAL_INT(SH_OP_BG, sh_ast_op(ast, p));
+  TEST_ASSERT_EQUAL_STRING("./run", sh_ast_argv(ast, sh_ast_child(ast, p))[0]);
+  TEST_ASSERT_EQUAL_UINT32(SH_NODE_NONE, sh_ast_next(ast, p));
+  sh_ast_free(ast);
+}
+
+void test_sh_parse_pipeline(void)
+{
+  struct sh_ast *ast = sh_parse("ls -l | grep a|wc -l && echo ok | cat &");
+  TEST_ASSERT_NOT_NULL(ast);
+
+  uint32_t p = sh_ast_first(ast);
+  TEST_ASSERT_EQUAL_INT(SH_OP_AND, sh_ast_op(ast, p));
+  uint32_t c = sh_ast_child(ast, p);
+  TEST_ASSERT_EQUAL_STRING("-l", sh_ast_argv(ast, c)[1]);
+  c = sh_ast_next(ast, c);
+  TEST_ASSERT_EQUAL_STRING("grep", sh_ast_argv(ast, c)[0]);
+  c = sh_ast_next(ast, c);
+  TEST_ASSERT_EQUAL_STRING("wc", sh_ast_argv(ast, c)[0]);
+  TEST_ASSERT_EQUAL_UINT32(SH_NODE_NONE, sh_ast_next(ast, c));
+
+  p = sh_ast_next(ast, p);
+  TEST_ASSERT_EQUAL_INT(SH_OP_BG, sh_ast_op(ast, p));
+  c = sh_ast_next(ast, sh_ast_child(ast, p));
+  TEST_ASSERT_EQUAL_STRING("cat", sh_ast_argv(ast, c)[0]);
+  TEST_ASSERT_EQUAL_UINT32(SH_NODE_NONE, sh_ast_next(ast, p));
+  sh_ast_free(ast);
+}
+
+void test_sh_parse_redirs(void)
+{
+  struct sh_ast *ast = sh_parse("sort <in -r 2>>log | >out tr a b 2>&1 &>all 0<>rw");
+  TEST_ASSERT_NOT_NULL(ast);
+
+  // Redirections hang off their command and leave its argv whole
+  uint32_t c = sh_ast_child(ast, sh_ast_first(ast));
+  char **argv = sh_ast_argv(ast, c);
+  TEST_ASSERT_EQUAL_STRING("sort", argv[0]);
+  TEST_ASSERT_EQUAL_STRING("-r", argv[1]);
+  TEST_ASSERT_NULL(argv[2]);
+  uint32_t r = sh_ast_child(ast, c);
+  TEST_ASSERT_EQUAL_UINT8(SH_NODE_REDIR, ast->kind[r]);
+  struct sh_redir in = sh_ast_redir(ast, r);
+  TEST_ASSERT_EQUAL_INT(SH_REDIR_IN, in.op);
+  TEST_ASSERT_EQUAL_INT(0, in.fd);
+  TEST_ASSERT_EQUAL_STRING("in", in.path);
+  r = sh_ast_next(ast, r);
+  struct sh_redir log = sh_ast_redir(ast, r);
+  TEST_ASSERT_EQUAL_INT(SH_REDIR_APPEND, log.op);
+  TEST_ASSERT_EQUAL_INT(2, log.fd);
+  TEST_ASSERT_EQUAL_STRING("log", log.path);
+  TEST_ASSERT_EQUAL_UINT32(SH_NODE_NONE, sh_ast_next(ast, r));
+
+  // A redirection may start a command, and &> is > followed by 2>&1
+  c = sh_ast_next(ast, c);
+  argv = sh_ast_argv(ast, c);
+  TEST_ASSERT_EQUAL_STRING("tr", argv[0]);
+  TEST_ASSERT_NULL(argv[3]);
+  static const struct
+  {
+    enum sh_redir_op op;
+    int fd;
+    const char *path;
+    int src;
+  } want[] = {
+      {SH_REDIR_OUT, 1, "out", -1}, {SH_REDIR_DUP, 2, NULL, 1},  {SH_REDIR_OUT, 1, "all", -1},
+      {SH_REDIR_DUP, 2, NULL, 1},   {SH_REDIR_RDWR, 0, "rw", -1},
+  };
+  size_t count = 0;
+  for (r = sh_ast_child(ast, c); r != SH_NODE_NONE; r = sh_ast_next(ast, r))
+  {
+    TEST_ASSERT_TRUE(count < 5);
+    struct sh_redir got = sh_ast_redir(ast, r);
+    TEST_ASSERT_EQUAL_INT(want[count].op, got.op);
+    TEST_ASSERT_EQUAL_INT(want[count].fd, got.fd);
+    if (want[count].path) TEST_ASSERT_EQUAL_STRING(want[count].path, got.path);
+    else TEST_ASSERT_EQUAL_INT(want[count].src, got.src);
+    count++;
+  }
+  TEST_ASSERT_EQUAL_UINT(5, count);
+  sh_ast_free(ast);
+
+  // A line of redirections alone is a command without words
+  ast = sh_parse("> empty");
+  TEST_ASSERT_NOT_NULL(ast);
+  TEST_ASSERT_NULL(sh_ast_argv(ast, sh_ast_child(ast, sh_ast_first(ast)))[0]);
+  sh_ast_free(ast);
+
+  TEST_ASSERT_NULL(sh_parse("ls >"));
+  TEST_ASSERT_NULL(sh_parse("ls > | cat"));
+  TEST_ASSERT_NULL(sh_parse("ls 3> f"));
+  TEST_ASSERT_NULL(sh_parse("ls 2>&x"));
+  TEST_ASSERT_NULL(sh_parse("ls >&5"));
+}
+
+void test_sh_parse_errors(void)
+{
+  TEST_ASSERT_NULL(sh_parse("; ls"));
+  TEST_ASSERT_NULL(sh_parse("ls &&"));
+  TEST_ASSERT_NULL(sh_parse("ls ;; ls"));
+  TEST_ASSERT_NULL(sh_parse("& ls"));
+  TEST_ASSERT_NULL(sh_parse("ls & ; ls"));
+  TEST_ASSERT_NULL(sh_parse("ls |"));
+  TEST_ASSERT_NULL(sh_parse("| ls"));
+  TEST_ASSERT_NULL(sh_parse("ls | ; ls"));
+  TEST_ASSERT_NULL(sh_parse("echo 'open"));
+
+  struct sh_ast *ast = sh_parse("  # nothing here");
+  TEST_ASSERT_NOT_NULL(ast);
+  TEST_ASSERT_EQUAL_UINT32(SH_NODE_NONE, sh_ast_first(ast));
+  sh_ast_free(ast);
+}
+
+void test_sh_parse_long_line(void)
+{
+  // Longer than the parser's stack scratch space
+  char line[1024] = "echo";
+  for (int i = 0; i < 200; i++) strcat(line, i % 50 == 49 ? ";echo" : " x");
+
+  struct sh_ast *ast = sh_parse(line);
+  TEST_ASSERT_NOT_NULL(ast);
+  // Five pipelines of one command: four "echo x..." and a bare "echo"
+  TEST_ASSERT_EQUAL_UINT32(10, ast->nnodes);
+  TEST_ASSERT_EQUAL_UINT32(196 + 5 + 5, ast->nwords);
+  char **fourth = sh_ast_argv(ast, 7);
+  TEST_ASSERT_EQUAL_STRING("echo", fourth[0]);
+  TEST_ASSERT_EQUAL_STRING("x", fourth[49]);
+  TEST_ASSERT_NULL(fourth[50]);
+  char **last = sh_ast_argv(ast, 9);
+  TEST_ASSERT_EQUAL_STRING("echo", last[0]);
+  TEST_ASSERT_NULL(last[1]);
+  sh_ast_free(ast);
+}
+
+void test_sh_cache_hits(void)
+{
+  struct sh_cache *cache = sh_cache_create(4);
+  const struct sh_ast *a = sh_cache_parse(cache, "ls -l; pwd");
+  const struct sh_ast *b = sh_cache_parse(cache, "ls -l; pwd");
+  TEST_ASSERT_NOT_NULL(a);
+  TEST_ASSERT_EQUAL_PTR(a, b);
+  TEST_ASSERT_EQUAL_STRING("pwd", sh_ast_argv(a, sh_ast_child(a, sh_ast_next(a, 0)))[0]);
+  TEST_ASSERT_NULL(sh_cache_parse(cache, "ls &&"));
+
+  struct sh_cache_stats st = sh_cache_get_stats(cache);
+  TEST_ASSERT_EQUAL_UINT(1, st.hits);
+  TEST_ASSERT_EQUAL_UINT(2, st.misses);
+  TEST_ASSERT_EQUAL_UINT(1, st.entries);
+
+  sh_cache_release(cache, a);
+  sh_cache_release(cache, b);
+  sh_cache_destroy(cache);
+}
+
+void test_sh_cache_lru(void)
+{
+  struct sh_cache *cache = sh_cache_create(2);
+
+  // Keep the first tree in use while it gets evicted
+  const struct sh_ast *first = sh_cache_parse(cache, "echo one");
+  sh_cache_release(cache, sh_cache_parse(cache, "echo two"));
+  sh_cache_release(cache, sh_cache_parse(cache, "echo three"));
+  TEST_ASSERT_EQUAL_UINT(1, sh_cache_get_stats(cache).evictions);
+  TEST_ASSERT_EQUAL_STRING("one", sh_ast_argv(first, 1)[1]);
+  sh_cache_release(cache, first);
+
+  // "echo two" is now the oldest and goes next, "echo three" stays cached
+  sh_cache_release(cache, sh_cache_parse(cache, "echo three"));
+  sh_cache_release(cache, sh_cache_parse(cache, "echo four"));
+  sh_cache_release(cache, sh_cache_parse(cache, "echo three"));
+  struct sh_cache_stats st = sh_cache_get_stats(cache);
+  TEST_ASSERT_EQUAL_UINT(2, st.hits);
+  TEST_ASSERT_EQUAL_UINT(2, st.evictions);
+  TEST_ASSERT_EQUAL_UINT(2, st.entries);
+  sh_cache_destroy(cache);
+}
+
+// Counts allocations and frees on top of the heap
+struct counting
+{
+  size_t allocs;
+  size_t frees;
+  size_t bytes;
+};
+
+static void *counting_alloc(void *ctx, size_t size)
+{
+  struct counting *c = ctx;
+  c->allocs++;
+  c->bytes += size;
+  return malloc(size);
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+  struct counting *c = ctx;
+  c->frees++;
+  free(ptr);
+}
+
+void test_allocator_counting(void)
+{
+  struct counting c = {0};
+  struct sh_allocator a = {counting_alloc, counting_free, &c};
+
+  char **argv = cmd_parse_with(&a, "ls -a -l");
+  TEST_ASSERT_EQUAL_STRING("-l", argv[2]);
+  cmd_free_with(&a, argv);
+  TEST_ASSERT_EQUAL_UINT(1, c.allocs);
+  TEST_ASSERT_EQUAL_UINT(1, c.frees);
+
+  // State that outlives a line is on the heap, so an arena behind the
+  // shell's allocator can be reset after every line
+  c = (struct counting){0};
+  struct shell s = {.alloc = &a};
+  sh_init(&s);
+  const struct sh_ast *ast = sh_cache_parse(s.cache, "echo hi; pwd");
+  sh_cache_release(s.cache, ast);
+  TEST_ASSERT_EQUAL_UINT(0, c.allocs);
+
+  // What a line needs while it runs goes through the allocator
+  char *yes[] = {"true", NULL};
+  char **const stages[] = {yes, yes};
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&s, stages, 2, NULL));
+  sh_destroy(&s);
+  TEST_ASSERT_TRUE(c.allocs > 0);
+  TEST_ASSERT_EQUAL_UINT(c.allocs, c.frees);
+}
+
+void test_allocator_arena(void)
+{
+  struct sh_arena arena;
+  TEST_ASSERT_TRUE(sh_arena_init(&arena, 4096));
+
+  struct sh_ast *ast = sh_parse_with(&arena.allocator, "make && ./run");
+  TEST_ASSERT_NOT_NULL(ast);
+  TEST_ASSERT_TRUE((char *)ast >= arena.base && (char *)ast < arena.base + arena.size);
+  TEST_ASSERT_EQUAL_STRING("./run", sh_ast_argv(ast, 3)[0]);
+  sh_ast_free_with(&arena.allocator, ast);
+  TEST_ASSERT_TRUE(arena.used > 0);
+
+  sh_arena_reset(&arena);
+  TEST_ASSERT_EQUAL_UINT(0, arena.used);
+
+  // A full arena overflows to the heap and frees those blocks for real
+  char *big = arena.allocator.alloc(arena.allocator.ctx, 8192);
+  TEST_ASSERT_NOT_NULL(big);
+  TEST_ASSERT_EQUAL_UINT(1, arena.overflows);
+  arena.allocator.free(arena.allocator.ctx, big);
+  TEST_ASSERT_NULL(arena.overflow);
+
+  // Blocks that are never freed go on reset, like the rest of the arena
+  TEST_ASSERT_NOT_NULL(arena.allocator.alloc(arena.allocator.ctx, 8192));
+  TEST_ASSERT_NOT_NULL(arena.allocator.alloc(arena.allocator.ctx, 8192));
+  TEST_ASSERT_NOT_NULL(arena.overflow);
+  sh_arena_reset(&arena);
+  TEST_ASSERT_NULL(arena.overflow);
+  TEST_ASSERT_NOT_NULL(arena.allocator.alloc(arena.allocator.ctx, 8192));
+  sh_arena_destroy(&arena);
+}
+
+// Allocation budgets for parsing one line. Parsers must stay proportional
+// to the line, not to limits like ARG_MAX.
+#define ARGV_BYTE_BUDGET(len) (CMD_ARGV_BOUND(len) * sizeof(char *) + (len) + 1)
+#define AST_BYTE_BUDGET(len) (8 * (len) + 128)
+
+static const char *budget_lines[] = {
+    "ls -la",
+    "grep -rn --color=auto TODO src/ include/ tests/",
+    "make && ./run --fast || echo failed; ls -l",
+    "echo 'quoted  words' \"and more\" plain\\ escaped",
+};
+
+void test_alloc_budget_cmd_parse(void)
+{
+  for (size_t i = 0; i < sizeof(budget_lines) / sizeof(budget_lines[0]); i++)
+  {
+    struct counting c = {0};
+    struct sh_allocator a = {counting_alloc, counting_free, &c};
+    size_t len = strlen(budget_lines[i]);
+
+    cmd_free_with(&a, cmd_parse_with(&a, budget_lines[i]));
+    TEST_ASSERT_EQUAL_UINT(1, c.allocs);
+    TEST_ASSERT_TRUE(c.bytes <= ARGV_BYTE_BUDGET(len));
+
+    c = (struct counting){0};
+    cmd_free_with(&a, cmd_lex_with(&a, budget_lines[i]));
+    TEST_ASSERT_EQUAL_UINT(1, c.allocs);
+    TEST_ASSERT_TRUE(c.bytes <= ARGV_BYTE_BUDGET(len));
+  }
+}
+
+void test_alloc_budget_sh_parse(void)
+{
+  for (size_t i = 0; i < sizeof(budget_lines) / sizeof(budget_lines[0]); i++)
+  {
+    struct counting c = {0};
+    struct sh_allocator a = {counting_alloc, counting_free, &c};
+    size_t len = strlen(budget_lines[i]);
+
+    sh_ast_free_with(&a, sh_parse_with(&a, budget_lines[i]));
+    TEST_ASSERT_EQUAL_UINT(1, c.allocs);
+    TEST_ASSERT_EQUAL_UINT(1, c.frees);
+    TEST_ASSERT_TRUE(c.bytes <= AST_BYTE_BUDGET(len));
+  }
+}
+
+void test_alloc_budget_cache(void)
+{
+  struct counting c = {0};
+  struct sh_allocator a = {counting_alloc, counting_free, &c};
+  struct sh_cache *cache = sh_cache_create_with(&a, 8);
+  const char *line = budget_lines[2];
+
+  // A miss is one allocation of the tree plus its key
+  c = (struct counting){0};
+  sh_cache_release(cache, sh_cache_parse(cache, line));
+  TEST_ASSERT_EQUAL_UINT(1, c.allocs);
+  TEST_ASSERT_TRUE(c.bytes <= AST_BYTE_BUDGET(strlen(line)) + 128 + strlen(line));
+
+  // A hit allocates nothing
+  c = (struct counting){0};
+  for (int i = 0; i < 100; i++) sh_cache_release(cache, sh_cache_parse(cache, line));
+  TEST_ASSERT_EQUAL_UINT(0, c.allocs);
+  sh_cache_destroy(cache);
+
+  // Destroying a cache frees a tree it evicted while it was still in use
+  c = (struct counting){0};
+  cache = sh_cache_create_with(&a, 1);
+  TEST_ASSERT_NOT_NULL(sh_cache_parse(cache, "echo held"));
+  sh_cache_release(cache, sh_cache_parse(cache, "echo other"));
+  TEST_ASSERT_EQUAL_UINT(1, sh_cache_get_stats(cache).evictions);
+  sh_cache_destroy(cache);
+  TEST_ASSERT_EQUAL_UINT(c.allocs, c.frees);
+}
+
+void test_alloc_budget_get_prompt(void)
+{
+  struct counting c = {0};
+  struct sh_allocator a = {counting_alloc, counting_free, &c};
+  char *prompt = get_prompt_with(&a, "MY_PROMPT");
+  TEST_ASSERT_EQUAL_UINT(1, c.allocs);
+  TEST_ASSERT_EQUAL_UINT(strlen(prompt) + 1, c.bytes);
+  a.free(a.ctx, prompt);
+}
+
+#define PARSE_THREADS 8
+#define PARSE_ROUNDS 2000
+
+static const char *parse_lines[] = {
+    "ls -a -l",
+    "  grep\t-n foo  bar.txt ",
+    "echo one two three four five six",
+    "cd /",
+};
+static const char *parse_expected[][8] = {
+    {"ls", "-a", "-l", NULL},
+    {"grep", "-n", "foo", "bar.txt", NULL},
+    {"echo", "one", "two", "three", "four", "five", "six", NULL},
+    {"cd", "/", NULL},
+};
+
+static void *parse_worker(void *arg)
+{
+  size_t id = (size_t)arg;
+  for (size_t r = 0; r < PARSE_ROUNDS; r++)
+  {
+    size_t which = (id + r) % 4;
+    char **argv = cmd_parse(parse_lines[which]);
+    bool ok = argv != NULL;
+    for (size_t i = 0; ok; i++)
+    {
+      const char *want = parse_expected[which][i];
+      if (want == NULL || argv[i] == NULL)
+      {
+        ok = want == argv[i];
+        break;
+      }
+      ok = strcmp(want, argv[i]) == 0;
+    }
+    cmd_free(argv);
+    if (!ok) return (void *)1;
+  }
+  return NULL;
+}
+
+void test_cmd_parse_threads(void)
+{
+  pthread_t threads[PARSE_THREADS];
+  for (size_t i = 0; i < PARSE_THREADS; i++)
+  {
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, parse_worker, (void *)i));
+  }
+
+  size_t failures = 0;
+  for (size_t i = 0; i < PARSE_THREADS; i++)
+  {
+    void *rval;
+    pthread_join(threads[i], &rval);
+    if (rval) failures++;
+  }
+  TEST_ASSERT_EQUAL_UINT(0, failures);
+}
+
+void test_sh_spawn_backends(void)
+{
+  TEST_ASSERT_EQUAL(SH_SPAWN_VFORK, sh_spawn_backend_parse("vfork"));
+  TEST_ASSERT_EQUAL(SH_SPAWN_AUTO, sh_spawn_backend_parse(NULL));
+  TEST_ASSERT_EQUAL_STRING("posix_spawn", sh_spawn_backend_name(SH_SPAWN_POSIX));
+
+  for (int backend = SH_SPAWN_AUTO; backend <= SH_SPAWN_FORK; backend++)
+  {
+    struct shell sh = {0};
+    sh.spawn = (enum sh_spawn_backend)backend;
+    TEST_ASSERT_NOT_EQUAL(SH_SPAWN_AUTO, sh_spawn_backend_resolve(&sh));
+
+    // Exit statuses come back through waitpid
+    char *ok[] = {"sh", "-c", "exit 3", NULL};
+    int status;
+    pid_t pid = sh_spawn(&sh, ok);
+    TEST_ASSERT_GREATER_THAN(0, pid);
+    TEST_ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL(3, WEXITSTATUS(status));
+
+    // The job control signals the shell ignores are back to SIG_DFL
+    char *sig[] = {"sh", "-c", "kill -INT $$", NULL};
+    signal(SIGINT, SIG_IGN);
+    pid = sh_spawn(&sh, sig);
+    signal(SIGINT, SIG_DFL);
+    TEST_ASSERT_GREATER_THAN(0, pid);
+    waitpid(pid, &status, 0);
+    TEST_ASSERT_TRUE(WIFSIGNALED(status));
+    TEST_ASSERT_EQUAL(SIGINT, WTERMSIG(status));
+
+    // A missing command fails in the parent, not in a stray child
+    char *missing[] = {"no-such-command-452", NULL};
+    TEST_ASSERT_EQUAL(-1, sh_spawn(&sh, missing));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+  }
+}
+
+static void count_tick(void *ctx)
+{
+  (*(int *)ctx)++;
+}
+
+static void record_exit(void *ctx, pid_t pid, int status)
+{
+  UNUSED(pid);
+  *(int *)ctx = status;
+}
+
+void test_sh_loop_children_and_timers(void)
+{
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  TEST_ASSERT_NOT_NULL(sh.loop);
+
+  // A child running in the background is reaped by the loop while a
+  // foreground child is waited for
+  char *slow[] = {"sh", "-c", "sleep 0.05; exit 4", NULL};
+  char *fast[] = {"sh", "-c", "exit 2", NULL};
+  int slow_status = -1;
+  pid_t bg = sh_spawn(&sh, slow);
+  TEST_ASSERT_NOT_NULL(sh_loop_watch_child(sh.loop, bg, record_exit, &slow_status));
+
+  int ticks = 0, once = 0;
+  struct sh_watch *tick = sh_loop_add_timer(sh.loop, 5, true, count_tick, &ticks);
+  TEST_ASSERT_NOT_NULL(tick);
+  TEST_ASSERT_NOT_NULL(sh_loop_add_timer(sh.loop, 1, false, count_tick, &once));
+
+  int status = sh_wait(&sh, sh_spawn(&sh, fast));
+  TEST_ASSERT_TRUE(WIFEXITED(status));
+  TEST_ASSERT_EQUAL(2, WEXITSTATUS(status));
+
+  while (slow_status == -1) TEST_ASSERT_TRUE(sh_loop_run_once(sh.loop, -1) >= 0);
+  TEST_ASSERT_TRUE(WIFEXITED(slow_status));
+  TEST_ASSERT_EQUAL(4, WEXITSTATUS(slow_status));
+  TEST_ASSERT_EQUAL(ECHILD, waitpid(bg, NULL, WNOHANG) < 0 ? errno : 0);
+
+  // The one shot timer fired once, the repeating one kept going
+  TEST_ASSERT_EQUAL(1, once);
+  TEST_ASSERT_GREATER_THAN(1, ticks);
+  sh_loop_cancel(sh.loop, tick);
+  int seen = ticks;
+  sh_loop_run_once(sh.loop, 20);
+  TEST_ASSERT_EQUAL(seen, ticks);
+
+  // A child someone else reaped is reported as failed, not as exit 0
+  char *ok[] = {"true", NULL};
+  int stolen_status = -1;
+  pid_t stolen = sh_spawn(&sh, ok);
+  TEST_ASSERT_NOT_NULL(sh_loop_watch_child(sh.loop, stolen, record_exit, &stolen_status));
+  TEST_ASSERT_EQUAL(stolen, waitpid(stolen, NULL, 0));
+  while (stolen_status == -1) TEST_ASSERT_TRUE(sh_loop_run_once(sh.loop, 1000) > 0);
+  TEST_ASSERT_TRUE(WIFEXITED(stolen_status));
+  TEST_ASSERT_EQUAL(255, WEXITSTATUS(stolen_status));
+
+  sh_loop_destroy(sh.loop);
+}
+
+void test_sh_loop_pause_fds(void)
+{
+  struct sh_loop *loop = sh_loop_create(NULL);
+  int fds[2];
+  TEST_ASSERT_EQUAL(0, pipe(fds));
+
+  // A hung up pipe is readable, but not while fds are paused
+  close(fds[1]);
+  int reads = 0;
+  struct sh_watch *w = sh_loop_watch_fd(loop, fds[0], count_tick, &reads);
+  sh_loop_pause_fds(loop, true);
+  TEST_ASSERT_EQUAL(0, sh_loop_run_once(loop, 10));
+  TEST_ASSERT_EQUAL(0, reads);
+  sh_loop_pause_fds(loop, false);
+  TEST_ASSERT_EQUAL(1, sh_loop_run_once(loop, 10));
+  TEST_ASSERT_EQUAL(1, reads);
+
+  sh_loop_cancel(loop, w);
+  sh_loop_destroy(loop);
+  close(fds[0]);
+}
+
+// Write an executable script that exits with status
+static void write_tool(const char *path, int status)
+{
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fprintf(f, "#!/bin/sh\nexit %d\n", status);
+  fclose(f);
+  TEST_ASSERT_EQUAL(0, chmod(path, 0755));
+}
+
+void test_sh_path_cache(void)
+{
+  char first[] = "/tmp/test-lab-pathXXXXXX";
+  char second[] = "/tmp/test-lab-pathXXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(first));
+  TEST_ASSERT_NOT_NULL(mkdtemp(second));
+  char *saved = strdup(getenv("PATH"));
+  char path_env[128], first_tool[64], second_tool[64];
+  snprintf(path_env, sizeof(path_env), "%s:%s:/bin:/usr/bin", first, second);
+  snprintf(first_tool, sizeof(first_tool), "%s/tool", first);
+  snprintf(second_tool, sizeof(second_tool), "%s/tool", second);
+  setenv("PATH", path_env, 1);
+
+  struct shell sh = {0};
+  sh.paths = sh_path_cache_create_with(NULL);
+  write_tool(second_tool, 5);
+
+  // Resolved once, then served from the cache
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(sh.paths, "tool"));
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(sh.paths, "tool"));
+  TEST_ASSERT_NULL(sh_path_lookup(sh.paths, "no-such-command-452"));
+  struct sh_path_stats stats = sh_path_get_stats(sh.paths);
+  TEST_ASSERT_EQUAL(1, stats.hits);
+  TEST_ASSERT_EQUAL(2, stats.misses);
+  TEST_ASSERT_EQUAL(1, stats.entries);
+
+  // A binary earlier in PATH is not seen until the entry is dropped, and a
+  // cached binary that disappears is looked up again when it fails to exec
+  write_tool(first_tool, 6);
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(sh.paths, "tool"));
+  unlink(second_tool);
+  char *argv[] = {"tool", NULL};
+  int status = sh_wait(&sh, sh_spawn(&sh, argv));
+  TEST_ASSERT_EQUAL(6, WEXITSTATUS(status));
+  TEST_ASSERT_EQUAL_STRING(first_tool, sh_path_lookup(sh.paths, "tool"));
+
+  // Changing PATH empties the cache
+  sh_path_add(sh.paths, "other", "/bin/true");
+  setenv("PATH", "/bin:/usr/bin", 1);
+  TEST_ASSERT_NULL(sh_path_lookup(sh.paths, "tool"));
+  stats = sh_path_get_stats(sh.paths);
+  TEST_ASSERT_EQUAL(1, stats.invalidations);
+  TEST_ASSERT_EQUAL(0, stats.entries);
+
+  // An empty entry is whatever the current directory is, so what it finds
+  // is run but not cached
+  write_tool(second_tool, 5);
+  char *cwd = getcwd(NULL, 0);
+  setenv("PATH", ":/bin:/usr/bin", 1);
+  TEST_ASSERT_EQUAL(0, chdir(first));
+  TEST_ASSERT_EQUAL(6, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, argv))));
+  TEST_ASSERT_EQUAL(0, chdir(second));
+  TEST_ASSERT_EQUAL(5, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, argv))));
+  TEST_ASSERT_EQUAL(0, chdir(cwd));
+  free(cwd);
+  TEST_ASSERT_NULL(sh_path_lookup(sh.paths, "tool"));
+  TEST_ASSERT_EQUAL(0, sh_path_get_stats(sh.paths).entries);
+
+  setenv("PATH", saved, 1);
+  free(saved);
+  sh_path_cache_destroy(sh.paths);
+  unlink(first_tool);
+  unlink(second_tool);
+  rmdir(first);
+  rmdir(second);
+}
+
+void test_sh_path_cache_inotify(void)
+{
+  char first[] = "/tmp/test-lab-pathXXXXXX";
+  char second[] = "/tmp/test-lab-pathXXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(first));
+  TEST_ASSERT_NOT_NULL(mkdtemp(second));
+  char *saved = strdup(getenv("PATH"));
+  char path_env[128], first_tool[64], second_tool[64], other[64];
+  snprintf(path_env, sizeof(path_env), "%s:%s", first, second);
+  snprintf(first_tool, sizeof(first_tool), "%s/tool", first);
+  snprintf(second_tool, sizeof(second_tool), "%s/tool", second);
+  snprintf(other, sizeof(other), "%s/other", second);
+  setenv("PATH", path_env, 1);
+
+  struct sh_loop *loop = sh_loop_create(NULL);
+  struct sh_path_cache *cache = sh_path_cache_create_with(NULL);
+  sh_path_cache_watch(cache, loop);
+  write_tool(second_tool, 0);
+  write_tool(other, 0);
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(cache, "tool"));
+  TEST_ASSERT_EQUAL_STRING(other, sh_path_lookup(cache, "other"));
+
+  // Installing a binary earlier in PATH drops only the entry it shadows
+  write_tool(first_tool, 0);
+  while (sh_path_get_stats(cache).dropped == 0) TEST_ASSERT_TRUE(sh_loop_run_once(loop, 1000) > 0);
+  TEST_ASSERT_EQUAL(1, sh_path_get_stats(cache).entries);
+  TEST_ASSERT_EQUAL_STRING(first_tool, sh_path_lookup(cache, "tool"));
+
+  // So does removing one
+  unlink(first_tool);
+  while (sh_path_get_stats(cache).entries == 2) TEST_ASSERT_TRUE(sh_loop_run_once(loop, 1000) > 0);
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(cache, "tool"));
+  TEST_ASSERT_EQUAL_STRING(other, sh_path_lookup(cache, "other"));
+
+  // Only tool was ever searched for again
+  TEST_ASSERT_EQUAL(4, sh_path_get_stats(cache).misses);
+
+  // A PATH directory that does not exist yet is watched from the time
+  // it is created, through its nearest parent until then
+  char missing[64], missing_tool[96];
+  snprintf(missing, sizeof(missing), "%s/sub", first);
+  snprintf(missing_tool, sizeof(missing_tool), "%s/bin/tool", missing);
+  snprintf(path_env, sizeof(path_env), "%s/bin:%s", missing, second);
+  setenv("PATH", path_env, 1);
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(cache, "tool"));
+  TEST_ASSERT_EQUAL(0, mkdir(missing, 0755));
+  strcat(missing, "/bin");
+  TEST_ASSERT_EQUAL(0, mkdir(missing, 0755));
+  while (sh_path_get_stats(cache).entries) TEST_ASSERT_TRUE(sh_loop_run_once(loop, 1000) > 0);
+  write_tool(missing_tool, 0);
+  while (sh_loop_run_once(loop, 100) > 0)
+    ;
+  TEST_ASSERT_EQUAL_STRING(missing_tool, sh_path_lookup(cache, "tool"));
+  unlink(missing_tool);
+  while (sh_path_get_stats(cache).entries) TEST_ASSERT_TRUE(sh_loop_run_once(loop, 1000) > 0);
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(cache, "tool"));
+
+  // So is one that is removed and made again later
+  TEST_ASSERT_EQUAL(0, rmdir(missing));
+  while (sh_loop_run_once(loop, 100) > 0)
+    ;
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(cache, "tool"));
+  TEST_ASSERT_EQUAL(0, mkdir(missing, 0755));
+  while (sh_loop_run_once(loop, 100) > 0)
+    ;
+  TEST_ASSERT_EQUAL_STRING(second_tool, sh_path_lookup(cache, "tool"));
+  write_tool(missing_tool, 0);
+  while (sh_path_get_stats(cache).entries) TEST_ASSERT_TRUE(sh_loop_run_once(loop, 1000) > 0);
+  TEST_ASSERT_EQUAL_STRING(missing_tool, sh_path_lookup(cache, "tool"));
+  unlink(missing_tool);
+  rmdir(missing);
+  *strrchr(missing, '/') = '\0';
+  rmdir(missing);
+
+  setenv("PATH", saved, 1);
+  free(saved);
+  sh_path_cache_destroy(cache);
+  sh_loop_destroy(loop);
+  unlink(second_tool);
+  unlink(other);
+  rmdir(first);
+  rmdir(second);
+}
+
+void test_sh_path_exec_fds(void)
+{
+  struct shell sh = {0};
+  sh.paths = sh_path_cache_create_with(NULL);
+
+  // The second launch opens the binary, later ones exec the fd
+  char *argv[] = {"true", NULL};
+  for (int i = 0; i < 3; i++)
+  {
+    int status = sh_wait(&sh, sh_spawn(&sh, argv));
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL(0, WEXITSTATUS(status));
+  }
+  struct sh_path_stats stats = sh_path_get_stats(sh.paths);
+  TEST_ASSERT_EQUAL(1, stats.fd_opens);
+  TEST_ASSERT_EQUAL(2, stats.fd_launches);
+
+  int fd;
+  sh_path_lookup_fd(sh.paths, "true", &fd);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_TRUE(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+
+  // A backend the user picked is kept, and it execs the path
+  enum sh_spawn_backend picked[] = {SH_SPAWN_POSIX, SH_SPAWN_FORK};
+  for (size_t i = 0; i < sizeof(picked) / sizeof(picked[0]); i++)
+  {
+    sh.spawn = picked[i];
+    TEST_ASSERT_EQUAL(0, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, argv))));
+  }
+  sh.spawn = SH_SPAWN_AUTO;
+  TEST_ASSERT_EQUAL(2, sh_path_get_stats(sh.paths).fd_launches);
+
+  // Scripts cannot run from a close-on-exec fd and fall back to the path,
+  // and after the first failed try their fd is dropped for good
+  char dir[] = "/tmp/test-lab-pathXXXXXX";
+  char tool[64];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  snprintf(tool, sizeof(tool), "%s/tool", dir);
+  write_tool(tool, 7);
+  sh_path_add(sh.paths, "tool", tool);
+  char *script[] = {"tool", NULL};
+  for (int i = 0; i < 4; i++) TEST_ASSERT_EQUAL(7, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, script))));
+  stats = sh_path_get_stats(sh.paths);
+  TEST_ASSERT_EQUAL(2, stats.fd_launches);
+  TEST_ASSERT_EQUAL(2, stats.fd_opens);
+  sh_path_lookup_fd(sh.paths, "tool", &fd);
+  TEST_ASSERT_EQUAL(-1, fd);
+
+  // Only the most recently used commands keep their fd
+  char names[SH_EXEC_FDS][16];
+  for (int i = 0; i < SH_EXEC_FDS; i++)
+  {
+    snprintf(names[i], sizeof(names[i]), "cmd%d", i);
+    sh_path_add(sh.paths, names[i], "/bin/true");
+    sh_path_lookup_fd(sh.paths, names[i], &fd);
+    sh_path_lookup_fd(sh.paths, names[i], &fd);
+    TEST_ASSERT_TRUE(fd >= 0);
+  }
+  stats = sh_path_get_stats(sh.paths);
+  TEST_ASSERT_EQUAL(1, stats.fd_evictions);
+  TEST_ASSERT_EQUAL(2 + SH_EXEC_FDS, stats.fd_opens);
+
+  // An evicted command that is used again is opened again
+  sh_path_lookup_fd(sh.paths, "true", &fd);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL(3 + SH_EXEC_FDS, sh_path_get_stats(sh.paths).fd_opens);
+
+  sh_path_cache_destroy(sh.paths);
+  unlink(tool);
+  rmdir(dir);
+}
+
+void test_sh_forkserver(void)
+{
+  for (int with_loop = 0; with_loop < 2; with_loop++)
+  {
+    struct shell sh = {0};
+    sh.spawn = SH_SPAWN_SERVER;
+    TEST_ASSERT_EQUAL(SH_SPAWN_POSIX, sh_spawn_backend_resolve(&sh));
+    if (with_loop) sh.loop = sh_loop_create(NULL);
+    sh.server = sh_forkserver_start(NULL, sh.loop);
+    TEST_ASSERT_NOT_NULL(sh.server);
+    TEST_ASSERT_EQUAL(SH_SPAWN_SERVER, sh_spawn_backend_resolve(&sh));
+
+    // The command is the helper's child, not ours, and runs in our cwd
+    char *saved = getcwd(NULL, 0);
+    TEST_ASSERT_EQUAL(0, chdir("/tmp"));
+    char script[128];
+    snprintf(script, sizeof(script), "test $PPID -ne %d && test \"$(pwd)\" = /tmp && exit 3", (int)getpid());
+    char *argv[] = {"sh", "-c", script, NULL};
+    pid_t pid = sh_spawn(&sh, argv);
+    TEST_ASSERT_EQUAL(0, chdir(saved));
+    free(saved);
+    TEST_ASSERT_GREATER_THAN(0, pid);
+    TEST_ASSERT_EQUAL(-1, waitpid(pid, NULL, WNOHANG));
+    int status = sh_wait(&sh, pid);
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL(3, WEXITSTATUS(status));
+
+    // Exits are delivered whether they arrive before or after the watch
+    int late = -1;
+    char *quick[] = {"sh", "-c", "exit 4", NULL};
+    char *slow[] = {"sh", "-c", "sleep 0.05; exit 5", NULL};
+    pid_t first = sh_spawn(&sh, quick);
+    pid_t second = sh_spawn(&sh, slow);
+    usleep(20000);
+    TEST_ASSERT_EQUAL(4, WEXITSTATUS(sh_wait(&sh, first)));
+    if (sh.loop)
+    {
+      TEST_ASSERT_TRUE(sh_watch_child(&sh, second, record_exit, &late));
+      while (late == -1) TEST_ASSERT_TRUE(sh_loop_run_once(sh.loop, -1) >= 0);
+    }
+    else
+    {
+      late = sh_wait(&sh, second);
+    }
+    TEST_ASSERT_EQUAL(5, WEXITSTATUS(late));
+
+    // Exec errors come back from the helper
+    char *missing[] = {"no-such-command-452", NULL};
+    TEST_ASSERT_EQUAL(-1, sh_spawn(&sh, missing));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    sh_forkserver_stop(sh.server);
+    sh.server = NULL;
+    TEST_ASSERT_EQUAL(SH_SPAWN_POSIX, sh_spawn_backend_resolve(&sh));
+    sh_loop_destroy(sh.loop);
+  }
+}
+
+void test_sh_prefork(void)
+{
+  struct shell sh = {0};
+  sh.prefork = sh_prefork_create(NULL);
+  TEST_ASSERT_NOT_NULL(sh.prefork);
+
+  // Without a spare commands are spawned as usual
+  char *argv[] = {"sh", "-c", "exit 3", NULL};
+  TEST_ASSERT_EQUAL(3, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, argv))));
+  TEST_ASSERT_EQUAL(0, sh_prefork_get_stats(sh.prefork).launches);
+
+  // A spare runs one command and is used up
+  TEST_ASSERT_TRUE(sh_prefork_arm(sh.prefork));
+  TEST_ASSERT_TRUE(sh_prefork_arm(sh.prefork));
+  pid_t pid = sh_spawn(&sh, argv);
+  TEST_ASSERT_GREATER_THAN(0, pid);
+  int status = sh_wait(&sh, pid);
+  TEST_ASSERT_TRUE(WIFEXITED(status));
+  TEST_ASSERT_EQUAL(3, WEXITSTATUS(status));
+  struct sh_prefork_stats stats = sh_prefork_get_stats(sh.prefork);
+  TEST_ASSERT_EQUAL(1, stats.spares);
+  TEST_ASSERT_EQUAL(1, stats.launches);
+
+  // Exec errors come back from the spare
+  TEST_ASSERT_TRUE(sh_prefork_arm(sh.prefork));
+  char *missing[] = {"no-such-command-452", NULL};
+  TEST_ASSERT_EQUAL(-1, sh_spawn(&sh, missing));
+  TEST_ASSERT_EQUAL(ENOENT, errno);
+  TEST_ASSERT_EQUAL(2, sh_prefork_get_stats(sh.prefork).launches);
+
+  // cd throws the spare away, since it would run in the old directory
+  char *saved = getcwd(NULL, 0);
+  TEST_ASSERT_TRUE(sh_prefork_arm(sh.prefork));
+  char *cd[] = {"cd", "/tmp", NULL};
+  do_builtin(&sh, cd);
+  TEST_ASSERT_EQUAL(1, sh_prefork_get_stats(sh.prefork).discards);
+  TEST_ASSERT_TRUE(sh_prefork_arm(sh.prefork));
+  char *pwd[] = {"sh", "-c", "test \"$(pwd)\" = /tmp", NULL};
+  TEST_ASSERT_EQUAL(0, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, pwd))));
+  TEST_ASSERT_EQUAL(0, chdir(saved));
+  free(saved);
+
+  sh_prefork_destroy(sh.prefork);
+}
+
+void test_sh_jobs_table(void)
+{
+  struct sh_jobs *jobs = sh_jobs_create(NULL);
+  TEST_ASSERT_NOT_NULL(jobs);
+
+  // Far more jobs than the table starts with, keyed by made up pids
+  enum { N = 5000 };
+  char *argv[] = {"sleep", "10", NULL};
+  for (int i = 1; i <= N; i++)
+  {
+    struct sh_job *job = sh_job_add(jobs, 100000 + i, 0, argv);
+    TEST_ASSERT_NOT_NULL(job);
+    TEST_ASSERT_EQUAL(i, job->id);
+  }
+  TEST_ASSERT_EQUAL_UINT(N, sh_jobs_count(jobs));
+  TEST_ASSERT_EQUAL_STRING("sleep 10", sh_job_get(jobs, 42)->command);
+  TEST_ASSERT_EQUAL(4321, sh_job_find(jobs, 104321)->id);
+  TEST_ASSERT_NULL(sh_job_find(jobs, 99));
+  TEST_ASSERT_NULL(sh_job_get(jobs, N + 1));
+
+  // Freed ids are reused smallest first
+  sh_job_remove(jobs, sh_job_get(jobs, 300));
+  sh_job_remove(jobs, sh_job_get(jobs, 7));
+  sh_job_remove(jobs, sh_job_get(jobs, 4000));
+  TEST_ASSERT_NULL(sh_job_get(jobs, 7));
+  TEST_ASSERT_NULL(sh_job_find(jobs, 100007));
+  TEST_ASSERT_EQUAL(7, sh_job_add(jobs, 1, 0, argv)->id);
+  TEST_ASSERT_EQUAL(300, sh_job_add(jobs, 2, 0, argv)->id);
+  TEST_ASSERT_EQUAL(4000, sh_job_add(jobs, 3, 0, argv)->id);
+  TEST_ASSERT_EQUAL(N + 1, sh_job_add(jobs, 4, 0, argv)->id);
+  TEST_ASSERT_EQUAL(300, sh_job_find(jobs, 2)->id);
+
+  // Walking visits every job once, in id order
+  int last = 0;
+  size_t seen = 0;
+  for (struct sh_job *job = sh_job_next(jobs, NULL); job; job = sh_job_next(jobs, job))
+  {
+    TEST_ASSERT_GREATER_THAN(last, job->id);
+    last = job->id;
+    seen++;
+  }
+  TEST_ASSERT_EQUAL_UINT(N + 1, seen);
+
+  // Job specs
+  TEST_ASSERT_EQUAL(N + 1, sh_job_parse(jobs, "%%")->id);
+  TEST_ASSERT_EQUAL(N + 1, sh_job_parse(jobs, "%+")->id);
+  TEST_ASSERT_EQUAL(4000, sh_job_parse(jobs, "%-")->id);
+  TEST_ASSERT_EQUAL(12, sh_job_parse(jobs, "%12")->id);
+  TEST_ASSERT_EQUAL(12, sh_job_parse(jobs, "12")->id);
+  TEST_ASSERT_NULL(sh_job_parse(jobs, "%0"));
+  TEST_ASSERT_NULL(sh_job_parse(jobs, "%x"));
+
+  // An empty table starts over at 1
+  while (sh_jobs_count(jobs)) sh_job_remove(jobs, sh_job_next(jobs, NULL));
+  TEST_ASSERT_EQUAL(1, sh_job_add(jobs, 5, 0, argv)->id);
+  sh_jobs_destroy(jobs);
+}
+
+void test_sh_run_background(void)
+{
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  sh.jobs = sh_jobs_create(NULL);
+
+  char *slow[] = {"sleep", "0.2", NULL};
+  char *fail[] = {"sh", "-c", "exit 3", NULL};
+  struct sh_job *first = sh_run_background(&sh, slow);
+  TEST_ASSERT_NOT_NULL(first);
+  TEST_ASSERT_EQUAL(1, first->id);
+  TEST_ASSERT_EQUAL_STRING("sleep 0.2", first->command);
+  pid_t slow_pid = first->pid;
+  // It leads its own group, out of reach of a Ctrl-C at the terminal
+  TEST_ASSERT_EQUAL(slow_pid, first->pgid);
+  TEST_ASSERT_EQUAL(slow_pid, getpgid(slow_pid));
+  struct sh_job *second = sh_run_background(&sh, fail);
+  TEST_ASSERT_NOT_NULL(second);
+  TEST_ASSERT_EQUAL(2, second->id);
+
+  // Nothing is reported until a job is reaped by the loop
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_notify(&sh));
+  while (!second->done) sh_loop_run_once(sh.loop, -1);
+  TEST_ASSERT_EQUAL(3, WEXITSTATUS(second->status));
+  TEST_ASSERT_EQUAL_UINT(1, sh_jobs_notify(&sh));
+  TEST_ASSERT_NULL(sh_job_get(sh.jobs, 2));
+
+  // A foreground wait keeps reaping background jobs
+  char *fg[] = {"sleep", "0.3", NULL};
+  sh_wait(&sh, sh_spawn(&sh, fg));
+  TEST_ASSERT_TRUE(sh_job_find(sh.jobs, slow_pid)->done);
+  TEST_ASSERT_EQUAL_UINT(1, sh_jobs_notify(&sh));
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  // Without a loop jobs are polled when they are reported
+  sh_loop_destroy(sh.loop);
+  sh.loop = NULL;
+  char *quick[] = {"true", NULL};
+  struct sh_job *polled = sh_run_background(&sh, quick);
+  TEST_ASSERT_NOT_NULL(polled);
+  TEST_ASSERT_EQUAL(1, polled->id);
+  while (sh_jobs_notify(&sh) == 0) usleep(1000);
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  sh_jobs_destroy(sh.jobs);
+}
+
+void test_sh_run_pipeline(void)
+{
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  sh.jobs = sh_jobs_create(NULL);
+  int lowest = dup(STDIN_FILENO);
+  close(lowest);
+
+  // Every stage's status is collected, and one that cannot start leaves
+  // the next one an EOF
+  char *two[] = {"sh", "-c", "exit 2", NULL};
+  char *missing[] = {"no-such-command-here", NULL};
+  char *drain[] = {"sh", "-c", "cat >/dev/null; exit 5", NULL};
+  char **const failing[] = {two, missing, drain};
+  int statuses[3];
+  struct sh_pipeline_attr attr = SH_PIPELINE_ATTR_INIT;
+  attr.statuses = statuses;
+  TEST_ASSERT_EQUAL(5, sh_run_pipeline(&sh, failing, 3, &attr));
+  TEST_ASSERT_EQUAL(2, WEXITSTATUS(statuses[0]));
+  TEST_ASSERT_EQUAL(127, WEXITSTATUS(statuses[1]));
+  TEST_ASSERT_EQUAL(5, WEXITSTATUS(statuses[2]));
+
+  // All stages share one new process group
+  char pgrp[16];
+  snprintf(pgrp, sizeof(pgrp), "%d", (int)getpgrp());
+  char *first[] = {"sh", "-c", "cut -d' ' -f5 /proc/$$/stat", NULL};
+  char *second[] = {"sh", "-c", "read a; b=$(cut -d' ' -f5 /proc/$$/stat); test $a = $b && test $b != $1", "sh", pgrp,
+                    NULL};
+  char **const grouped[] = {first, second};
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, grouped, 2, NULL));
+
+  // A builtin stage writes into the pipe from a copy of the shell
+  char cwd[PATH_MAX];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  char *pwd[] = {"pwd", NULL};
+  char *check[] = {"sh", "-c", "read d; test \"$d\" = \"$1\"", "sh", cwd, NULL};
+  char **const builtin[] = {pwd, check};
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, builtin, 2, NULL));
+
+  // In the background the whole pipeline is one job
+  char *slow[] = {"sleep", "0.1", NULL};
+  char *four[] = {"sh", "-c", "exit 4", NULL};
+  char **const bg[] = {slow, four};
+  struct sh_pipeline_attr in_background = SH_PIPELINE_ATTR_INIT;
+  in_background.background = true;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, bg, 2, &in_background));
+  struct sh_job *job = sh_job_get(sh.jobs, 1);
+  TEST_ASSERT_NOT_NULL(job);
+  TEST_ASSERT_EQUAL_STRING("sleep 0.1 | sh -c exit 4", job->command);
+  TEST_ASSERT_TRUE(job->pgid > 0);
+  TEST_ASSERT_EQUAL_PTR(job, sh_job_find(sh.jobs, job->pgid));
+  TEST_ASSERT_EQUAL_PTR(job, sh_job_find(sh.jobs, job->pid));
+  TEST_ASSERT_EQUAL_PTR(job, sh_jobs_wait(&sh, job));
+  TEST_ASSERT_EQUAL(4, WEXITSTATUS(job->status));
+  TEST_ASSERT_EQUAL_UINT(1, sh_jobs_notify(&sh));
+
+  // No pipe end is left open in the shell
+  int fd = dup(STDIN_FILENO);
+  TEST_ASSERT_EQUAL(lowest, fd);
+  close(fd);
+
+  sh_jobs_destroy(sh.jobs);
+  sh_loop_destroy(sh.loop);
+}
+
+void test_sh_pipe_size(void)
+{
+  size_t size = 0;
+  TEST_ASSERT_TRUE(sh_pipe_size_parse("4096", &size));
+  TEST_ASSERT_EQUAL_UINT(4096, size);
+  TEST_ASSERT_TRUE(sh_pipe_size_parse("64k", &size));
+  TEST_ASSERT_EQUAL_UINT(65536, size);
+  TEST_ASSERT_TRUE(sh_pipe_size_parse("1M", &size));
+  TEST_ASSERT_EQUAL_UINT(1 << 20, size);
+  TEST_ASSERT_FALSE(sh_pipe_size_parse("0", &size));
+  TEST_ASSERT_FALSE(sh_pipe_size_parse("-1", &size));
+  TEST_ASSERT_FALSE(sh_pipe_size_parse("12x", &size));
+  TEST_ASSERT_FALSE(sh_pipe_size_parse("k", &size));
+
+  // The prefix belongs to the pipeline after it
+  struct sh_ast *ast = sh_parse("pipesize 256k yes | head -c 1; ls | wc");
+  TEST_ASSERT_NOT_NULL(ast);
+  uint32_t p = sh_ast_first(ast);
+  TEST_ASSERT_EQUAL_UINT(256 << 10, sh_ast_pipe_size(ast, p));
+  TEST_ASSERT_EQUAL_STRING("yes", sh_ast_argv(ast, sh_ast_child(ast, p))[0]);
+  TEST_ASSERT_EQUAL_UINT(0, sh_ast_pipe_size(ast, sh_ast_next(ast, p)));
+  sh_ast_free(ast);
+  TEST_ASSERT_NULL(sh_parse("pipesize 0 yes | head"));
+  TEST_ASSERT_NULL(sh_parse("pipesize 1m"));
+  TEST_ASSERT_NULL(sh_parse("pipesize 1m ; ls"));
+
+  // set -o pipesize sets the default, a prefix overrides it, and both are
+  // capped at the system limit
+  struct shell sh = {0};
+  char *on[] = {"set", "-o", "pipesize=128k", NULL};
+  char *off[] = {"set", "+o", "pipesize", NULL};
+  do_builtin(&sh, on);
+  TEST_ASSERT_EQUAL_UINT(128 << 10, sh.pipe_size);
+
+  char *yes[] = {"yes", NULL};
+  char *head[] = {"head", "-c", "100000", NULL};
+  char **const stages[] = {yes, head};
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, stages, 2, NULL));
+  TEST_ASSERT_EQUAL_UINT(128 << 10, sh.pipe_stats.last);
+  size_t max = sh_pipe_max_size();
+  TEST_ASSERT_TRUE(max > 0);
+  struct sh_pipeline_attr attr = SH_PIPELINE_ATTR_INIT;
+  attr.pipe_size = max * 4;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, stages, 2, &attr));
+  TEST_ASSERT_EQUAL_UINT(max, sh.pipe_stats.last);
+  do_builtin(&sh, off);
+  TEST_ASSERT_EQUAL_UINT(0, sh.pipe_size);
+
+  // Like every builtin, set prints to sh->out, which a redirection sets
+  sh.out = tmpfile();
+  TEST_ASSERT_NOT_NULL(sh.out);
+  char *list[] = {"set", "+o", NULL};
+  do_builtin(&sh, list);
+  char buf[64] = {0};
+  rewind(sh.out);
+  TEST_ASSERT_EQUAL_UINT(23, fread(buf, 1, sizeof(buf) - 1, sh.out));
+  TEST_ASSERT_EQUAL_STRING("set +b\nset +o pipesize\n", buf);
+  fclose(sh.out);
+  sh.out = NULL;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, stages, 2, NULL));
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(devnull);
+  TEST_ASSERT_EQUAL_UINT(3, sh.pipe_stats.pipes);
+  TEST_ASSERT_EQUAL_UINT(2, sh.pipe_stats.resized);
+}
+
+void test_sh_pipeline_threads(void)
+{
+  struct shell sh = {0};
+  char cwd[PATH_MAX];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  FILE *out = tmpfile();
+  int saved = dup(STDOUT_FILENO);
+  fflush(stdout);
+  dup2(fileno(out), STDOUT_FILENO);
+
+  // Builtins next to each other run on threads joined by a ring: no
+  // process and no pipe
+  char *pwd[] = {"pwd", NULL};
+  char *stats[] = {"stats", NULL};
+  char **const builtins[] = {pwd, stats, pwd};
+  int statuses[3];
+  struct sh_pipeline_attr attr = SH_PIPELINE_ATTR_INIT;
+  attr.statuses = statuses;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, builtins, 3, &attr));
+  TEST_ASSERT_EQUAL(0, statuses[1]);
+  TEST_ASSERT_EQUAL_UINT(0, sh.pipe_stats.pipes);
+  TEST_ASSERT_EQUAL_UINT(3, sh.pipe_stats.threads);
+  TEST_ASSERT_EQUAL_UINT(2, sh.pipe_stats.rings);
+
+  // A writer that fills a small ring nobody reads is released, with EPIPE,
+  // once the reader is done
+  for (int i = 0; i < 2000; i++) add_history("a line long enough to fill a ring of four kilobytes quickly");
+  char *history[] = {"history", NULL};
+  char **const filled[] = {history, pwd};
+  struct sh_pipeline_attr small = SH_PIPELINE_ATTR_INIT;
+  small.pipe_size = 4096;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, filled, 2, &small));
+  clear_history();
+
+  // Only the edge to an external command is a real pipe
+  char *wc[] = {"wc", "-c", NULL};
+  char **const mixed[] = {pwd, pwd, wc};
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, mixed, 3, NULL));
+  TEST_ASSERT_EQUAL_UINT(1, sh.pipe_stats.pipes);
+  TEST_ASSERT_EQUAL_UINT(7, sh.pipe_stats.threads);
+
+  // Forking every builtin gives the same output over real pipes
+  sh.fork_builtins = true;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, mixed, 3, NULL));
+  TEST_ASSERT_EQUAL_UINT(3, sh.pipe_stats.pipes);
+  TEST_ASSERT_EQUAL_UINT(7, sh.pipe_stats.threads);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  char expect[PATH_MAX + 64];
+  int len = snprintf(expect, sizeof(expect), "%s\n%s\n%zu\n%zu\n", cwd, cwd, strlen(cwd) + 1, strlen(cwd) + 1);
+  char got[PATH_MAX + 64] = {0};
+  rewind(out);
+  TEST_ASSERT_EQUAL((size_t)len, fread(got, 1, sizeof(got) - 1, out));
+  TEST_ASSERT_EQUAL_STRING(expect, got);
+  fclose(out);
+}
+
+// Read a small file into buf as a string
+static const char *read_file(const char *path, char *buf, size_t size)
+{
+  int fd = open(path, O_RDONLY);
+  TEST_ASSERT_TRUE(fd >= 0);
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  TEST_ASSERT_TRUE(n >= 0);
+  buf[n] = '\0';
+  return buf;
+}
+
+void test_sh_spawn_scripts(void)
+{
+  // A script with no #! line is run with /bin/sh, as execvp would
+  char dir[] = "/tmp/test-lab-scriptXXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char tool[64];
+  snprintf(tool, sizeof(tool), "%s/nsb", dir);
+  FILE *f = fopen(tool, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fprintf(f, "exit \"$1\"\n");
+  fclose(f);
+  TEST_ASSERT_EQUAL(0, chmod(tool, 0755));
+  char *saved = strdup(getenv("PATH"));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s:%s", dir, saved);
+  setenv("PATH", path, 1);
+
+  char *by_name[] = {"nsb", "6", NULL};
+  char *by_path[] = {tool, "7", NULL};
+  for (int backend = SH_SPAWN_AUTO; backend <= SH_SPAWN_SERVER; backend++)
+  {
+    for (int cached = 0; cached < 2; cached++)
+    {
+      struct shell sh = {0};
+      sh.spawn = (enum sh_spawn_backend)backend;
+      if (backend == SH_SPAWN_SERVER) sh.server = sh_forkserver_start(NULL, NULL);
+      // A cached command is exec'd by path, and later from an fd
+      if (cached) sh.paths = sh_path_cache_create_with(NULL);
+      for (int i = 0; i < 3; i++)
+      {
+        TEST_ASSERT_EQUAL(6, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, by_name))));
+        TEST_ASSERT_EQUAL(7, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, by_path))));
+      }
+      sh_path_cache_destroy(sh.paths);
+      sh_forkserver_stop(sh.server);
+    }
+  }
+
+  // So does a spare from the pre-fork pool
+  struct shell sh = {0};
+  sh.prefork = sh_prefork_create(NULL);
+  TEST_ASSERT_TRUE(sh_prefork_arm(sh.prefork));
+  TEST_ASSERT_EQUAL(6, WEXITSTATUS(sh_wait(&sh, sh_spawn(&sh, by_name))));
+  TEST_ASSERT_EQUAL(1, sh_prefork_get_stats(sh.prefork).launches);
+  sh_prefork_destroy(sh.prefork);
+
+  setenv("PATH", saved, 1);
+  free(saved);
+  unlink(tool);
+  rmdir(dir);
+}
+
+void test_sh_redirs(void)
+{
+  struct shell sh = {0};
+  char dir[] = "/tmp/test-lab-redirXXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char out[64], log[64], buf[PATH_MAX + 64];
+  snprintf(out, sizeof(out), "%s/out", dir);
+  snprintf(log, sizeof(log), "%s/log", dir);
+  struct stat before, after;
+  TEST_ASSERT_EQUAL(0, fstat(STDOUT_FILENO, &before));
+  const struct sh_redir end = {SH_REDIR_END, 0, NULL, 0};
+
+  // A builtin runs in the shell itself: a forked cd would change nothing
+  char cwd[PATH_MAX];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  char *cd[] = {"cd", dir, NULL};
+  const struct sh_redir to_out[] = {{SH_REDIR_OUT, 1, out, -1}, end};
+  TEST_ASSERT_TRUE(sh_run_builtin(&sh, cd, to_out));
+  TEST_ASSERT_EQUAL_STRING(dir, getcwd(buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("", read_file(out, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL(0, chdir(cwd));
+
+  // pwd gets the file as its stream, set gets it installed as stderr, and
+  // the shell's own stdio is back afterwards
+  char *pwd[] = {"pwd", NULL};
+  TEST_ASSERT_TRUE(sh_run_builtin(&sh, pwd, to_out));
+  char *bad_set[] = {"set", "-x", NULL};
+  const struct sh_redir errs_out[] = {{SH_REDIR_APPEND, 1, out, -1}, {SH_REDIR_DUP, 2, NULL, 1}, end};
+  TEST_ASSERT_TRUE(sh_run_builtin(&sh, bad_set, errs_out));
+  TEST_ASSERT_EQUAL(2, sh.status);
+  char expect[PATH_MAX + 64];
+  snprintf(expect, sizeof(expect), "%s\nset: -x: invalid option\n", cwd);
+  TEST_ASSERT_EQUAL_STRING_LEN(expect, read_file(out, buf, sizeof(buf)), strlen(expect));
+  TEST_ASSERT_EQUAL(0, fstat(STDOUT_FILENO, &after));
+  TEST_ASSERT_EQUAL(before.st_ino, after.st_ino);
+  TEST_ASSERT_FALSE(sh_run_builtin(&sh, (char *[]){"true", NULL}, to_out));
+
+  // A file that cannot be opened stops the command
+  const struct sh_redir missing[] = {{SH_REDIR_IN, 0, "/no/such/file", -1}, end};
+  TEST_ASSERT_TRUE(sh_run_builtin(&sh, cd, missing));
+  TEST_ASSERT_EQUAL(1, sh.status);
+  TEST_ASSERT_EQUAL_STRING(cwd, getcwd(buf, sizeof(buf)));
+
+  // Every backend applies them in order: 2>&1 >file keeps stderr on the
+  // stdout from before the file, here log
+  char *both[] = {"sh", "-c", "echo out; echo err >&2", NULL};
+  const struct sh_redir ordered[] = {{SH_REDIR_OUT, 1, log, -1}, {SH_REDIR_DUP, 2, NULL, 1},
+                                     {SH_REDIR_OUT, 1, out, -1}, end};
+  const enum sh_spawn_backend backends[] = {SH_SPAWN_POSIX, SH_SPAWN_VFORK, SH_SPAWN_FORK};
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+  {
+    sh.spawn = backends[i];
+    struct sh_spawn_attr attr = SH_SPAWN_ATTR_INIT;
+    attr.redirs = ordered;
+    TEST_ASSERT_EQUAL(0, WEXITSTATUS(sh_wait(&sh, sh_spawn_with_attr(&sh, both, &attr))));
+    TEST_ASSERT_EQUAL_STRING("out\n", read_file(out, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_STRING("err\n", read_file(log, buf, sizeof(buf)));
+  }
+  sh.spawn = SH_SPAWN_AUTO;
+
+  // In a pipeline they apply after the pipes, so 2>&1 goes down the pipe,
+  // and a redirected builtin is forked rather than put on a thread
+  char *err_only[] = {"sh", "-c", "echo err >&2", NULL};
+  char *count[] = {"wc", "-c", NULL};
+  char **const stages[] = {err_only, count, pwd};
+  const struct sh_redir to_pipe[] = {{SH_REDIR_DUP, 2, NULL, 1}, end};
+  const struct sh_redir to_log[] = {{SH_REDIR_OUT, 1, log, -1}, end};
+  const struct sh_redir *const redirs[] = {to_pipe, to_log, to_out};
+  struct sh_pipeline_attr attr = SH_PIPELINE_ATTR_INIT;
+  attr.redirs = redirs;
+  TEST_ASSERT_EQUAL(0, sh_run_pipeline(&sh, stages, 3, &attr));
+  TEST_ASSERT_EQUAL_STRING("4\n", read_file(log, buf, sizeof(buf)));
+  snprintf(expect, sizeof(expect), "%s\n", cwd);
+  TEST_ASSERT_EQUAL_STRING(expect, read_file(out, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_UINT(0, sh.pipe_stats.threads);
+
+  unlink(out);
+  unlink(log);
+  rmdir(dir);
+}
+
+void test_sh_job_builtins(void)
+{
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  sh.jobs = sh_jobs_create(NULL);
+
+  char *slow[] = {"sh", "-c", "sleep 0.2; exit 1", NULL};
+  char *quick[] = {"sh", "-c", "exit 2", NULL};
+  TEST_ASSERT_NOT_NULL(sh_run_background(&sh, slow));
+  TEST_ASSERT_NOT_NULL(sh_run_background(&sh, quick));
+
+  // wait -n returns the first to finish and removes it
+  char *wait_next[] = {"wait", "-n", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, wait_next));
+  TEST_ASSERT_EQUAL(2, sh.status);
+  TEST_ASSERT_NULL(sh_job_get(sh.jobs, 2));
+
+  char *wait_one[] = {"wait", "%1", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, wait_one));
+  TEST_ASSERT_EQUAL(1, sh.status);
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  // Nothing to wait for
+  TEST_ASSERT_TRUE(do_builtin(&sh, wait_next));
+  TEST_ASSERT_EQUAL(127, sh.status);
+  char *wait_pid[] = {"wait", "1", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, wait_pid));
+  TEST_ASSERT_EQUAL(127, sh.status);
+  char *fg[] = {"fg", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, fg));
+  TEST_ASSERT_EQUAL(1, sh.status);
+
+  // bg continues a stopped job and fg waits for it
+  char *stops[] = {"sh", "-c", "kill -STOP $$; exit 5", NULL};
+  struct sh_job *job = sh_run_background(&sh, stops);
+  TEST_ASSERT_NOT_NULL(job);
+  siginfo_t info;
+  TEST_ASSERT_EQUAL(0, waitid(P_PID, (id_t)job->pid, &info, WSTOPPED | WNOWAIT));
+  char *jobs[] = {"jobs", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, jobs));
+  TEST_ASSERT_TRUE(job->stopped);
+  char *bg[] = {"bg", "%1", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, bg));
+  TEST_ASSERT_FALSE(job->stopped);
+  TEST_ASSERT_TRUE(do_builtin(&sh, fg));
+  TEST_ASSERT_EQUAL(5, sh.status);
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  // A fixed fan-out: every wait -n takes one worker off the table
+  char *worker[] = {"true", NULL};
+  for (int i = 0; i < 200; i++) TEST_ASSERT_NOT_NULL(sh_run_background(&sh, worker));
+  for (int i = 0; i < 200; i++)
+  {
+    TEST_ASSERT_TRUE(do_builtin(&sh, wait_next));
+    TEST_ASSERT_EQUAL(0, sh.status);
+  }
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  sh_loop_destroy(sh.loop);
+  sh_jobs_destroy(sh.jobs);
+}
+
+static size_t notified;
+
+static void count_notify(struct shell *sh)
+{
+  notified += sh_jobs_notify(sh);
+}
+
+void test_sh_job_notify(void)
+{
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  sh.jobs = sh_jobs_create(NULL);
+  sh.job_notify = count_notify;
+  notified = 0;
+
+  // Without set -b finished jobs wait for sh_jobs_notify
+  char *quick[] = {"true", NULL};
+  struct sh_job *job = sh_run_background(&sh, quick);
+  while (!job->done) sh_loop_run_once(sh.loop, -1);
+  TEST_ASSERT_EQUAL_UINT(0, notified);
+  TEST_ASSERT_EQUAL_UINT(1, sh_jobs_notify(&sh));
+
+  // With it they are reported from the loop as they exit
+  char *set_b[] = {"set", "-b", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, set_b));
+  TEST_ASSERT_TRUE(sh.notify);
+  TEST_ASSERT_NOT_NULL(sh_run_background(&sh, quick));
+  while (notified == 0) sh_loop_run_once(sh.loop, -1);
+  TEST_ASSERT_EQUAL_UINT(1, notified);
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  // A job a builtin waits for is left to that builtin
+  TEST_ASSERT_NOT_NULL(sh_run_background(&sh, quick));
+  char *wait_one[] = {"wait", "%1", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, wait_one));
+  TEST_ASSERT_EQUAL_UINT(1, notified);
+  TEST_ASSERT_EQUAL_UINT(0, sh_jobs_count(sh.jobs));
+
+  char *set_o[] = {"set", "+o", "notify", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, set_o));
+  TEST_ASSERT_FALSE(sh.notify);
+  char *bad[] = {"set", "-x", NULL};
+  TEST_ASSERT_TRUE(do_builtin(&sh, bad));
+  TEST_ASSERT_EQUAL(2, sh.status);
+
+  sh_loop_destroy(sh.loop);
+  sh_jobs_destroy(sh.jobs);
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void test_sh_jobs_reap_storm(void)
+{
+  struct counting c = {0};
+  struct sh_allocator a = {counting_alloc, counting_free, &c};
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  sh.jobs = sh_jobs_create(&a);
+  TEST_ASSERT_TRUE(sh_jobs_watch(&sh));
+
+  // Every job prints "[n] pid", which would flood the test output
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  TEST_ASSERT_TRUE(saved >= 0 && devnull >= 0);
+  dup2(devnull, STDOUT_FILENO);
+
+  // Two rounds of 5000 children, all started before the loop runs, so the
+  // reaper wakes up to a pile of zombies
+  enum { ROUNDS = 2, JOBS = 5000 };
+  char *quick[] = {"true", NULL};
+  size_t started = 0, left[ROUNDS], live[ROUNDS];
+  double drain[ROUNDS];
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (int i = 0; i < JOBS; i++) started += sh_run_background(&sh, quick) != NULL;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sh_jobs_notify(&sh), sh_jobs_count(sh.jobs) && elapsed_since(&start) < 10)
+      sh_loop_run_once(sh.loop, 100);
+    drain[round] = elapsed_since(&start);
+    left[round] = sh_jobs_count(sh.jobs);
+    live[round] = c.allocs - c.frees;
+  }
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(devnull);
+
+  TEST_ASSERT_EQUAL_UINT(ROUNDS * JOBS, started);
+  struct sh_jobs_stats stats = sh_jobs_get_stats(sh.jobs);
+  TEST_ASSERT_EQUAL_UINT(ROUNDS * JOBS, stats.reaped);
+  // Exits are drained in bulk, not one wakeup per child
+  TEST_ASSERT_LESS_THAN_UINT(stats.reaped / 10, stats.batches);
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    TEST_ASSERT_EQUAL_UINT(0, left[round]);
+    TEST_ASSERT_TRUE(drain[round] < 5);
+  }
+  // The second round reused the first round's table
+  TEST_ASSERT_EQUAL_UINT(live[0], live[1]);
+
+  // No zombies are left behind
+  siginfo_t info;
+  info.si_pid = 0;
+  TEST_ASSERT_TRUE(waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0);
+
+  sh_jobs_destroy(sh.jobs);
+  sh_loop_destroy(sh.loop);
+}
+
+void test_sh_jobs_reap_stray_zombie(void)
+{
+  struct shell sh = {0};
+  sh.loop = sh_loop_create(NULL);
+  sh.jobs = sh_jobs_create(NULL);
+  TEST_ASSERT_TRUE(sh_jobs_watch(&sh));
+
+  // A child that is not a job exits first and is never waited for, so it
+  // is the zombie P_ALL keeps showing the reaper
+  pid_t stray = fork();
+  if (stray == 0) _exit(0);
+  TEST_ASSERT_TRUE(stray > 0);
+  siginfo_t info;
+  TEST_ASSERT_EQUAL_INT(0, waitid(P_PID, stray, &info, WEXITED | WNOWAIT));
+
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  TEST_ASSERT_TRUE(saved >= 0 && devnull >= 0);
+  dup2(devnull, STDOUT_FILENO);
+
+  char *quick[] = {"true", NULL};
+  size_t started = 0;
+  for (int i = 0; i < 3; i++) started += sh_run_background(&sh, quick) != NULL;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (sh_jobs_notify(&sh), sh_jobs_count(sh.jobs) && elapsed_since(&start) < 5)
+    sh_loop_run_once(sh.loop, 100);
+  size_t left = sh_jobs_count(sh.jobs);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+
+  TEST_ASSERT_EQUAL_UINT(3, started);
+  TEST_ASSERT_EQUAL_UINT(0, left);
+  // The stray was left for its owner
+  TEST_ASSERT_EQUAL_INT(stray, waitpid(stray, NULL, WNOHANG));
+
+  // With the stray gone, the reaper takes new jobs in batches again
+  dup2(devnull, STDOUT_FILENO);
+  size_t before = sh_jobs_get_stats(sh.jobs).reaped;
+  started = 0;
+  for (int i = 0; i < 3; i++) started += sh_run_background(&sh, quick) != NULL;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (sh_jobs_notify(&sh), sh_jobs_count(sh.jobs) && elapsed_since(&start) < 5)
+    sh_loop_run_once(sh.loop, 100);
+  left = sh_jobs_count(sh.jobs);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(devnull);
+
+  TEST_ASSERT_EQUAL_UINT(3, started);
+  TEST_ASSERT_EQUAL_UINT(0, left);
+  TEST_ASSERT_EQUAL_UINT(before + 3, sh_jobs_get_stats(sh.jobs).reaped);
+
+  sh_jobs_destroy(sh.jobs);
+  sh_loop_destroy(sh.loop);
+}
+
 void test_trim_white_no_whitespace(void)
 {
   char *line = (char *)calloc(10, sizeof(char));
@@ -123,6 +1764,84 @@ void test_trim_white_mostly_whitespace(void)
   free(line);
 }
 
+// The scalar behavior every scanner must match: strtok on " \t\n" and
+// isspace for trimming
+static char **ref_parse(const char *line, size_t *argc)
+{
+  char *copy = strdup(line);
+  char **argv = calloc(strlen(line) + 2, sizeof(char *));
+  *argc = 0;
+  for (char *tok = strtok(copy, " \t\n"); tok; tok = strtok(NULL, " \t\n"))
+  {
+    argv[(*argc)++] = strdup(tok);
+  }
+  free(copy);
+  return argv;
+}
+
+static void ref_free(char **argv, size_t argc)
+{
+  for (size_t i = 0; i < argc; i++) free(argv[i]);
+  free(argv);
+}
+
+static void ref_trim(char *line)
+{
+  char *start = line;
+  while (isspace((unsigned char)*start)) start++;
+  char *end = line + strlen(line) - 1;
+  while (end > start && isspace((unsigned char)*end)) end--;
+  *(end + 1) = '\0';
+  if (start != line) memmove(line, start, end - start + 2);
+}
+
+void test_scan_isa_parity(void)
+{
+  static const char alphabet[] = "ab-  \t\n\v\f\r";
+  enum scan_isa saved = scan_get_isa();
+
+  for (int isa = SCAN_ISA_SCALAR; isa <= SCAN_ISA_AVX2; isa++)
+  {
+    if (!scan_set_isa((enum scan_isa)isa)) continue;
+    srand(452);
+
+    for (int round = 0; round < 2000; round++)
+    {
+      // Random length and alignment so every vector boundary gets crossed
+      size_t len = rand() % 150;
+      size_t off = rand() % 64;
+      char *buf = malloc(off + len + 1);
+      char *line = buf + off;
+      for (size_t i = 0; i < len; i++) line[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+      line[len] = '\0';
+
+      size_t ref_argc;
+      char **expected = ref_parse(line, &ref_argc);
+
+      char **actual = cmd_parse(line);
+      for (size_t i = 0; i < ref_argc; i++) TEST_ASSERT_EQUAL_STRING(expected[i], actual[i]);
+      TEST_ASSERT_NULL(actual[ref_argc]);
+      cmd_free(actual);
+
+      char *copy = strdup(line);
+      char *argv[160];
+      TEST_ASSERT_EQUAL_UINT(ref_argc, cmd_tokenize(copy, argv, 160));
+      for (size_t i = 0; i < ref_argc; i++) TEST_ASSERT_EQUAL_STRING(expected[i], argv[i]);
+      TEST_ASSERT_NULL(argv[ref_argc]);
+      free(copy);
+      ref_free(expected, ref_argc);
+
+      char *want = strdup(line);
+      ref_trim(want);
+      TEST_ASSERT_EQUAL_STRING(want, trim_white(line));
+      free(want);
+      free(buf);
+    }
+  }
+
+  scan_set_isa(saved);
+}
+
 void test_get_prompt_default(void)
 {
   char *prompt = get_prompt("MY_PROMPT");
@@ -177,12 +1896,52 @@ int main(void)
   UNITY_BEGIN();
   RUN_TEST(test_cmd_parse);
   RUN_TEST(test_cmd_parse2);
+  RUN_TEST(test_cmd_tokenize);
+  RUN_TEST(test_cmd_tokenize_too_small);
+  RUN_TEST(test_cmd_lex_quotes);
+  RUN_TEST(test_cmd_lex_comment);
+  RUN_TEST(test_cmd_lex_unterminated);
+  RUN_TEST(test_sh_parse_list);
+  RUN_TEST(test_sh_parse_background);
+  RUN_TEST(test_sh_parse_pipeline);
+  RUN_TEST(test_sh_parse_redirs);
+  RUN_TEST(test_sh_parse_errors);
+  RUN_TEST(test_sh_parse_long_line);
+  RUN_TEST(test_sh_cache_hits);
+  RUN_TEST(test_sh_cache_lru);
+  RUN_TEST(test_allocator_counting);
+  RUN_TEST(test_allocator_arena);
+  RUN_TEST(test_alloc_budget_cmd_parse);
+  RUN_TEST(test_alloc_budget_sh_parse);
+  RUN_TEST(test_alloc_budget_cache);
+  RUN_TEST(test_alloc_budget_get_prompt);
+  RUN_TEST(test_cmd_parse_threads);
+  RUN_TEST(test_sh_spawn_backends);
+  RUN_TEST(test_sh_loop_children_and_timers);
+  RUN_TEST(test_sh_loop_pause_fds);
+  RUN_TEST(test_sh_path_cache);
+  RUN_TEST(test_sh_path_cache_inotify);
+  RUN_TEST(test_sh_path_exec_fds);
+  RUN_TEST(test_sh_forkserver);
+  RUN_TEST(test_sh_prefork);
+  RUN_TEST(test_sh_jobs_table);
+  RUN_TEST(test_sh_run_background);
+  RUN_TEST(test_sh_run_pipeline);
+  RUN_TEST(test_sh_pipe_size);
+  RUN_TEST(test_sh_pipeline_threads);
+  RUN_TEST(test_sh_spawn_scripts);
+  RUN_TEST(test_sh_redirs);
+  RUN_TEST(test_sh_job_builtins);
+  RUN_TEST(test_sh_job_notify);
+  RUN_TEST(test_sh_jobs_reap_storm);
+  RUN_TEST(test_sh_jobs_reap_stray_zombie);
   RUN_TEST(test_trim_white_no_whitespace);
   RUN_TEST(test_trim_white_start_whitespace);
   RUN_TEST(test_trim_white_end_whitespace);
   RUN_TEST(test_trim_white_both_whitespace_single);
   RUN_TEST(test_trim_white_both_whitespace_double);
   RUN_TEST(test_trim_white_all_whitespace);
+  RUN_TEST(test_scan_isa_parity);
   RUN_TEST(test_get_prompt_default);
   RUN_TEST(test_get_prompt_custom);
   RUN_TEST(test_ch_dir_home);